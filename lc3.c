@@ -10,177 +10,255 @@
 #include <signal.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
 
 #include <sys/time.h>
 #include <sys/types.h>
-#include <sys/termios.h>
 #include <sys/mman.h>
 
-bool running = true;
+/* Devices */
+bool lc3_map_device(lc3_vm* vm, const lc3_device* dev) {
+	if (vm->device_count == MAX_DEVICES) {
+		return false;
+	}
+	vm->devices[vm->device_count++] = *dev;
 
-/* Unix stuff */
-struct termios original_tio;
+	uint32_t loc;
+	for (loc = dev->base; loc < (uint32_t) dev->base + dev->size; loc++) {
+		vm->io_page[IO_PAGE(loc)] = 1;
+		vm->code_map[loc] |= MAP_IO;
+	}
+	return true;
+}
 
-void disable_input_buffering() {
-    tcgetattr(STDIN_FILENO, &original_tio);
-    struct termios new_tio = original_tio;
-    new_tio.c_lflag &= ~ICANON & ~ECHO;
-    tcsetattr(STDIN_FILENO, TCSANOW, &new_tio);
+static lc3_device* find_device(lc3_vm* vm, uint16_t loc) {
+	int i;
+	for (i = 0; i < vm->device_count; i++) {
+		lc3_device* dev = &vm->devices[i];
+		if (loc >= dev->base && loc - dev->base < dev->size) {
+			return dev;
+		}
+	}
+	return NULL;
 }
 
-void restore_input_buffering() {
-    tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
+static uint16_t io_read(lc3_vm* vm, uint16_t loc) {
+	lc3_device* dev = find_device(vm, loc);
+	if (dev && dev->read) {
+		return dev->read(vm, loc);
+	}
+	return vm->memory[loc];
 }
 
-void handle_interrupt(int signal) {
-    restore_input_buffering();
-    printf("\n");
-    exit(-2);
+static void io_write(lc3_vm* vm, uint16_t loc, uint16_t val) {
+	lc3_device* dev = find_device(vm, loc);
+	if (dev && dev->write) {
+		dev->write(vm, loc, val);
+	} else {
+		vm->memory[loc] = val;
+	}
 }
 
-void read_img_file(FILE* file);
-int read_image(const char* image_path);
+/* longest a guest spinning on KBSR is parked before it runs again */
+#define IDLE_WAIT_MS 100
 
-int main(int argc, char** argv) {
-	if (argc < 2) {
-		fprintf(stderr, "Need executable\n");
-		exit(EXIT_FAILURE);
-	}
+/* the instruction reading KBSR and the next one are "LDx R; BRz(p) back",
+ * a loop that changes nothing but R and the flags until a key arrives */
+static bool idle_loop(lc3_vm* vm) {
+	uint16_t pc = vm->registers[R_PC];
+	lc3_decoded load, br;
+	lc3_decode(vm->memory[(uint16_t) (pc - 1)], &load);
+	lc3_decode(vm->memory[pc], &br);
+	return (load.handler == D_LD || load.handler == D_LDI || load.handler == D_LDR) &&
+			br.handler == D_BR && (br.dst & FL_ZRO) && !(br.dst & FL_NEG) &&
+			br.imm == -2;
+}
 
-	int i;
-	for (i = 0; i < argc; i++) {
-		if (!read_image(argv[i]))  {
-			printf("failed to load image file: %s\n", argv[i]);
-			exit(EXIT_FAILURE);
+static uint16_t keyboard_read(lc3_vm* vm, uint16_t loc) {
+	if (loc == MR_KBDR) {
+		vm->stats.kbdr_reads++;
+	}
+	if (loc == MR_KBSR) {
+		vm->stats.kbsr_reads++;
+		bool ready = kbd_poll(vm);
+		if (!ready) {
+			out_flush(vm); /* the guest waits for a key */
+			if (idle_loop(vm)) {
+				/* same state as if it had spun until now */
+				ready = kbd_wait(vm, IDLE_WAIT_MS);
+			}
+		}
+		if (ready) {
+			vm->memory[MR_KBSR] = (1 << 15);
+			vm->memory[MR_KBDR] = kbd_getc(vm);
+		} else {
+			vm->memory[MR_KBSR] = 0;
 		}
 	}
+	return vm->memory[loc];
+}
 
-	signal(SIGINT, handle_interrupt);
-	disable_input_buffering();
-
-	while (running) {
-		uint16_t instr = mem_read(registers[R_PC]++);
-		uint8_t op = instr >> 12;
-		//printf("op = %X\n", op);
-		switch(op) {
-			case OP_ADD:
-				if (!lc3_add(instr)) {
-					fprintf(stderr, "Invalid add instruction: %x\n", instr);
-					exit(EXIT_FAILURE);
-				}
-				break;
-			case OP_RTI:
-				running = false;
-				break;
-			case OP_AND:
-				lc3_and(instr);
-				break;
-			case OP_NOT:
-				lc3_not(instr);
-				break;
-			case OP_BR:
-				lc3_br(instr);
-				break;
-			case OP_JMP:
-				lc3_jmp_ret(instr);
-				break;
-			case OP_JSR:
-				lc3_jsrr(instr);
-				break;
-			case OP_LEA:
-				lc3_lea(instr);
-				break;
-			case OP_LD:
-				lc3_ld(instr);
-				break;
-			case OP_LDI:
-				lc3_ldi(instr);
-				break;
-			case OP_LDR:
-				lc3_ldr(instr);
-				break;
-			case OP_ST:
-				lc3_st(instr);
-				break;
-			case OP_STR:
-				lc3_str(instr);
-				break;
-			case OP_TRAP:
-				lc3_trap(instr);
-				break;
-			default:
-				restore_input_buffering();
-				fprintf(stderr, "Invalid instruction: %x\n", instr);
-				exit(EXIT_FAILURE);
-		}
+static uint16_t display_read(lc3_vm* vm, uint16_t loc) {
+	if (loc == MR_DSR) {
+		return 1 << 15; /* always ready */
 	}
-	
-	restore_input_buffering();
+	return vm->memory[loc];
+}
 
-	return 0;
+static void display_write(lc3_vm* vm, uint16_t loc, uint16_t val) {
+	vm->memory[loc] = val;
+	if (loc == MR_DDR) {
+		out_putc(vm, (char) val);
+		out_commit(vm);
+	}
 }
 
-uint16_t swap16(uint16_t x) {
-    return (x << 8) | (x >> 8);
+static uint16_t vclock_read(lc3_vm* vm, uint16_t loc) {
+	if (loc == MR_VCLK) {
+		int i;
+		for (i = 0; i < 4; i++) {
+			vm->memory[MR_VCLK + i] = (uint16_t) (vm->retired >> (16 * i));
+		}
+	}
+	return vm->memory[loc];
 }
 
-void read_image_file(FILE* file) {
-    /* the origin tells us where in memory to place the image */
-    uint16_t origin;
-    fread(&origin, sizeof(origin), 1, file);
-    origin = swap16(origin);
+static void mcr_write(lc3_vm* vm, uint16_t loc, uint16_t val) {
+	vm->memory[loc] = val;
+	if (!(val >> 15)) {
+		vm->running = false; /* clock enable cleared */
+	}
+}
 
-    /* we know the maximum file size so we only need one fread */
-    uint16_t max_read = UINT16_T_MAX - origin;
-    uint16_t* p = memory + origin;
-    size_t read = fread(p, sizeof(uint16_t), max_read, file);
+static const lc3_device keyboard = { MR_KBSR, 4, keyboard_read, NULL };
+static const lc3_device display = { MR_DSR, 4, display_read, display_write };
+static const lc3_device vclock = { MR_VCLK, 4, vclock_read, NULL };
+static const lc3_device mcr = { MR_MCR, 1, NULL, mcr_write };
 
-    /* swap to little endian */
-    while (read-- > 0)
-    {
-        *p = swap16(*p);
-        ++p;
-    }
+/* VM context
+ * memory[] is a private mapping, of zero pages or of a shared image, so
+ * the kernel copies a page the first time the VM writes to it */
+static lc3_vm* vm_new(int image_fd) {
+	lc3_vm* vm = calloc(1, sizeof(lc3_vm));
+	if (!vm) {
+		return NULL;
+	}
+
+	vm->memory = mmap(NULL, MEMORY_SIZE * sizeof(uint16_t), PROT_READ | PROT_WRITE,
+			image_fd < 0 ? MAP_PRIVATE | MAP_ANONYMOUS : MAP_PRIVATE, image_fd, 0);
+	if (vm->memory == MAP_FAILED) {
+		vm->memory = NULL;
+	}
+	vm->decoded = calloc(MEMORY_SIZE, sizeof(lc3_decoded));
+	vm->code_map = calloc(MEMORY_SIZE, sizeof(uint8_t));
+	if (!vm->memory || !vm->decoded || !vm->code_map) {
+		lc3_vm_destroy(vm);
+		return NULL;
+	}
+
+	vm->in = stdin;
+	vm->out.fd = -1;
+	lc3_output_fd(vm, STDOUT_FILENO, isatty(STDOUT_FILENO) ? OUT_LINE : OUT_FULL);
+	vm->running = true;
+	vm->stop_at = UINT64_MAX;
+	vm->budget = UINT64_MAX;
+	clock_gettime(CLOCK_MONOTONIC, &vm->stats.start);
+	memset(vm->dirty, 1, sizeof(vm->dirty)); /* nothing checkpointed yet */
+
+	lc3_map_device(vm, &keyboard);
+	lc3_map_device(vm, &display);
+	lc3_map_device(vm, &vclock);
+	lc3_map_device(vm, &mcr);
+	vm->memory[MR_MCR] = 1 << 15;
+	return vm;
 }
 
-int read_image(const char* image_path) {
-    FILE* file = fopen(image_path, "rb");
-    if (!file) { return 0; };
-    read_image_file(file);
-    fclose(file);
-    return 1;
+lc3_vm* lc3_vm_create() {
+	return vm_new(-1);
 }
 
-/* Memory read/write */
-uint16_t check_key() {
-    fd_set readfds;
-    FD_ZERO(&readfds);
-    FD_SET(STDIN_FILENO, &readfds);
+lc3_vm* lc3_vm_create_from(const lc3_image* image) {
+	return vm_new(image->fd);
+}
+
+void lc3_vm_destroy(lc3_vm* vm) {
+	if (!vm) {
+		return;
+	}
+	if (vm->jit) {
+		jit_destroy(vm->jit);
+	}
+	if (vm->kbd) {
+		kbd_destroy(vm->kbd);
+	}
+	if (vm->profile) {
+		profile_destroy(vm->profile);
+	}
+	if (vm->trace) {
+		trace_destroy(vm->trace);
+	}
+	if (vm->replay) {
+		replay_destroy(vm->replay);
+	}
+	out_close(vm);
+	free(vm->code_map);
+	free(vm->decoded);
+	if (vm->memory) {
+		munmap(vm->memory, MEMORY_SIZE * sizeof(uint16_t));
+	}
+	free(vm);
+}
+
+/* Superinstructions
+ * With vm->fuse set, a record that starts one of the sequences below,
+ * or one of the loops of lc3_idiom.c, runs all of it in one dispatch.
+ * The words after it keep records of their own for jumps into the
+ * middle, a write to any of them or a breakpoint on one drops the fused
+ * record too. */
+#define FUSE_MAX 6 /* longest sequence, the copy loop of lc3_idiom.c */
 
-    struct timeval timeout;
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 0;
-    return select(1, &readfds, NULL, NULL, &timeout) != 0;
+static bool is_fused(uint8_t handler) {
+	return handler >= D_ADDI_BR && handler < D_COUNT;
 }
 
-uint16_t mem_read(uint16_t loc) {
-	//assert(loc > 0 && loc <= UINT16_T_MAX);
-	if (loc == MR_KBSR) {
-		if (check_key()) {
-			memory[MR_KBSR] = (1 << 15);
-			memory[MR_KBDR] = getchar();
-		} else {
-			memory[MR_KBSR] = 0;
+static void unfuse(lc3_vm* vm, uint16_t loc) {
+	int i;
+	for (i = 1; i < FUSE_MAX; i++) {
+		lc3_decoded* d = &vm->decoded[(uint16_t) (loc - i)];
+		if (is_fused(d->handler)) {
+			d->handler = D_DECODE;
 		}
 	}
+}
+
+/* Memory read/write */
+uint16_t mem_read(lc3_vm* vm, uint16_t loc) {
+	//assert(loc > 0 && loc <= UINT16_T_MAX);
+	if (vm->io_page[IO_PAGE(loc)]) {
+		return io_read(vm, loc);
+	}
 
-	return memory[loc];
+	return vm->memory[loc];
 }
 
-uint16_t mem_write(uint16_t loc, uint16_t val) {
+uint16_t mem_write(lc3_vm* vm, uint16_t loc, uint16_t val) {
 	//assert(loc > 0 && loc <= UINT16_T_MAX);
-	memory[loc] = val;
-	return memory[loc];
+	vm->dirty[DIRTY_PAGE(loc)] = 1;
+	if (vm->code_map[loc]) {
+		if (vm->code_map[loc] & MAP_IO) {
+			io_write(vm, loc, val);
+			return vm->memory[loc];
+		}
+		vm->code_map[loc] = 0;
+		vm->decoded[loc].handler = D_DECODE;
+		unfuse(vm, loc);
+		jit_invalidate(vm, loc);
+		if (vm->code_written) {
+			vm->code_written(vm, loc);
+		}
+	}
+	vm->memory[loc] = val;
+	return vm->memory[loc];
 }
 
 /* sign extend */
@@ -193,266 +271,751 @@ uint16_t sign_extend(uint16_t x, int bit_count)
 }
 
 /* Update flags */
-void update_flags(uint16_t r)
+static uint16_t flags_of(uint16_t val)
 {
-    if (registers[r] == 0)
+    if (val == 0)
     {
-        registers[R_COND] = FL_ZRO;
+        return FL_ZRO;
     }
-    else if (registers[r] >> 15) /* a 1 in the left-most bit indicates negative */
+    else if (val >> 15) /* a 1 in the left-most bit indicates negative */
     {
-        registers[R_COND] = FL_NEG;
+        return FL_NEG;
     }
     else
     {
-        registers[R_COND] = FL_POS;
+        return FL_POS;
+    }
+}
+
+#ifdef LC3_LAZY_FLAGS
+/* Lazy condition codes
+ * flag setting instructions only record their result, R_COND is brought
+ * up to date by lc3_sync_flags() when BR, RTI or a state dump needs it */
+void update_flags(lc3_vm* vm, uint16_t r)
+{
+    vm->cond_result = vm->registers[r];
+    vm->cond_pending = true;
+}
+
+void lc3_sync_flags(lc3_vm* vm)
+{
+    if (vm->cond_pending)
+    {
+        vm->registers[R_COND] = flags_of(vm->cond_result);
+        vm->cond_pending = false;
     }
 }
+#else
+void update_flags(lc3_vm* vm, uint16_t r)
+{
+    vm->registers[R_COND] = flags_of(vm->registers[r]);
+}
+
+void lc3_sync_flags(lc3_vm* vm)
+{
+}
+#endif
+
+/* Decode */
+void lc3_decode(uint16_t instr, lc3_decoded* d) {
+	d->dst = (instr >> 9) & 0x7;
+	d->src1 = (instr >> 6) & 0x7;
+	d->src2 = instr & 0x7;
+	d->imm = 0;
+
+	switch (instr >> 12) {
+		case OP_BR:
+			d->handler = D_BR;
+			d->imm = sign_extend(instr & 0x1FF, 9);
+			break;
+		case OP_ADD:
+		case OP_AND:
+			if ((instr >> 5) & 0x1) {
+				d->handler = (instr >> 12) == OP_ADD ? D_ADDI : D_ANDI;
+				d->imm = sign_extend(instr & 0x1F, 5);
+			} else {
+				d->handler = (instr >> 12) == OP_ADD ? D_ADD : D_AND;
+			}
+			break;
+		case OP_LD:
+			d->handler = D_LD;
+			d->imm = sign_extend(instr & 0x1FF, 9);
+			break;
+		case OP_ST:
+			d->handler = D_ST;
+			d->imm = sign_extend(instr & 0x1FF, 9);
+			break;
+		case OP_JSR:
+			if ((instr >> 11) & 0x1) {
+				d->handler = D_JSR;
+				d->imm = sign_extend(instr & 0x7FF, 11);
+			} else {
+				d->handler = D_JSRR;
+			}
+			break;
+		case OP_LDR:
+			d->handler = D_LDR;
+			d->imm = sign_extend(instr & 0x3F, 6);
+			break;
+		case OP_STR:
+			d->handler = D_STR;
+			d->imm = sign_extend(instr & 0x3F, 6);
+			break;
+		case OP_RTI:
+			d->handler = D_RTI;
+			break;
+		case OP_NOT:
+			d->handler = D_NOT;
+			break;
+		case OP_LDI:
+			d->handler = D_LDI;
+			d->imm = sign_extend(instr & 0x1FF, 9);
+			break;
+		case OP_STI:
+			d->handler = D_STI;
+			d->imm = sign_extend(instr & 0x1FF, 9);
+			break;
+		case OP_JMP:
+			d->handler = D_JMP;
+			break;
+		case OP_LEA:
+			d->handler = D_LEA;
+			d->imm = sign_extend(instr & 0x1FF, 9);
+			break;
+		case OP_TRAP:
+			d->handler = D_TRAP;
+			d->imm = instr & 0xFF;
+			break;
+		default:
+			d->handler = D_RES;
+			d->imm = instr;
+	}
+}
 
-/* Instructions */
-bool lc3_add(uint16_t instr) {
-	uint16_t dst_reg = (instr >> 9) & 0x7;
-	uint16_t src_reg = (instr >> 6) & 0x7;
-	uint16_t is_imm  = (instr >> 5) & 0x1;
+/* the handler of the sequence starting with d at pc, or d's own */
+static uint8_t fused_handler(lc3_vm* vm, uint16_t pc, const lc3_decoded* d) {
+	lc3_decoded seq[FUSE_MAX];
+	int n = 0;
+	seq[0] = *d;
+	while (n < FUSE_MAX - 1) {
+		uint32_t loc = pc + 1 + n;
+		if (loc >= MEMORY_SIZE || vm->io_page[IO_PAGE(loc)] ||
+				vm->decoded[loc].handler == D_BREAK) {
+			break;
+		}
+		lc3_decode(vm->memory[loc], &seq[++n]);
+	}
+	int i;
+	for (i = n + 1; i < FUSE_MAX; i++) {
+		seq[i].handler = D_DECODE;
+	}
 
-	if (is_imm) {
-		int16_t imm = sign_extend(instr & 0x1F, 5);
-		registers[dst_reg] = registers[src_reg] + imm;
+	int len = 1;
+	uint8_t fused = idiom_match(seq, n, &len);
+	uint8_t h0 = seq[0].handler;
+	uint8_t h1 = seq[1].handler;
+	int loop_len;
+	if (fused != D_DECODE) {
+		/* a whole loop */
+	} else if (n > 0 && idiom_match(seq + 1, n - 1, &loop_len) != D_DECODE) {
+		fused = h0; /* falls into a loop, which is better left whole */
+	} else if (h0 == D_ADDI && h1 == D_BR && seq[1].dst != 0) {
+		fused = D_ADDI_BR;
+		len = 2;
+	} else if (h0 == D_ANDI && h1 == D_ADDI) {
+		fused = D_ANDI_ADDI;
+		len = 2;
+	} else if (h0 == D_LEA && h1 == D_TRAP) {
+		fused = D_LEA_TRAP;
+		len = 2;
+	} else if (h0 == D_LDR && (h1 == D_ADD || h1 == D_ADDI) && seq[2].handler == D_STR) {
+		fused = h1 == D_ADD ? D_LDR_ADD_STR : D_LDR_ADDI_STR;
+		len = 3;
 	} else {
-		uint16_t src_reg2 = instr & 0x7;
-		registers[dst_reg] = ((int16_t) registers[src_reg]) + ((int16_t) registers[src_reg2]);
+		fused = h0;
 	}
 
-	update_flags(dst_reg);
+	/* the handlers read the operands of the other records, which are
+	 * still decoded on their own when a jump lands on them */
+	for (i = 1; i < len; i++) {
+		if (vm->decoded[pc + i].handler == D_DECODE) {
+			vm->decoded[pc + i] = seq[i];
+			vm->decoded[pc + i].handler = D_DECODE;
+		}
+		vm->code_map[pc + i] |= MAP_CODE;
+	}
+	return fused;
+}
 
-	return true;
+/* Handlers */
+static void decode_at(lc3_vm* vm, uint16_t pc, lc3_decoded* d) {
+	vm->code_map[pc] |= MAP_CODE;
+	lc3_decode(mem_read(vm, pc), d);
+	if (vm->fuse && !vm->io_page[IO_PAGE(pc)]) {
+		d->handler = fused_handler(vm, pc, d);
+	}
 }
 
-bool lc3_ldi(uint16_t instr) {
-	uint16_t dst_reg = (instr >> 9) & 0x7;
-	int16_t pc_offset = (int16_t) sign_extend(instr & 0x1FF, 9);
-	registers[dst_reg] = mem_read(mem_read(registers[R_PC] + pc_offset));
-	update_flags(dst_reg);
+static void d_decode(lc3_vm* vm, lc3_decoded* d) {
+	/* only reached through the cache, so d is decoded[rpc - 1] */
+	decode_at(vm, vm->registers[R_PC] - 1, d);
+	lc3_execute(vm, d);
+}
 
-	return true;
+static void d_br(lc3_vm* vm, lc3_decoded* d) {
+	lc3_sync_flags(vm);
+	if (d->dst & vm->registers[R_COND]) {
+		vm->registers[R_PC] += d->imm;
+	}
+}
+
+static void d_add(lc3_vm* vm, lc3_decoded* d) {
+	vm->registers[d->dst] = vm->registers[d->src1] + vm->registers[d->src2];
+	update_flags(vm, d->dst);
 }
 
-bool lc3_and(uint16_t instr) {
-	uint16_t dst_reg = (instr >> 9) & 0x7;
-	uint16_t src_reg = (instr >> 6) & 0x7;
-	uint16_t is_imm  = (instr >> 5) & 0x1;
+static void d_addi(lc3_vm* vm, lc3_decoded* d) {
+	vm->registers[d->dst] = vm->registers[d->src1] + d->imm;
+	update_flags(vm, d->dst);
+}
 
-	if (is_imm) {
-		int16_t imm = sign_extend(instr & 0x1F, 5);
-		registers[dst_reg] = registers[src_reg] & imm;
-	} else {
-		uint16_t src_reg2 = (instr & 0x7);
-		registers[dst_reg] = registers[src_reg] & registers[src_reg2];
+static void d_ld(lc3_vm* vm, lc3_decoded* d) {
+	vm->registers[d->dst] = mem_read(vm, vm->registers[R_PC] + d->imm);
+	update_flags(vm, d->dst);
+}
+
+static void d_st(lc3_vm* vm, lc3_decoded* d) {
+	mem_write(vm, vm->registers[R_PC] + d->imm, vm->registers[d->dst]);
+}
+
+static void d_jsr(lc3_vm* vm, lc3_decoded* d) {
+	vm->registers[R_7] = vm->registers[R_PC];
+	vm->registers[R_PC] += d->imm;
+}
+
+static void d_jsrr(lc3_vm* vm, lc3_decoded* d) {
+	vm->registers[R_7] = vm->registers[R_PC];
+	vm->registers[R_PC] = vm->registers[d->src1];
+}
+
+static void d_and(lc3_vm* vm, lc3_decoded* d) {
+	vm->registers[d->dst] = vm->registers[d->src1] & vm->registers[d->src2];
+	update_flags(vm, d->dst);
+}
+
+static void d_andi(lc3_vm* vm, lc3_decoded* d) {
+	vm->registers[d->dst] = vm->registers[d->src1] & d->imm;
+	update_flags(vm, d->dst);
+}
+
+static void d_ldr(lc3_vm* vm, lc3_decoded* d) {
+	vm->registers[d->dst] = mem_read(vm, vm->registers[d->src1] + d->imm);
+	update_flags(vm, d->dst);
+}
+
+static void d_str(lc3_vm* vm, lc3_decoded* d) {
+	mem_write(vm, vm->registers[d->src1] + d->imm, vm->registers[d->dst]);
+}
+
+static void d_rti(lc3_vm* vm, lc3_decoded* d) {
+	lc3_sync_flags(vm);
+	vm->running = false;
+}
+
+static void d_not(lc3_vm* vm, lc3_decoded* d) {
+	vm->registers[d->dst] = ~(vm->registers[d->src1]);
+	update_flags(vm, d->dst);
+}
+
+static void d_ldi(lc3_vm* vm, lc3_decoded* d) {
+	vm->registers[d->dst] = mem_read(vm, mem_read(vm, vm->registers[R_PC] + d->imm));
+	update_flags(vm, d->dst);
+}
+
+static void d_sti(lc3_vm* vm, lc3_decoded* d) {
+	mem_write(vm, mem_read(vm, vm->registers[R_PC] + d->imm), vm->registers[d->dst]);
+}
+
+static void d_jmp(lc3_vm* vm, lc3_decoded* d) {
+	vm->registers[R_PC] = vm->registers[d->src1];
+}
+
+static void d_res(lc3_vm* vm, lc3_decoded* d) {
+	if (!vm->quiet) {
+		fprintf(stderr, "Invalid instruction: %x\n", (uint16_t) d->imm);
 	}
-	update_flags(dst_reg);
+	vm->fault = LC3_BAD_INSTR;
+	vm->running = false;
+}
 
-	return true;
+static void d_lea(lc3_vm* vm, lc3_decoded* d) {
+	vm->registers[d->dst] = vm->registers[R_PC] + d->imm;
+	update_flags(vm, d->dst);
+}
+
+static void d_trap(lc3_vm* vm, lc3_decoded* d) {
+	lc3_trap(vm, 0xF000 | d->imm);
+}
+
+static void d_break(lc3_vm* vm, lc3_decoded* d) {
+	/* undo the fetch, the instruction runs when the VM is resumed */
+	vm->registers[R_PC]--;
+	vm->retired--;
+	d->handler = D_DECODE;
+	vm->running = false;
+}
+
+/* Fused handlers
+ * each runs its first instruction, then fetches and runs the others
+ * unless that would take retired past stop_at or the VM stopped */
+static bool fits(lc3_vm* vm, int len) {
+	return vm->running && vm->retired + len - 1 <= vm->stop_at;
 }
 
-bool lc3_br(uint16_t instr) {
-/*
-	uint16_t n = (instr >> 11) & 0x1;
-	uint16_t z = (instr >> 10) & 0x1;
-	uint16_t p = (instr >> 9) & 0x1;
-	int16_t pc_offset = sign_extend(instr & 0x1FF, 9);
+static lc3_decoded* fetch_next(lc3_vm* vm, lc3_decoded* d, uint8_t handler) {
+	vm->registers[R_PC]++;
+	vm->retired++;
+	vm->stats.handlers[handler]++;
+	return d + 1;
+}
 
-	if (! (n | z | p)) {
-		registers[R_PC] = registers[R_PC] + pc_offset;
-	} else if ((n & registers[R_COND]) | (z & registers[R_COND]) | (p & registers[R_COND])) {
-		registers[R_PC] = registers[R_PC] + pc_offset;
+static void d_addi_br(lc3_vm* vm, lc3_decoded* d) {
+	vm->stats.handlers[D_ADDI]++;
+	d_addi(vm, d);
+	if (fits(vm, 2)) {
+		d_br(vm, fetch_next(vm, d, D_BR));
 	}
-*/
-	uint16_t pc_offset = sign_extend((instr) & 0x1FF, 9);
-	uint16_t flag = (instr >> 9) & 0x7;
-	if (flag & registers[R_COND]) {
-		registers[R_PC] += pc_offset;
+}
+
+static void d_andi_addi(lc3_vm* vm, lc3_decoded* d) {
+	vm->stats.handlers[D_ANDI]++;
+	d_andi(vm, d);
+	if (fits(vm, 2)) {
+		d_addi(vm, fetch_next(vm, d, D_ADDI));
 	}
+}
 
-	return true;
+static void d_lea_trap(lc3_vm* vm, lc3_decoded* d) {
+	vm->stats.handlers[D_LEA]++;
+	d_lea(vm, d);
+	if (fits(vm, 2)) {
+		d_trap(vm, fetch_next(vm, d, D_TRAP));
+	}
 }
 
-bool lc3_jmp_ret(uint16_t instr) {
-	uint16_t base_reg = (instr >> 6) & 0x7;
-	registers[R_PC] = registers[base_reg];
-	return true;
+static void d_ldr_add_str(lc3_vm* vm, lc3_decoded* d) {
+	vm->stats.handlers[D_LDR]++;
+	d_ldr(vm, d);
+	if (fits(vm, 3)) {
+		d = fetch_next(vm, d, D_ADD);
+		d_add(vm, d);
+		d_str(vm, fetch_next(vm, d, D_STR));
+	}
 }
 
-bool lc3_jsrr(uint16_t instr) {
-	registers[R_7] = registers[R_PC];
-	uint16_t is_absolute = (instr >> 11) & 0x1;
-	if (is_absolute) {
-		int16_t pc_offset = sign_extend(instr & 0x7FF, 11);
-		registers[R_PC] += pc_offset;
-	} else {
-		uint16_t base_reg = (instr >> 6) & 0x7;
-		registers[R_PC] = registers[base_reg];
+static void d_ldr_addi_str(lc3_vm* vm, lc3_decoded* d) {
+	vm->stats.handlers[D_LDR]++;
+	d_ldr(vm, d);
+	if (fits(vm, 3)) {
+		d = fetch_next(vm, d, D_ADDI);
+		d_addi(vm, d);
+		d_str(vm, fetch_next(vm, d, D_STR));
 	}
-	return true;
 }
 
-bool lc3_ld(uint16_t instr) {
-	uint16_t dest_reg = (instr >> 9) & 0x7;
-	int16_t pc_offset = sign_extend(instr & 0x1FF, 9);
-	registers[dest_reg] = mem_read(registers[R_PC] + pc_offset);
-	update_flags(dest_reg);
+static void d_idiom(lc3_vm* vm, lc3_decoded* d) {
+	if (!idiom_run(vm, d)) {
+		/* the loop's first instruction, the rest follows one by one */
+		lc3_decoded first;
+		lc3_decode(vm->memory[(uint16_t) (vm->registers[R_PC] - 1)], &first);
+		lc3_execute(vm, &first);
+	}
+}
 
-	return true;
+static void (*const handlers[D_COUNT])(lc3_vm*, lc3_decoded*) = {
+	[D_DECODE] = d_decode,
+	[D_BR]     = d_br,
+	[D_ADD]    = d_add,
+	[D_ADDI]   = d_addi,
+	[D_LD]     = d_ld,
+	[D_ST]     = d_st,
+	[D_JSR]    = d_jsr,
+	[D_JSRR]   = d_jsrr,
+	[D_AND]    = d_and,
+	[D_ANDI]   = d_andi,
+	[D_LDR]    = d_ldr,
+	[D_STR]    = d_str,
+	[D_RTI]    = d_rti,
+	[D_NOT]    = d_not,
+	[D_LDI]    = d_ldi,
+	[D_STI]    = d_sti,
+	[D_JMP]    = d_jmp,
+	[D_RES]    = d_res,
+	[D_LEA]    = d_lea,
+	[D_TRAP]   = d_trap,
+	[D_BREAK]  = d_break,
+	[D_ADDI_BR]      = d_addi_br,
+	[D_ANDI_ADDI]    = d_andi_addi,
+	[D_LEA_TRAP]     = d_lea_trap,
+	[D_LDR_ADD_STR]  = d_ldr_add_str,
+	[D_LDR_ADDI_STR] = d_ldr_addi_str,
+	[D_MUL_LOOP]     = d_idiom,
+	[D_DIV_LOOP]     = d_idiom,
+	[D_COPY_LOOP]    = d_idiom,
+	[D_FILL_LOOP]    = d_idiom
+};
+
+void lc3_execute(lc3_vm* vm, lc3_decoded* d) {
+	vm->stats.handlers[d->handler]++;
+	handlers[d->handler](vm, d);
+}
+
+void lc3_set_budget(lc3_vm* vm, uint64_t n) {
+	vm->budget = n > UINT64_MAX - vm->retired ? UINT64_MAX : vm->retired + n;
+	if (vm->stop_at > vm->budget) {
+		vm->stop_at = vm->budget;
+	}
 }
 
-bool lc3_ldr(uint16_t instr) {
-	uint16_t dest_reg = (instr >> 9) & 0x7;
-	uint16_t base_reg = (instr >> 6) & 0x7;
-	int16_t offset = sign_extend(instr & 0x3F, 6);
-	registers[dest_reg] = mem_read(registers[base_reg] + offset);
-	update_flags(dest_reg);
+void lc3_check_budget(lc3_vm* vm) {
+	if (vm->running && vm->retired >= vm->budget) {
+		vm->running = false;
+		vm->fault = LC3_BUDGET;
+	}
+}
 
-	return true;
+bool lc3_step(lc3_vm* vm) {
+	if (vm->running) {
+		vm->retired++;
+		lc3_execute(vm, &vm->decoded[vm->registers[R_PC]++]);
+		lc3_sync_flags(vm);
+	}
+	return vm->running;
 }
 
-bool lc3_lea(uint16_t instr) {
-	uint16_t dest_reg = (instr >> 9) & 0x7;
-	int16_t pc_offset = sign_extend(instr & 0x1FF, 9);
-	registers[dest_reg] = registers[R_PC] + pc_offset;
-	update_flags(dest_reg);
+void lc3_break_at(lc3_vm* vm, uint16_t pc) {
+	vm->decoded[pc].handler = D_BREAK;
+	vm->code_map[pc] |= MAP_CODE;
+	unfuse(vm, pc);
+	jit_invalidate(vm, pc);
+}
 
-	return true;
+void lc3_forget_code(lc3_vm* vm) {
+	uint32_t i;
+	for (i = 0; i < MEMORY_SIZE; i++) {
+		vm->code_map[i] &= MAP_IO;
+	}
+	memset(vm->decoded, 0, MEMORY_SIZE * sizeof(lc3_decoded));
+	if (vm->jit) {
+		jit_count(vm, vm->stats.handlers);
+		jit_destroy(vm->jit);
+		vm->jit = NULL;
+	}
 }
 
-bool lc3_not(uint16_t instr) {
-	uint16_t dest_reg = (instr >> 9) & 0x7;
-	uint16_t src_reg = (instr >> 6) & 0x7;
+/* Execution engines */
+void lc3_run(lc3_vm* vm) {
+	while (vm->running && vm->retired < vm->stop_at) {
+		vm->retired++;
+		lc3_execute(vm, &vm->decoded[vm->registers[R_PC]++]);
+	}
+	lc3_sync_flags(vm);
+	lc3_check_budget(vm);
+}
+
+#if defined(__GNUC__)
+/* Direct threaded: every handler ends in its own indirect jump to the
+ * next one instead of going back through a single dispatch point, which
+ * gives the branch predictor one history per handler. */
+void lc3_run_threaded(lc3_vm* vm) {
+	static void* const labels[D_COUNT] = {
+		[D_DECODE] = &&l_decode,
+		[D_BR]     = &&l_br,
+		[D_ADD]    = &&l_add,
+		[D_ADDI]   = &&l_addi,
+		[D_LD]     = &&l_ld,
+		[D_ST]     = &&l_st,
+		[D_JSR]    = &&l_jsr,
+		[D_JSRR]   = &&l_jsrr,
+		[D_AND]    = &&l_and,
+		[D_ANDI]   = &&l_andi,
+		[D_LDR]    = &&l_ldr,
+		[D_STR]    = &&l_str,
+		[D_RTI]    = &&l_rti,
+		[D_NOT]    = &&l_not,
+		[D_LDI]    = &&l_ldi,
+		[D_STI]    = &&l_sti,
+		[D_JMP]    = &&l_jmp,
+		[D_RES]    = &&l_res,
+		[D_LEA]    = &&l_lea,
+		[D_TRAP]   = &&l_trap,
+		[D_BREAK]  = &&l_break,
+		[D_ADDI_BR]      = &&l_addi_br,
+		[D_ANDI_ADDI]    = &&l_andi_addi,
+		[D_LEA_TRAP]     = &&l_lea_trap,
+		[D_LDR_ADD_STR]  = &&l_ldr_add_str,
+		[D_LDR_ADDI_STR] = &&l_ldr_addi_str,
+		[D_MUL_LOOP]     = &&l_idiom,
+		[D_DIV_LOOP]     = &&l_idiom,
+		[D_COPY_LOOP]    = &&l_idiom,
+		[D_FILL_LOOP]    = &&l_idiom
+	};
+	lc3_decoded* d;
+
+#define DISPATCH() do { \
+		vm->retired++; \
+		d = &vm->decoded[vm->registers[R_PC]++]; \
+		vm->stats.handlers[d->handler]++; \
+		goto *labels[d->handler]; \
+	} while (0)
+
+/* jumps close every guest loop, checking stop_at there is enough */
+#define DISPATCH_JUMP() do { \
+		if (vm->retired >= vm->stop_at) { \
+			goto out; \
+		} \
+		DISPATCH(); \
+	} while (0)
+
+	if (!vm->running || vm->retired >= vm->stop_at) {
+		goto out;
+	}
+	DISPATCH();
+
+l_decode:
+	decode_at(vm, vm->registers[R_PC] - 1, d);
+	vm->stats.handlers[d->handler]++;
+	goto *labels[d->handler];
+l_br:   d_br(vm, d);   DISPATCH_JUMP();
+l_add:  d_add(vm, d);  DISPATCH();
+l_addi: d_addi(vm, d); DISPATCH();
+l_ld:   d_ld(vm, d);   DISPATCH();
+l_st:   d_st(vm, d);   goto store;
+l_jsr:  d_jsr(vm, d);  DISPATCH_JUMP();
+l_jsrr: d_jsrr(vm, d); DISPATCH_JUMP();
+l_and:  d_and(vm, d);  DISPATCH();
+l_andi: d_andi(vm, d); DISPATCH();
+l_ldr:  d_ldr(vm, d);  DISPATCH();
+l_str:  d_str(vm, d);  goto store;
+l_not:  d_not(vm, d);  DISPATCH();
+l_ldi:  d_ldi(vm, d);  DISPATCH();
+l_sti:  d_sti(vm, d);  goto store;
+l_jmp:  d_jmp(vm, d);  DISPATCH_JUMP();
+l_lea:  d_lea(vm, d);  DISPATCH();
+l_res:  d_res(vm, d);  goto out;
+l_addi_br:      d_addi_br(vm, d);      DISPATCH_JUMP();
+l_andi_addi:    d_andi_addi(vm, d);    DISPATCH();
+l_ldr_add_str:  d_ldr_add_str(vm, d);  goto store;
+l_ldr_addi_str: d_ldr_addi_str(vm, d); goto store;
+l_idiom:        d_idiom(vm, d);        goto loop;
+l_break: d_break(vm, d); goto out;
+l_rti:
+	d_rti(vm, d);
+	goto out;
+l_trap:
+	d_trap(vm, d);
+	goto trapped;
+l_lea_trap:
+	d_lea_trap(vm, d);
+trapped:
+	if (!vm->running) {
+		goto out;
+	}
+	DISPATCH();
+store:
+	/* a write to MR_MCR can stop the machine */
+	if (!vm->running) {
+		goto out;
+	}
+	DISPATCH();
+loop:
+	/* a whole loop ends on its BR, or it ran its first instruction */
+	if (!vm->running) {
+		goto out;
+	}
+	DISPATCH_JUMP();
+
+out:
+	lc3_sync_flags(vm);
+	lc3_check_budget(vm);
 
-	registers[dest_reg] = ~(registers[src_reg]);
-	update_flags(dest_reg);
+#undef DISPATCH
+#undef DISPATCH_JUMP
+}
+#else
+void lc3_run_threaded(lc3_vm* vm) {
+	lc3_run(vm);
+}
+#endif
 
+/* Instructions
+ * kept for single stepping and tests, they run the same handlers as
+ * the execution loop */
+static bool execute_instr(lc3_vm* vm, uint16_t instr) {
+	lc3_decoded d;
+	lc3_decode(instr, &d);
+	lc3_execute(vm, &d);
+	lc3_sync_flags(vm);
 	return true;
 }
 
-bool lc3_st(uint16_t instr) {
-	uint16_t src_reg = (instr >> 9) & 0x7;
-	int16_t pc_offset = sign_extend(instr & 0x1FF, 9);
-	mem_write(pc_offset + registers[R_PC], registers[src_reg]);
+bool lc3_add(lc3_vm* vm, uint16_t instr) {
+	return execute_instr(vm, instr);
+}
 
-	return true;
+bool lc3_ldi(lc3_vm* vm, uint16_t instr) {
+	return execute_instr(vm, instr);
 }
 
-bool lc3_sti(uint16_t instr) {
-	uint16_t src_reg = (instr >> 9) & 0x7;
-	int16_t pc_offset = sign_extend(instr & 0x1FF, 9);
-	mem_write(mem_read(registers[R_PC] + pc_offset), registers[src_reg]);
+bool lc3_and(lc3_vm* vm, uint16_t instr) {
+	return execute_instr(vm, instr);
+}
 
-	return true;
+bool lc3_br(lc3_vm* vm, uint16_t instr) {
+	return execute_instr(vm, instr);
+}
+
+bool lc3_jmp_ret(lc3_vm* vm, uint16_t instr) {
+	return execute_instr(vm, instr);
+}
+
+bool lc3_jsrr(lc3_vm* vm, uint16_t instr) {
+	return execute_instr(vm, instr);
 }
 
-bool lc3_str(uint16_t instr) {
-	uint16_t base_reg = (instr >> 6) & 0x7;
-	uint16_t src_reg = (instr >> 9) & 0x7;
-	int16_t offset = sign_extend(instr & 0x3F, 6);
+bool lc3_ld(lc3_vm* vm, uint16_t instr) {
+	return execute_instr(vm, instr);
+}
 
-	mem_write(registers[base_reg] + offset, registers[src_reg]);
+bool lc3_ldr(lc3_vm* vm, uint16_t instr) {
+	return execute_instr(vm, instr);
+}
 
-	return true;
+bool lc3_lea(lc3_vm* vm, uint16_t instr) {
+	return execute_instr(vm, instr);
 }
 
-static void lc3_getc() {
-	registers[R_0] = (uint16_t) getchar();
+bool lc3_not(lc3_vm* vm, uint16_t instr) {
+	return execute_instr(vm, instr);
 }
 
-static void lc3_out() {
-	putc((char) registers[R_0], stdout);
-	fflush(stdout);
+bool lc3_st(lc3_vm* vm, uint16_t instr) {
+	return execute_instr(vm, instr);
 }
 
-static void lc3_in() {
-	lc3_getc();
+bool lc3_sti(lc3_vm* vm, uint16_t instr) {
+	return execute_instr(vm, instr);
 }
 
-static void lc3_putsp() {
-	uint16_t* c = memory + registers[R_0];
+bool lc3_str(lc3_vm* vm, uint16_t instr) {
+	return execute_instr(vm, instr);
+}
+
+static void lc3_getc(lc3_vm* vm) {
+	out_flush(vm);
+	vm->registers[R_0] = kbd_getc(vm);
+}
+
+static void lc3_out(lc3_vm* vm) {
+	out_putc(vm, (char) vm->registers[R_0]);
+	out_commit(vm);
+}
+
+static void lc3_in(lc3_vm* vm) {
+	lc3_getc(vm);
+}
+
+static void lc3_putsp(lc3_vm* vm) {
+	uint16_t* c = vm->memory + vm->registers[R_0];
 	while (*c) {
 		char c1 = (*c) & 0xFF;
-		putc(c1, stdout);
+		out_putc(vm, c1);
 
 		char c2 = (*c) >> 8;
 		if (c2) {
-			putc(c2, stdout);
+			out_putc(vm, c2);
 		}
-
-		fflush(stdout);
+		++c;
 	}
+
+	out_commit(vm);
 }
 
-static void lc3_halt() {
-	running = false;
+static void lc3_halt(lc3_vm* vm) {
+	out_flush(vm);
+	vm->running = false;
 }
 
-static void lc3_puts() {
+static void lc3_puts(lc3_vm* vm) {
 	//printf("lc3_puts\n");
-	uint16_t* c = memory + registers[R_0];
+	uint16_t* c = vm->memory + vm->registers[R_0];
 	while (*c) {
-		putc((char)*c, stdout);
+		out_putc(vm, (char)*c);
 		++c;
 	}
 
-	fflush(stdout);
+	out_commit(vm);
 }
 
-bool lc3_trap(uint16_t instr) {
+bool lc3_trap(lc3_vm* vm, uint16_t instr) {
+	vm->stats.traps[instr & 0xFF]++;
 	switch (instr & 0xFF) {
 		case TRAP_GETC:
-			lc3_getc();
+			lc3_getc(vm);
 			break;
 		case TRAP_OUT:
-			lc3_out();
+			lc3_out(vm);
 			break;
 		case TRAP_PUTS:
-			lc3_puts();
+			lc3_puts(vm);
 			break;
 		case TRAP_IN:
-			lc3_in();
+			lc3_in(vm);
 			break;
 		case TRAP_PUTSP:
-			lc3_putsp();
+			lc3_putsp(vm);
 			break;
 		case TRAP_HALT:
-			lc3_halt();
+			lc3_halt(vm);
 			break;
 		default:
-			printf("Invalid trap code: 0x%X\n", instr & 0xFF);
-			exit(EXIT_FAILURE);
+			if (!vm->quiet) {
+				printf("Invalid trap code: 0x%X\n", instr & 0xFF);
+			}
+			vm->fault = LC3_BAD_TRAP;
+			vm->running = false;
 	}
 
 	return true;
 }
 
 /* Utility */
-void dump_registers() {
+void dump_registers(lc3_vm* vm) {
+	lc3_sync_flags(vm);
 	int i;
 	for (i = 0; i <= 7; i++) {
-		printf("r%d\t0x%X\n", i, registers[i]);
+		printf("r%d\t0x%X\n", i, vm->registers[i]);
 	}
 
-	printf("rpc\t0x%X\n", registers[R_PC]);
-	printf("rcond\t0x%X\n", registers[R_COND]);
+	printf("rpc\t0x%X\n", vm->registers[R_PC]);
+	printf("rcond\t0x%X\n", vm->registers[R_COND]);
 }
 
-void zero_registers() {
+void zero_registers(lc3_vm* vm) {
 	printf("Zero-ing registers\n");
 	uint16_t i;
 	for (i = 0; i < R_COUNT; i++) {
-		registers[i] = 0;
+		vm->registers[i] = 0;
 	}
+	vm->cond_pending = false;
 }
 
-void zero_memory() {
+void zero_memory(lc3_vm* vm) {
 	printf("Zero-ing memory\n");
-	uint16_t i = 0;
-	for (i = 0; i < UINT16_T_MAX; i++) {
-		memory[i] = 0;
+	uint32_t i;
+	for (i = 0; i < MEMORY_SIZE; i++) {
+		if (!(vm->code_map[i] & MAP_IO)) {
+			mem_write(vm, i, 0);
+		}
 	}
 }
@@ -13,9 +13,12 @@ typedef unsigned char uint8_t;
 
 #include <assert.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
 
 /* Memory */
-uint16_t memory[UINT16_T_MAX];
+#define MEMORY_SIZE (UINT16_T_MAX + 1)
 
 /* Registers 
  * R0 - R7 General purpose
@@ -34,7 +37,6 @@ enum {
 	R_COUNT //not actually a register
 };
 
-uint16_t registers[R_COUNT];
 
 /* Instructions */
 enum
@@ -78,33 +80,438 @@ enum
 /* memory mapped registers */
 enum {
     MR_KBSR = 0xFE00, /* keyboard status */
-    MR_KBDR = 0xFE02  /* keyboard data */
+    MR_KBDR = 0xFE02, /* keyboard data */
+    MR_DSR = 0xFE04,  /* display status */
+    MR_DDR = 0xFE06,  /* display data */
+    MR_VCLK = 0xFE08, /* virtual clock, 4 words, not part of the LC-3 spec */
+    MR_MCR = 0xFFFE   /* machine control */
 };
 
+/* Pre-decoded instructions
+ * Each guest word is decoded once into a compact record that the
+ * execution loop runs directly. mem_write() drops the record of the
+ * address it writes so self-modifying code is decoded again. */
+enum {
+	D_DECODE = 0, /* not decoded yet, must stay 0 */
+	D_BR,
+	D_ADD,
+	D_ADDI,
+	D_LD,
+	D_ST,
+	D_JSR,
+	D_JSRR,
+	D_AND,
+	D_ANDI,
+	D_LDR,
+	D_STR,
+	D_RTI,
+	D_NOT,
+	D_LDI,
+	D_STI,
+	D_JMP,
+	D_RES,
+	D_LEA,
+	D_TRAP,
+	D_BREAK,  /* set by lc3_break_at(), never decoded */
+	/* superinstructions, only decoded with vm->fuse set */
+	D_ADDI_BR,
+	D_ANDI_ADDI,
+	D_LEA_TRAP,
+	D_LDR_ADD_STR,
+	D_LDR_ADDI_STR,
+	D_MUL_LOOP,  /* whole loops, see lc3_idiom.c */
+	D_DIV_LOOP,
+	D_COPY_LOOP,
+	D_FILL_LOOP,
+	D_COUNT //not actually a handler
+};
+
+typedef struct {
+	uint8_t handler; /* D_* */
+	uint8_t dst;     /* dst reg, src reg of stores, nzp of BR */
+	uint8_t src1;    /* src or base reg */
+	uint8_t src2;    /* second src reg */
+	int16_t imm;     /* sign extended imm/offset, trap vector, raw bad instr */
+} lc3_decoded;
+
+/* Faults that stop a VM */
+enum {
+	LC3_OK = 0,
+	LC3_BAD_INSTR, /* reserved opcode */
+	LC3_BAD_TRAP,  /* unknown trap vector */
+	LC3_BUDGET,    /* ran out of its instruction budget */
+	LC3_DIVERGED   /* did not follow the input it replays */
+};
+
+typedef struct lc3_fuzzer lc3_fuzzer;
+typedef struct lc3_jit lc3_jit;
+typedef struct lc3_kbd lc3_kbd;
+typedef struct lc3_profile lc3_profile;
+typedef struct lc3_trace lc3_trace;
+typedef struct lc3_replay lc3_replay;
+typedef struct lc3_vm lc3_vm;
+
+/* code_map bits */
+enum {
+	MAP_CODE = 1 << 0, /* decoded or translated */
+	MAP_IO = 1 << 1    /* device register, writes go to the device */
+};
+
+/* Devices
+ * memory is split into 256 pages of 256 words. Reads from a page with
+ * io_page set go through the devices mapped in it, every other read is a
+ * plain array access. Device registers are also flagged MAP_IO in
+ * code_map so writes take the one slow path mem_write() already has.
+ * A NULL read/write handler means the register is backed by memory[]. */
+#define IO_PAGES 256
+#define IO_PAGE(loc) ((loc) >> 8)
+#define MAX_DEVICES 8
+
+typedef struct {
+	uint16_t base;
+	uint16_t size; /* words */
+	uint16_t (*read)(lc3_vm* vm, uint16_t loc);
+	void (*write)(lc3_vm* vm, uint16_t loc, uint16_t val);
+} lc3_device;
+
+/* Dirty pages
+ * mem_write() and the JIT flag the 512 word page of every store, one
+ * byte per page so a translated store marks it with a single mov */
+#define DIRTY_PAGE_WORDS 512
+#define DIRTY_PAGES (MEMORY_SIZE / DIRTY_PAGE_WORDS)
+#define DIRTY_PAGE(loc) ((loc) >> 9)
+
+/* Console output
+ * OUT_UNBUFFERED: written after every trap or DDR store
+ * OUT_LINE: written once a newline was output
+ * OUT_FULL: written when the buffer fills
+ * all policies also write before the guest waits for a key and on HALT */
+enum {
+	OUT_UNBUFFERED = 0,
+	OUT_LINE,
+	OUT_FULL
+};
+
+#define OUT_BUF_SIZE 4096
+
+typedef struct {
+	int policy;          /* OUT_* */
+	int fd;              /* -1: collect in mem */
+	bool newline;        /* buf holds a newline */
+	size_t used;
+	char buf[OUT_BUF_SIZE];
+	char* mem;           /* everything flushed so far, fd -1 only */
+	size_t mem_len;
+	size_t mem_cap;
+} lc3_output;
+
+/* Keyboard input from memory
+ * set by lc3_input_mem(), the keyboard reads data instead of vm->in. A
+ * key is always ready, once data is used up every key is EOF. */
+typedef struct {
+	const uint8_t* data; /* NULL: read vm->in */
+	size_t len;
+	size_t pos;
+	uint64_t first_use;  /* vm->retired at the first poll or key, 0: none yet */
+} lc3_input;
+
+/* Stats
+ * event counters every engine keeps, each costs an increment where the
+ * event happens. Instructions are counted per D_* handler, D_DECODE
+ * counts the records decoded. lc3_stats_json() folds them into OP_*. */
+typedef struct {
+	uint64_t handlers[D_COUNT];
+	uint64_t kbsr_reads;
+	uint64_t kbdr_reads;
+	uint64_t traps[256];     /* per vector */
+	uint64_t flushes;        /* out_flush() calls that had output */
+	uint64_t writes;         /* write() calls for output */
+	struct timespec start;   /* CLOCK_MONOTONIC at lc3_vm_create() */
+} lc3_stats;
+
+/* VM context
+ * everything a guest can see or change, so any number of VMs can run in
+ * one process as long as each is only used by one thread at a time */
+struct lc3_vm {
+	uint16_t registers[R_COUNT]; /* must stay first, see lc3_jit.c */
+	bool running;
+	int fault;                 /* LC3_OK or what stopped the VM */
+	bool quiet;                /* faults are not reported on the console */
+	/* decode common sequences into one record, for engines that run
+	 * records and do not look at every instruction */
+	bool fuse;
+	uint64_t retired;          /* instructions run by the engines */
+	/* engines return once retired reaches it, the threaded engine and
+	 * the JIT only look at it on jumps so they may run a little over */
+	uint64_t stop_at;
+	uint64_t budget;           /* stop_at never goes past it */
+	FILE* in;                  /* keyboard, stdin by default */
+	lc3_input in_mem;          /* read instead of in when set */
+	lc3_output out;            /* console, stdout by default */
+	uint16_t* memory;          /* MEMORY_SIZE words */
+	lc3_decoded* decoded;      /* MEMORY_SIZE records */
+	/* nonzero for words that have a decoded record or are covered by a
+	 * translated block, mem_write() to them drops the cached copies */
+	uint8_t* code_map;         /* MAP_* bits */
+	uint16_t cond_result;      /* LC3_LAZY_FLAGS only */
+	bool cond_pending;
+	lc3_jit* jit;              /* created by the first lc3_run_jit() */
+	/* called by mem_write() after it dropped the cached copies of loc,
+	 * for code translated outside the VM such as lc3_aot() output */
+	void (*code_written)(lc3_vm* vm, uint16_t loc);
+	lc3_kbd* kbd;              /* created by the first keyboard access */
+	lc3_profile* profile;      /* created by lc3_run_profiled() */
+	lc3_trace* trace;          /* set by lc3_trace_start() */
+	lc3_replay* replay;        /* set by lc3_record_input()/lc3_replay_input() */
+	uint8_t io_page[IO_PAGES]; /* nonzero: page holds device registers */
+	lc3_device devices[MAX_DEVICES];
+	int device_count;
+	uint8_t dirty[DIRTY_PAGES];    /* written since the last checkpoint */
+	lc3_stats stats;
+};
+
+/* Shared images
+ * the memory[] of a set of loaded images kept in a sealed memfd. VMs
+ * created from one map it copy-on-write, they share every page they
+ * never write to and creating one copies nothing */
+typedef struct {
+	int fd;
+} lc3_image;
+
+lc3_image* lc3_image_load(char* const* paths, int count);
+void lc3_image_free(lc3_image* image);
+
+/* a new VM has the keyboard, display, virtual clock and machine control
+ * devices. Reading MR_VCLK latches the retired instruction count into
+ * MR_VCLK..MR_VCLK + 3, least significant word first, so guests can time
+ * themselves the same way on every run and engine. */
+lc3_vm* lc3_vm_create();
+lc3_vm* lc3_vm_create_from(const lc3_image* image);
+void lc3_vm_destroy(lc3_vm* vm);
+
+/* map dev's registers, before the VM runs, false if out of slots */
+bool lc3_map_device(lc3_vm* vm, const lc3_device* dev);
+
+void lc3_decode(uint16_t instr, lc3_decoded* d);
+void lc3_execute(lc3_vm* vm, lc3_decoded* d);
+
+/* Instruction budget
+ * the VM may retire n more instructions. An engine that stops at the
+ * budget faults the VM with LC3_BUDGET, at the same instruction on every
+ * run with that engine. Engines call lc3_check_budget() on their way out. */
+void lc3_set_budget(lc3_vm* vm, uint64_t n);
+void lc3_check_budget(lc3_vm* vm);
+
+/* runs one instruction, returns false once the VM stopped */
+bool lc3_step(lc3_vm* vm);
+
+/* stop the VM the first time it reaches pc, before running that
+ * instruction. The breakpoint is gone once hit or if the word is written */
+void lc3_break_at(lc3_vm* vm, uint16_t pc);
+
+/* drops every decoded record and translated block, for when memory[]
+ * was replaced behind mem_write()'s back */
+void lc3_forget_code(lc3_vm* vm);
+
+/* Execution engines, all run until the guest halts
+ * lc3_run: portable loop through a handler table
+ * lc3_run_threaded: computed goto between handlers (GCC/clang)
+ * lc3_run_jit: hot basic blocks translated to x86-64, falls back to
+ *              lc3_run() on other hosts */
+void lc3_run(lc3_vm* vm);
+void lc3_run_threaded(lc3_vm* vm);
+void lc3_run_jit(lc3_vm* vm);
+
+/* Lockstep engine (lc3_lockstep.c)
+ * runs count VMs, in groups of LOCKSTEP_LANES whose registers are vectors
+ * across the group, until all of them halt. Lanes at the same pc share
+ * one vector step (AVX2 where the host has it), loads, stores and traps
+ * run per VM. Does not bump vm->stats. */
+#define LOCKSTEP_LANES 16
+void lc3_run_lockstep(lc3_vm** vms, int count);
+
+/* lc3_jit.c
+ * jit_count: add the instructions blocks ran to handlers, translated
+ *            code leaves them out of vm->stats until it is dropped */
+void jit_invalidate(lc3_vm* vm, uint16_t loc);
+void jit_count(lc3_vm* vm, uint64_t* handlers);
+void jit_destroy(lc3_jit* jit);
+
+/* lc3_kbd.c
+ * kbd_poll: a key is waiting, never blocks
+ * kbd_wait: kbd_poll that waits up to timeout_ms for a key
+ * kbd_getc: next key, waits for one, EOF once the input ended
+ * kbd_syscalls: poll() and read() calls the reader thread made so far
+ * lc3_input_mem: the keyboard reads len bytes at data from now on, data
+ *                has to stay valid while the VM runs. NULL goes back to
+ *                vm->in. */
+void lc3_input_mem(lc3_vm* vm, const uint8_t* data, size_t len);
+bool kbd_poll(lc3_vm* vm);
+bool kbd_wait(lc3_vm* vm, int timeout_ms);
+uint16_t kbd_getc(lc3_vm* vm);
+uint64_t kbd_syscalls(lc3_vm* vm);
+void kbd_destroy(lc3_kbd* kbd);
+
+/* lc3_out.c
+ * lc3_output_fd/lc3_output_mem: flush and switch where output goes
+ * out_commit: end of one guest write, flushes as the policy says
+ * out_close: flush and free the mem buffer */
+void lc3_output_fd(lc3_vm* vm, int fd, int policy);
+void lc3_output_mem(lc3_vm* vm);
+void out_putc(lc3_vm* vm, char c);
+void out_commit(lc3_vm* vm);
+void out_flush(lc3_vm* vm);
+void out_close(lc3_vm* vm);
+
+/* Exact profiler (lc3_profile.c)
+ * lc3_run_profiled: lc3_run() counting every pc, BR outcome and the
+ *                   instructions of each call path
+ * lc3_profile_report: hot instructions, loops, branches and functions
+ * lc3_profile_folded: one "caller;callee count" line per call path, for
+ *                     flamegraph.pl */
+void lc3_run_profiled(lc3_vm* vm);
+bool lc3_profile_report(lc3_vm* vm, FILE* out);
+bool lc3_profile_folded(lc3_vm* vm, FILE* out);
+void profile_destroy(lc3_profile* profile);
+
+/* Input record/replay (lc3_replay.c)
+ * lc3_record_input: log every key and every poll that found one, with
+ *                   the instruction count it happened at
+ * lc3_replay_input: feed the guest such a log instead of the keyboard,
+ *                   a guest that strays from it stops with LC3_DIVERGED
+ * the rest is for lc3_kbd.c */
+bool lc3_record_input(lc3_vm* vm, const char* path);
+bool lc3_replay_input(lc3_vm* vm, const char* path);
+bool replaying(lc3_vm* vm);
+bool replay_ready(lc3_vm* vm);
+uint16_t replay_getc(lc3_vm* vm);
+void record_ready(lc3_vm* vm);
+void record_key(lc3_vm* vm, uint16_t c);
+void replay_destroy(lc3_replay* replay);
+
+/* Execution traces (lc3_trace.c)
+ * lc3_trace_start: write a trace of vm to path from now on
+ * lc3_run_traced: lc3_run() recording the pc, instruction word, changed
+ *                 registers and stored word of every instruction
+ * lc3_trace_stop: write what is still buffered and close the file
+ * lc3_trace_dump: one text line per instruction of a trace file */
+bool lc3_trace_start(lc3_vm* vm, const char* path);
+void lc3_run_traced(lc3_vm* vm);
+bool lc3_trace_stop(lc3_vm* vm);
+bool lc3_trace_dump(FILE* in, FILE* out);
+void trace_destroy(lc3_trace* trace);
+
+/* Sampling profiler (lc3_sample.c)
+ * samples R_PC and R7 of vm hz times per second of CPU time, for any
+ * engine, lc3_sampler_report prints where the samples fell */
+bool lc3_sampler_start(lc3_vm* vm, int hz);
+void lc3_sampler_stop();
+bool lc3_sampler_report(FILE* out);
+
+/* Stats (lc3_stats.c)
+ * lc3_stats_json: one line of JSON with every counter and the wall time
+ * lc3_stats_on_signal: a thread writes lc3_stats_json(vm, out) each time
+ *                      the process gets sig, until lc3_stats_stop_signal().
+ *                      Call it before any other thread starts, sig has to
+ *                      be blocked in all of them. */
+void lc3_stats_json(lc3_vm* vm, FILE* out);
+bool lc3_stats_on_signal(lc3_vm* vm, int sig, FILE* out);
+void lc3_stats_stop_signal();
+
+/* Snapshots (lc3_snapshot.c)
+ * registers, running, fault, retired and memory[], which also holds the
+ * device registers. Restoring maps the file copy-on-write as memory[]
+ * and drops everything decoded or translated. */
+bool lc3_snapshot_save(lc3_vm* vm, const char* path);
+bool lc3_snapshot_restore(lc3_vm* vm, const char* path);
+
+/* Checkpoints (lc3_checkpoint.c)
+ * lc3_checkpoint: append the registers and the dirty pages to log
+ * lc3_rollback: rebuild the VM as of checkpoint seq (-1: the last one
+ *               that was completely written), returns its seq or -1
+ * lc3_run_checkpointed: run, appending a checkpoint every interval
+ *                       instructions and when the guest stops */
+bool lc3_checkpoint(lc3_vm* vm, FILE* log);
+long lc3_rollback(lc3_vm* vm, const char* path, long seq);
+void lc3_run_checkpointed(lc3_vm* vm, void (*run)(lc3_vm*), FILE* log, uint64_t interval);
+
+/* Batch runner (lc3_batch.c)
+ * runs every job of a manifest on worker threads and prints a report,
+ * returns the number of failed jobs or -1 if the manifest is unusable.
+ * A job that runs more than budget instructions fails. With lockstep
+ * jobs sharing their images run in groups through lc3_run_lockstep()
+ * and run is not used. */
+int lc3_batch(const char* manifest, int threads, void (*run)(lc3_vm*), bool lockstep, uint64_t budget);
+
+/* Fuzzer (lc3_fuzz.c)
+ * runs the guest in the images on generated keyboard input, execs cases
+ * or forever if 0, each case stopping after budget instructions
+ * (UINT64_MAX: a default). Inputs that reach new edges are kept in
+ * dir/queue, which may hold seeds, those that fault in dir/crashes and
+ * those that run out of budget in dir/hangs. Returns the number of
+ * crashes and hangs found, -1 if fuzzing could not start. */
+int lc3_fuzz(char* const* paths, int count, const char* dir, uint64_t budget, uint64_t execs);
+
+/* lc3_fuzzer_create: the guest run up to the instruction before its first
+ *                    keyboard access, NULL if it never gets there
+ * lc3_fuzz_case: one case from that point on data, returns the VM as the
+ *                case left it, valid until the next case */
+lc3_fuzzer* lc3_fuzzer_create(char* const* paths, int count, uint64_t budget);
+lc3_vm* lc3_fuzz_case(lc3_fuzzer* f, const uint8_t* data, size_t len);
+void lc3_fuzzer_destroy(lc3_fuzzer* f);
+
+/* Loop idioms (lc3_idiom.c)
+ * idiom_match: the D_*_LOOP of the loop whose records are loop[0..n] and
+ *              its length in words, D_DECODE if they are not one
+ * idiom_run: runs the whole loop whose record d was just fetched, false
+ *            if it has to run one instruction at a time */
+uint8_t idiom_match(const lc3_decoded* loop, int n, int* len);
+bool idiom_run(lc3_vm* vm, lc3_decoded* d);
+
+/* Ahead-of-time translation (lc3_aot.c)
+ * writes a C program to out that runs the code reachable from the pc of
+ * vm as native blocks, on the memory vm holds now. Built with lc3.h and
+ * the core files it is a standalone LC-3 machine for that image. */
+bool lc3_aot(lc3_vm* vm, FILE* out);
+
+/* Image loading (lc3_image.c)
+ * lc3_load_images maps every image first, reports each pair of images
+ * that overlap and only loads them if none do */
+void read_image_file(lc3_vm* vm, FILE* file);
+int read_image(lc3_vm* vm, const char* image_path);
+bool lc3_load_images(lc3_vm* vm, char* const* paths, int count);
+
 /* Memory read/write */
-uint16_t mem_read(uint16_t loc);
+uint16_t mem_read(lc3_vm* vm, uint16_t loc);
 
-uint16_t mem_write(uint16_t loc, uint16_t val);
+uint16_t mem_write(lc3_vm* vm, uint16_t loc, uint16_t val);
 
 /* Instructions */
-bool lc3_add(uint16_t instr);
-bool lc3_ldi(uint16_t instr);
-bool lc3_and(uint16_t instr);
-bool lc3_br(uint16_t instr);
-bool lc3_jmp_ret(uint16_t instr);
-bool lc3_jsrr(uint16_t instr);
-bool lc3_ld(uint16_t instr);
-bool lc3_ldr(uint16_t isntr);
-bool lc3_lea(uint16_t instr);
-bool lc3_not(uint16_t instr);
-bool lc3_st(uint16_t instr);
-bool lc3_sti(uint16_t instr);
-bool lc3_str(uint16_t instr);
-bool lc3_trap(uint16_t instr);
+bool lc3_add(lc3_vm* vm, uint16_t instr);
+bool lc3_ldi(lc3_vm* vm, uint16_t instr);
+bool lc3_and(lc3_vm* vm, uint16_t instr);
+bool lc3_br(lc3_vm* vm, uint16_t instr);
+bool lc3_jmp_ret(lc3_vm* vm, uint16_t instr);
+bool lc3_jsrr(lc3_vm* vm, uint16_t instr);
+bool lc3_ld(lc3_vm* vm, uint16_t instr);
+bool lc3_ldr(lc3_vm* vm, uint16_t isntr);
+bool lc3_lea(lc3_vm* vm, uint16_t instr);
+bool lc3_not(lc3_vm* vm, uint16_t instr);
+bool lc3_st(lc3_vm* vm, uint16_t instr);
+bool lc3_sti(lc3_vm* vm, uint16_t instr);
+bool lc3_str(lc3_vm* vm, uint16_t instr);
+bool lc3_trap(lc3_vm* vm, uint16_t instr);
+
+/* Condition codes
+ * built with LC3_LAZY_FLAGS, flag setting instructions only record their
+ * result and R_COND is computed when it is read. lc3_sync_flags() brings
+ * R_COND up to date, the engines call it before returning. */
+void update_flags(lc3_vm* vm, uint16_t r);
+void lc3_sync_flags(lc3_vm* vm);
 
 /* utilitly */
-void dump_registers();
-void zero_registers();
-void zero_memory();
+void dump_registers(lc3_vm* vm);
+void zero_registers(lc3_vm* vm);
+void zero_memory(lc3_vm* vm);
 
 #endif
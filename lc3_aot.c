@@ -0,0 +1,501 @@
+#include "lc3.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Ahead-of-time translation
+ * Finds the code of a loaded VM by following every path from its pc:
+ * branch and JSR targets, the words after conditional branches and the
+ * return sites after JSR/JSRR start basic blocks. HALT, RTI, reserved
+ * opcodes, JMP and device pages end the walk, so data after them is
+ * left alone. Each block becomes a label in one C function that keeps
+ * the guest registers in locals and goes from block to block with goto.
+ * JMP, JSRR and RET go through a switch over every block start, and a
+ * pc that is not one (a computed target the walk did not see, or the
+ * middle of a block) is run one instruction at a time by lc3_step()
+ * until it reaches one again.
+ * Traps, device registers and stores into code go through lc3_trap(),
+ * mem_read() and mem_write() as in the engines. Every translated word is
+ * flagged MAP_CODE, so a store to one, from translated code or from
+ * lc3_step(), reaches mem_write() and its code_written hook, which marks
+ * the block stale. A stale block is never entered again, the
+ * interpreter runs that code from memory instead.
+ * Devices are assumed to be where lc3_vm_create() maps them, loads from
+ * constant addresses in other pages read memory[] directly. */
+
+enum {
+	W_CODE = 1 << 0,  /* reached by the walk */
+	W_START = 1 << 1  /* starts a block */
+};
+
+typedef struct {
+	uint16_t start;
+	uint16_t last;    /* inclusive */
+	uint32_t count;   /* instructions */
+} aot_block;
+
+static bool is_halt(uint16_t word) {
+	return word == (0xF000 | TRAP_HALT);
+}
+
+/* nothing falls through it */
+static bool ends_walk(const lc3_decoded* d, uint16_t word) {
+	switch (d->handler) {
+		case D_BR:
+			return d->dst == (FL_NEG | FL_ZRO | FL_POS);
+		case D_JMP:
+		case D_JSR:
+		case D_JSRR:
+		case D_RTI:
+		case D_RES:
+			return true;
+		case D_TRAP:
+			return is_halt(word);
+		default:
+			return false;
+	}
+}
+
+/* the block ends after it */
+static bool ends_block(const lc3_decoded* d, uint16_t word) {
+	return ends_walk(d, word) || (d->handler == D_BR && d->dst != 0);
+}
+
+/* marks every word of code reachable from entry */
+static bool walk(lc3_vm* vm, uint16_t entry, uint8_t* words) {
+	uint16_t* todo = malloc(MEMORY_SIZE * 3 * sizeof(uint16_t));
+	if (!todo) {
+		return false;
+	}
+	size_t n = 0;
+	todo[n++] = entry;
+	words[entry] |= W_START;
+	while (n > 0) {
+		uint16_t pc = todo[--n];
+		while (!(words[pc] & W_CODE) && !vm->io_page[IO_PAGE(pc)]) {
+			uint16_t word = vm->memory[pc];
+			uint16_t next = pc + 1;
+			lc3_decoded d;
+			lc3_decode(word, &d);
+			words[pc] |= W_CODE;
+
+			if ((d.handler == D_BR && d.dst != 0) || d.handler == D_JSR) {
+				uint16_t target = next + d.imm;
+				words[target] |= W_START;
+				todo[n++] = target;
+			}
+			if (d.handler == D_JSR || d.handler == D_JSRR) {
+				words[next] |= W_START; /* where RET comes back to */
+				todo[n++] = next;
+			}
+			if (ends_walk(&d, word)) {
+				break;
+			}
+			if (ends_block(&d, word)) {
+				words[next] |= W_START;
+			}
+			pc = next;
+		}
+		/* walked into code seen before, it is a join */
+		if (words[pc] & W_CODE) {
+			words[pc] |= W_START;
+		}
+	}
+	free(todo);
+	return true;
+}
+
+static size_t find_blocks(lc3_vm* vm, const uint8_t* words, aot_block* blocks) {
+	size_t count = 0;
+	uint32_t pc = 0;
+	while (pc < MEMORY_SIZE) {
+		if (!(words[pc] & W_START) || !(words[pc] & W_CODE)) {
+			pc++;
+			continue;
+		}
+		aot_block* b = &blocks[count++];
+		b->start = pc;
+		b->count = 0;
+		while (1) {
+			lc3_decoded d;
+			lc3_decode(vm->memory[pc], &d);
+			b->count++;
+			b->last = pc;
+			pc++;
+			if (ends_block(&d, vm->memory[pc - 1]) || pc == MEMORY_SIZE ||
+					!(words[pc] & W_CODE) || (words[pc] & W_START)) {
+				break;
+			}
+		}
+	}
+	return count;
+}
+
+/* Emitting */
+
+static const char* const reg[8] = { "r0", "r1", "r2", "r3", "r4", "r5", "r6", "r7" };
+
+/* the label of pc, or a way to get there without one */
+static void emit_goto(FILE* out, const uint8_t* words, uint16_t pc) {
+	if ((words[pc] & W_START) && (words[pc] & W_CODE)) {
+		fprintf(out, "goto b_%04X;", pc);
+	} else {
+		fprintf(out, "{ pc = 0x%04X; goto dispatch; }", pc);
+	}
+}
+
+/* a load from a constant address */
+static void emit_load_at(FILE* out, lc3_vm* vm, uint16_t addr, uint16_t next, uint32_t back) {
+	if (vm->io_page[IO_PAGE(addr)]) {
+		fprintf(out, "load(vm, 0x%04X, 0x%04X, retired - %u)", addr, next, back);
+	} else {
+		fprintf(out, "mem[0x%04X]", addr);
+	}
+}
+
+static void emit_flags(FILE* out, int r) {
+	fprintf(out, "\tcond = FLAGS(%s);\n", reg[r]);
+}
+
+/* back: instructions of the block after this one */
+static void emit_instr(FILE* out, lc3_vm* vm, const uint8_t* words, uint16_t pc, uint32_t back) {
+	uint16_t word = vm->memory[pc];
+	uint16_t next = pc + 1;
+	lc3_decoded d;
+	lc3_decode(word, &d);
+	const char* dst = reg[d.dst];
+	const char* src1 = reg[d.src1];
+
+	switch (d.handler) {
+		case D_BR:
+			if (d.dst == 0) {
+				break; /* never taken */
+			}
+			if (d.dst == (FL_NEG | FL_ZRO | FL_POS)) {
+				fprintf(out, "\t");
+			} else {
+				fprintf(out, "\tif (cond & %d) ", d.dst);
+			}
+			emit_goto(out, words, next + d.imm);
+			fprintf(out, "\n");
+			break;
+		case D_ADD:
+			fprintf(out, "\t%s = %s + %s;\n", dst, src1, reg[d.src2]);
+			emit_flags(out, d.dst);
+			break;
+		case D_ADDI:
+			fprintf(out, "\t%s = %s + 0x%04X;\n", dst, src1, (uint16_t) d.imm);
+			emit_flags(out, d.dst);
+			break;
+		case D_AND:
+			fprintf(out, "\t%s = %s & %s;\n", dst, src1, reg[d.src2]);
+			emit_flags(out, d.dst);
+			break;
+		case D_ANDI:
+			fprintf(out, "\t%s = %s & 0x%04X;\n", dst, src1, (uint16_t) d.imm);
+			emit_flags(out, d.dst);
+			break;
+		case D_NOT:
+			fprintf(out, "\t%s = ~%s;\n", dst, src1);
+			emit_flags(out, d.dst);
+			break;
+		case D_LEA:
+			fprintf(out, "\t%s = 0x%04X;\n", dst, (uint16_t) (next + d.imm));
+			emit_flags(out, d.dst);
+			break;
+		case D_LD:
+			fprintf(out, "\t%s = ", dst);
+			emit_load_at(out, vm, next + d.imm, next, back);
+			fprintf(out, ";\n");
+			emit_flags(out, d.dst);
+			break;
+		case D_LDI:
+			fprintf(out, "\ta = ");
+			emit_load_at(out, vm, next + d.imm, next, back);
+			fprintf(out, ";\n\t%s = LOAD(a, 0x%04X, %u);\n", dst, next, back);
+			emit_flags(out, d.dst);
+			break;
+		case D_LDR:
+			fprintf(out, "\ta = %s + 0x%04X;\n\t%s = LOAD(a, 0x%04X, %u);\n",
+					src1, (uint16_t) d.imm, dst, next, back);
+			emit_flags(out, d.dst);
+			break;
+		case D_ST:
+			fprintf(out, "\ta = 0x%04X;\n\tSTORE(a, %s, 0x%04X, %u);\n",
+					(uint16_t) (next + d.imm), dst, next, back);
+			break;
+		case D_STI:
+			fprintf(out, "\ta = ");
+			emit_load_at(out, vm, next + d.imm, next, back);
+			fprintf(out, ";\n\tSTORE(a, %s, 0x%04X, %u);\n", dst, next, back);
+			break;
+		case D_STR:
+			fprintf(out, "\ta = %s + 0x%04X;\n\tSTORE(a, %s, 0x%04X, %u);\n",
+					src1, (uint16_t) d.imm, dst, next, back);
+			break;
+		case D_JMP:
+			fprintf(out, "\tpc = %s;\n\tgoto dispatch;\n", src1);
+			break;
+		case D_JSR:
+			fprintf(out, "\tr7 = 0x%04X;\n\t", next);
+			emit_goto(out, words, next + d.imm);
+			fprintf(out, "\n");
+			break;
+		case D_JSRR:
+			/* R7 first, JSRR R7 goes to the return address as in d_jsrr */
+			fprintf(out, "\tr7 = 0x%04X;\n\tpc = %s;\n\tgoto dispatch;\n", next, src1);
+			break;
+		case D_TRAP:
+			fprintf(out, "\tTRAP(0x%04X, 0x%04X, %u);\n", word, next, back);
+			if (is_halt(word)) {
+				fprintf(out, "\tpc = 0x%04X;\n\tgoto leave;\n", next);
+			}
+			break;
+		default: /* D_RTI, D_RES: the interpreter knows what they do */
+			fprintf(out, "\tpc = 0x%04X;\n\tretired -= %u;\n\tgoto interp;\n", pc, back + 1);
+	}
+}
+
+static void emit_block(FILE* out, lc3_vm* vm, const uint8_t* words, const aot_block* b, size_t index) {
+	fprintf(out, "b_%04X:\n\tif (stale[%zu]) {\n\t\tpc = 0x%04X;\n\t\tgoto interp;\n\t}\n"
+			"\tretired += %u;\n", b->start, index, b->start, b->count);
+	uint32_t pc = b->start;
+	uint32_t k;
+	for (k = 1; k <= b->count; k++, pc++) {
+		emit_instr(out, vm, words, pc, b->count - k);
+	}
+	/* fell off the end into the next block */
+	lc3_decoded d;
+	lc3_decode(vm->memory[b->last], &d);
+	if (!ends_walk(&d, vm->memory[b->last])) {
+		fprintf(out, "\t");
+		emit_goto(out, words, b->last + 1);
+		fprintf(out, "\n");
+	}
+}
+
+static const char* const prologue =
+	"#include \"lc3.h\"\n"
+	"\n"
+	"#include <stdio.h>\n"
+	"#include <stdlib.h>\n"
+	"#include <stdbool.h>\n"
+	"#include <stdint.h>\n"
+	"\n";
+
+static const char* const helpers =
+	"#define FLAGS(v) ((v) == 0 ? FL_ZRO : ((v) >> 15) ? FL_NEG : FL_POS)\n"
+	"\n"
+	"/* devices see the pc and count of the instruction using them */\n"
+	"static inline uint16_t load(lc3_vm* vm, uint16_t addr, uint16_t next, uint64_t retired) {\n"
+	"\tvm->registers[R_PC] = next;\n"
+	"\tvm->retired = retired;\n"
+	"\treturn mem_read(vm, addr);\n"
+	"}\n"
+	"\n"
+	"/* vm->code_written, for every store to a translated word */\n"
+	"static void code_written(lc3_vm* vm, uint16_t loc) {\n"
+	"\tint b = block_of(loc);\n"
+	"\tif (b >= 0) {\n"
+	"\t\tstale[b] = 1;\n"
+	"\t}\n"
+	"}\n"
+	"\n"
+	"/* true when the rest of the block must not run */\n"
+	"static inline bool store(lc3_vm* vm, uint16_t addr, uint16_t val, uint16_t next, uint64_t retired) {\n"
+	"\tvm->registers[R_PC] = next;\n"
+	"\tvm->retired = retired;\n"
+	"\tmem_write(vm, addr, val);\n"
+	"\treturn block_of(addr) >= 0 || !vm->running;\n"
+	"}\n"
+	"\n"
+	"#define LOAD(a, next, back) \\\n"
+	"\t(vm->io_page[IO_PAGE(a)] ? load(vm, a, next, retired - (back)) : mem[a])\n"
+	"\n"
+	"#define STORE(a, v, next, back) do { \\\n"
+	"\t\tif (!vm->code_map[a]) { \\\n"
+	"\t\t\tmem[a] = v; \\\n"
+	"\t\t} else if (store(vm, a, v, next, retired - (back))) { \\\n"
+	"\t\t\tpc = next; \\\n"
+	"\t\t\tretired -= back; \\\n"
+	"\t\t\tgoto leave; \\\n"
+	"\t\t} \\\n"
+	"\t} while (0)\n"
+	"\n"
+	"#define SAVE() do { \\\n"
+	"\t\tvm->registers[R_0] = r0; vm->registers[R_1] = r1; \\\n"
+	"\t\tvm->registers[R_2] = r2; vm->registers[R_3] = r3; \\\n"
+	"\t\tvm->registers[R_4] = r4; vm->registers[R_5] = r5; \\\n"
+	"\t\tvm->registers[R_6] = r6; vm->registers[R_7] = r7; \\\n"
+	"\t\tvm->registers[R_COND] = cond; \\\n"
+	"\t\tvm->cond_pending = false; \\\n"
+	"\t} while (0)\n"
+	"\n"
+	"#define RESTORE() do { \\\n"
+	"\t\tlc3_sync_flags(vm); \\\n"
+	"\t\tr0 = vm->registers[R_0]; r1 = vm->registers[R_1]; \\\n"
+	"\t\tr2 = vm->registers[R_2]; r3 = vm->registers[R_3]; \\\n"
+	"\t\tr4 = vm->registers[R_4]; r5 = vm->registers[R_5]; \\\n"
+	"\t\tr6 = vm->registers[R_6]; r7 = vm->registers[R_7]; \\\n"
+	"\t\tcond = vm->registers[R_COND]; \\\n"
+	"\t} while (0)\n"
+	"\n"
+	"#define TRAP(word, next, back) do { \\\n"
+	"\t\tSAVE(); \\\n"
+	"\t\tvm->registers[R_PC] = next; \\\n"
+	"\t\tvm->retired = retired - (back); \\\n"
+	"\t\tlc3_trap(vm, word); \\\n"
+	"\t\tRESTORE(); \\\n"
+	"\t\tif (!vm->running) { \\\n"
+	"\t\t\tpc = next; \\\n"
+	"\t\t\tretired -= back; \\\n"
+	"\t\t\tgoto out; \\\n"
+	"\t\t} \\\n"
+	"\t} while (0)\n"
+	"\n";
+
+static void emit_run(FILE* out, lc3_vm* vm, const uint8_t* words, const aot_block* blocks, size_t count) {
+	fprintf(out,
+		"static void run(lc3_vm* vm) {\n"
+		"\tuint16_t* mem = vm->memory;\n"
+		"\tuint16_t r0, r1, r2, r3, r4, r5, r6, r7, cond;\n"
+		"\tuint16_t pc = vm->registers[R_PC];\n"
+		"\tuint16_t a;\n"
+		"\tuint64_t retired = vm->retired;\n"
+		"\t(void) mem;\n"
+		"\t(void) a;\n"
+		"\tRESTORE();\n"
+		"\tif (!vm->running) {\n"
+		"\t\tgoto out;\n"
+		"\t}\n"
+		"\n"
+		"dispatch:\n"
+		"\tswitch (pc) {\n");
+	size_t i;
+	for (i = 0; i < count; i++) {
+		fprintf(out, "\t\tcase 0x%04X: goto b_%04X;\n", blocks[i].start, blocks[i].start);
+	}
+	fprintf(out,
+		"\t\tdefault: goto interp;\n"
+		"\t}\n"
+		"\n"
+		"interp:\n"
+		"\tSAVE();\n"
+		"\tvm->registers[R_PC] = pc;\n"
+		"\tvm->retired = retired;\n"
+		"\tlc3_step(vm);\n"
+		"\tRESTORE();\n"
+		"\tpc = vm->registers[R_PC];\n"
+		"\tretired = vm->retired;\n"
+		"leave: __attribute__((unused));\n"
+		"\tif (!vm->running) {\n"
+		"\t\tgoto out;\n"
+		"\t}\n"
+		"\tgoto dispatch;\n"
+		"\n");
+	for (i = 0; i < count; i++) {
+		emit_block(out, vm, words, &blocks[i], i);
+	}
+	fprintf(out,
+		"\n"
+		"out:\n"
+		"\tSAVE();\n"
+		"\tvm->registers[R_PC] = pc;\n"
+		"\tvm->retired = retired;\n"
+		"}\n\n");
+}
+
+/* memory[] outside the device pages, as runs of nonzero words */
+static void emit_image(FILE* out, lc3_vm* vm) {
+	fprintf(out, "static const uint16_t image[] = {");
+	uint32_t n = 0;
+	uint32_t pc;
+	for (pc = 0; pc < MEMORY_SIZE; pc++) {
+		if (vm->memory[pc] && !vm->io_page[IO_PAGE(pc)]) {
+			fprintf(out, "%s0x%04X, 0x%04X", n++ ? ",\n\t" : "\n\t", pc, vm->memory[pc]);
+		}
+	}
+	fprintf(out, "\n};\n\n#define IMAGE_WORDS %u\n\n", n);
+}
+
+static void emit_blocks(FILE* out, const aot_block* blocks, size_t count) {
+	fprintf(out, "static const uint16_t block_start[] = {");
+	size_t i;
+	for (i = 0; i < count; i++) {
+		fprintf(out, "%s0x%04X", i == 0 ? "\n\t" : i % 8 ? ", " : ",\n\t", blocks[i].start);
+	}
+	fprintf(out, "\n};\n\nstatic const uint16_t block_last[] = {");
+	for (i = 0; i < count; i++) {
+		fprintf(out, "%s0x%04X", i == 0 ? "\n\t" : i % 8 ? ", " : ",\n\t", blocks[i].last);
+	}
+	fprintf(out,
+		"\n};\n\n"
+		"#define BLOCKS %zu\n"
+		"\n"
+		"static uint8_t stale[BLOCKS];\n"
+		"\n"
+		"/* the block holding addr, -1 if none does */\n"
+		"static int block_of(uint16_t addr) {\n"
+		"\tint lo = 0;\n"
+		"\tint hi = BLOCKS - 1;\n"
+		"\twhile (lo <= hi) {\n"
+		"\t\tint mid = (lo + hi) / 2;\n"
+		"\t\tif (addr < block_start[mid]) {\n"
+		"\t\t\thi = mid - 1;\n"
+		"\t\t} else if (addr > block_last[mid]) {\n"
+		"\t\t\tlo = mid + 1;\n"
+		"\t\t} else {\n"
+		"\t\t\treturn mid;\n"
+		"\t\t}\n"
+		"\t}\n"
+		"\treturn -1;\n"
+		"}\n\n", count);
+}
+
+static const char* const epilogue =
+	"int main(int argc, char** argv) {\n"
+	"\tlc3_vm* vm = lc3_vm_create();\n"
+	"\tif (!vm) {\n"
+	"\t\tfprintf(stderr, \"Out of memory\\n\");\n"
+	"\t\treturn EXIT_FAILURE;\n"
+	"\t}\n"
+	"\tint i;\n"
+	"\tfor (i = 0; i < IMAGE_WORDS; i++) {\n"
+	"\t\tvm->memory[image[2 * i]] = image[2 * i + 1];\n"
+	"\t}\n"
+	"\t/* stores to translated words take the slow path */\n"
+	"\tfor (i = 0; i < BLOCKS; i++) {\n"
+	"\t\tuint32_t loc;\n"
+	"\t\tfor (loc = block_start[i]; loc <= block_last[i]; loc++) {\n"
+	"\t\t\tvm->code_map[loc] |= MAP_CODE;\n"
+	"\t\t}\n"
+	"\t}\n"
+	"\tvm->code_written = code_written;\n"
+	"\trun(vm);\n"
+	"\tint status = vm->fault == LC3_OK ? 0 : EXIT_FAILURE;\n"
+	"\tlc3_vm_destroy(vm);\n"
+	"\treturn status;\n"
+	"}\n";
+
+bool lc3_aot(lc3_vm* vm, FILE* out) {
+	uint8_t* words = calloc(MEMORY_SIZE, 1);
+	aot_block* blocks = malloc(MEMORY_SIZE * sizeof(aot_block));
+	bool ok = words && blocks && walk(vm, vm->registers[R_PC], words);
+	if (ok) {
+		size_t count = find_blocks(vm, words, blocks);
+		fprintf(out, "/* generated by lc3_translate, %zu blocks */\n", count);
+		fputs(prologue, out);
+		emit_image(out, vm);
+		emit_blocks(out, blocks, count);
+		fputs(helpers, out);
+		emit_run(out, vm, words, blocks, count);
+		fputs(epilogue, out);
+		ok = !ferror(out);
+	}
+	free(words);
+	free(blocks);
+	return ok;
+}
@@ -0,0 +1,459 @@
+#include "lc3.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+/* Batch runner
+ * Each manifest line is "image stdin expected", '-' stands for no input
+ * or no expected output and '#' starts a comment. image may list several
+ * comma separated images, e.g. an OS image and a user program. Jobs are dealt out to
+ * per-worker deques; a worker pops from the bottom of its own deque and,
+ * once that is empty, steals from the top of the others. With lockstep
+ * the unit dealt out is a run of up to LOCKSTEP_LANES consecutive jobs
+ * with the same images, run together by lc3_run_lockstep(). */
+
+typedef struct {
+	char* image;
+	char* input;    /* NULL: no input */
+	char* expected; /* NULL: only check that the guest halted cleanly */
+	lc3_image* shared; /* NULL: the images did not load */
+	bool owns_shared;  /* first job with this image list */
+	int group;         /* jobs dealt out with this one, 0 if it is not the first */
+	int members[LOCKSTEP_LANES]; /* their indexes, this one first */
+
+	bool passed;
+	const char* reason;
+	uint64_t retired;
+	double seconds;
+} batch_job;
+
+typedef struct {
+	pthread_mutex_t lock;
+	int* jobs;
+	int top;    /* next job thieves take */
+	int bottom; /* one past the next job the owner takes */
+} job_deque;
+
+typedef struct {
+	batch_job* jobs;
+	job_deque* deques;
+	int workers;
+	void (*run)(lc3_vm*);
+	bool lockstep;
+	uint64_t budget;
+} batch;
+
+typedef struct {
+	batch* b;
+	int id;
+} worker_arg;
+
+static bool deque_pop(job_deque* q, int* job) {
+	bool found = false;
+	pthread_mutex_lock(&q->lock);
+	if (q->bottom > q->top) {
+		*job = q->jobs[--q->bottom];
+		found = true;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return found;
+}
+
+static bool deque_steal(job_deque* q, int* job) {
+	bool found = false;
+	pthread_mutex_lock(&q->lock);
+	if (q->bottom > q->top) {
+		*job = q->jobs[q->top++];
+		found = true;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return found;
+}
+
+static char* read_file(const char* path, size_t* len) {
+	FILE* file = fopen(path, "rb");
+	if (!file) {
+		return NULL;
+	}
+	char* buf = NULL;
+	size_t cap = 0;
+	*len = 0;
+	while (1) {
+		if (*len == cap) {
+			cap = cap ? cap * 2 : 4096;
+			char* grown = realloc(buf, cap);
+			if (!grown) {
+				free(buf);
+				fclose(file);
+				return NULL;
+			}
+			buf = grown;
+		}
+		size_t n = fread(buf + *len, 1, cap - *len, file);
+		if (n == 0) {
+			break;
+		}
+		*len += n;
+	}
+	fclose(file);
+	return buf;
+}
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static lc3_image* load_shared(const char* list) {
+	char* images = strdup(list);
+	if (!images) {
+		return NULL;
+	}
+	char* paths[16];
+	int count = 0;
+	char* rest;
+	char* path = strtok_r(images, ",", &rest);
+	while (path && count < 16) {
+		paths[count++] = path;
+		path = strtok_r(NULL, ",", &rest);
+	}
+	lc3_image* image = path ? NULL : lc3_image_load(paths, count);
+	free(images);
+	return image;
+}
+
+static const char* fault_reason(int fault) {
+	switch (fault) {
+		case LC3_BAD_TRAP: return "invalid trap";
+		case LC3_BUDGET: return "instruction budget exceeded";
+		case LC3_DIVERGED: return "input replay diverged";
+		default: return "invalid instruction";
+	}
+}
+
+static lc3_vm* job_start(batch_job* job, batch* b) {
+	if (!job->shared) {
+		job->reason = "cannot load image";
+		return NULL;
+	}
+	lc3_vm* vm = lc3_vm_create_from(job->shared);
+	if (!vm) {
+		job->reason = "out of memory";
+		return NULL;
+	}
+
+	/* no input is read from memory, with no reader thread to race */
+	static const uint8_t no_input[1];
+	lc3_output_mem(vm);
+	if (!job->input) {
+		lc3_input_mem(vm, no_input, 0);
+	} else if (!(vm->in = fopen(job->input, "rb"))) {
+		job->reason = "cannot open input";
+		lc3_vm_destroy(vm);
+		return NULL;
+	}
+	lc3_set_budget(vm, b->budget);
+	vm->fuse = !b->lockstep && (b->run == lc3_run || b->run == lc3_run_threaded);
+	return vm;
+}
+
+static void job_finish(batch_job* job, lc3_vm* vm) {
+	FILE* input;
+	job->retired = vm->retired;
+
+	out_flush(vm);
+
+	if (vm->fault != LC3_OK) {
+		job->reason = fault_reason(vm->fault);
+		goto out;
+	}
+
+	if (job->expected) {
+		size_t expected_len;
+		char* expected = read_file(job->expected, &expected_len);
+		if (!expected) {
+			job->reason = "cannot read expected output";
+			goto out;
+		}
+		job->passed = expected_len == vm->out.mem_len &&
+				memcmp(expected, vm->out.mem, expected_len) == 0;
+		if (!job->passed) {
+			job->reason = "output differs";
+		}
+		free(expected);
+	} else {
+		job->passed = true;
+	}
+
+out:
+	input = job->input ? vm->in : NULL;
+	lc3_vm_destroy(vm); /* stops the keyboard reader before its input closes */
+	if (input) {
+		fclose(input);
+	}
+}
+
+static void run_job(batch_job* job, batch* b) {
+	lc3_vm* vm = job_start(job, b);
+	if (!vm) {
+		return;
+	}
+	double start = now();
+	b->run(vm);
+	job->seconds = now() - start;
+	job_finish(job, vm);
+}
+
+/* the jobs of head's unit in lockstep, each is charged the time of the group */
+static void run_group(batch_job* head, batch* b) {
+	lc3_vm* vms[LOCKSTEP_LANES];
+	batch_job* started[LOCKSTEP_LANES];
+	int n = 0;
+	int i;
+	for (i = 0; i < head->group; i++) {
+		batch_job* job = &b->jobs[head->members[i]];
+		lc3_vm* vm = job_start(job, b);
+		if (vm) {
+			started[n] = job;
+			vms[n++] = vm;
+		}
+	}
+	double start = now();
+	lc3_run_lockstep(vms, n);
+	double seconds = now() - start;
+	for (i = 0; i < n; i++) {
+		started[i]->seconds = seconds;
+		job_finish(started[i], vms[i]);
+	}
+}
+
+static void* worker(void* p) {
+	worker_arg* arg = p;
+	batch* b = arg->b;
+	int job;
+
+	while (1) {
+		if (!deque_pop(&b->deques[arg->id], &job)) {
+			int i;
+			bool stolen = false;
+			for (i = 1; i < b->workers && !stolen; i++) {
+				stolen = deque_steal(&b->deques[(arg->id + i) % b->workers], &job);
+			}
+			/* jobs never spawn jobs, so nothing left to steal means done */
+			if (!stolen) {
+				break;
+			}
+		}
+		if (b->lockstep) {
+			run_group(&b->jobs[job], b);
+		} else {
+			run_job(&b->jobs[job], b);
+		}
+	}
+	return NULL;
+}
+
+/* the next field of line, NULL if it is '-' or missing. False when out
+ * of memory. */
+static bool field(char** line, char** value) {
+	char* tok = strtok_r(NULL, " \t\r\n", line);
+	*value = NULL;
+	if (!tok || strcmp(tok, "-") == 0) {
+		return true;
+	}
+	*value = strdup(tok);
+	return *value != NULL;
+}
+
+static void free_jobs(batch_job* jobs, int count) {
+	int i;
+	for (i = 0; i < count; i++) {
+		free(jobs[i].image);
+		free(jobs[i].input);
+		free(jobs[i].expected);
+		if (jobs[i].owns_shared) {
+			lc3_image_free(jobs[i].shared);
+		}
+	}
+	free(jobs);
+}
+
+static int read_manifest(const char* path, batch_job** jobs) {
+	FILE* file = fopen(path, "r");
+	if (!file) {
+		return -1;
+	}
+
+	char line[4096];
+	int count = 0;
+	int cap = 0;
+	*jobs = NULL;
+	while (fgets(line, sizeof(line), file)) {
+		char* hash = strchr(line, '#');
+		if (hash) {
+			*hash = '\0';
+		}
+
+		char* rest;
+		char* image = strtok_r(line, " \t\r\n", &rest);
+		if (!image) {
+			continue;
+		}
+
+		if (count == cap) {
+			cap = cap ? cap * 2 : 64;
+			batch_job* grown = realloc(*jobs, cap * sizeof(batch_job));
+			if (!grown) {
+				goto fail;
+			}
+			*jobs = grown;
+		}
+		batch_job* job = &(*jobs)[count++];
+		memset(job, 0, sizeof(batch_job));
+		job->image = strdup(image);
+		if (!job->image || !field(&rest, &job->input) || !field(&rest, &job->expected)) {
+			goto fail;
+		}
+	}
+
+	fclose(file);
+	return count;
+
+fail:
+	fprintf(stderr, "%s: out of memory\n", path);
+	fclose(file);
+	free_jobs(*jobs, count);
+	*jobs = NULL;
+	return -1;
+}
+
+int lc3_batch(const char* manifest, int threads, void (*run)(lc3_vm*), bool lockstep, uint64_t budget) {
+	batch b;
+	int count = read_manifest(manifest, &b.jobs);
+	if (count < 0) {
+		fprintf(stderr, "cannot read manifest: %s\n", manifest);
+		return -1;
+	}
+
+	if (threads < 1) {
+		threads = 1;
+	}
+	if (threads > count && count > 0) {
+		threads = count;
+	}
+	b.workers = threads;
+	b.run = run;
+	b.lockstep = lockstep;
+	b.budget = budget;
+	b.deques = calloc(threads, sizeof(job_deque));
+	pthread_t* tids = calloc(threads, sizeof(pthread_t));
+	worker_arg* args = calloc(threads, sizeof(worker_arg));
+	int* units = calloc(count + 1, sizeof(int));
+	int failed = -1;
+	int ready = 0;   /* deques set up */
+	int started = 0; /* workers running */
+	int i, k;
+	if (!b.deques || !tids || !args || !units) {
+		fprintf(stderr, "batch: out of memory\n");
+		goto out;
+	}
+
+	/* jobs running the same images share one copy-on-write image */
+	for (i = 0; i < count; i++) {
+		batch_job* job = &b.jobs[i];
+		for (k = 0; k < i && strcmp(b.jobs[k].image, job->image) != 0; k++) {
+		}
+		if (k < i) {
+			job->shared = b.jobs[k].shared;
+		} else {
+			job->shared = load_shared(job->image);
+			job->owns_shared = true;
+		}
+	}
+
+	/* the first job of every unit dealt out, lockstep groups the jobs
+	 * sharing images into units that fill up in manifest order */
+	int unit_count = 0;
+	for (i = 0; i < count; i++) {
+		batch_job* job = &b.jobs[i];
+		for (k = unit_count - 1; lockstep && job->shared && k >= 0; k--) {
+			batch_job* head = &b.jobs[units[k]];
+			if (head->shared == job->shared && head->group < LOCKSTEP_LANES) {
+				break;
+			}
+		}
+		if (lockstep && job->shared && k >= 0) {
+			b.jobs[units[k]].members[b.jobs[units[k]].group++] = i;
+		} else {
+			job->group = 1;
+			job->members[0] = i;
+			units[unit_count++] = i;
+		}
+	}
+
+	for (ready = 0; ready < threads; ready++) {
+		b.deques[ready].jobs = calloc(unit_count / threads + 1, sizeof(int));
+		if (!b.deques[ready].jobs) {
+			fprintf(stderr, "batch: out of memory\n");
+			goto out;
+		}
+		pthread_mutex_init(&b.deques[ready].lock, NULL);
+	}
+	/* deal in reverse so every owner pops its jobs in manifest order */
+	for (i = unit_count - 1; i >= 0; i--) {
+		job_deque* q = &b.deques[i % threads];
+		q->jobs[q->bottom++] = units[i];
+	}
+
+	/* workers steal whatever is left, so any that started run every job */
+	double start = now();
+	for (started = 0; started < threads; started++) {
+		args[started].b = &b;
+		args[started].id = started;
+		int err = pthread_create(&tids[started], NULL, worker, &args[started]);
+		if (err != 0) {
+			fprintf(stderr, "batch: cannot start worker: %s\n", strerror(err));
+			break;
+		}
+	}
+	for (i = 0; i < started; i++) {
+		pthread_join(tids[i], NULL);
+	}
+	double elapsed = now() - start;
+	if (started == 0) {
+		goto out;
+	}
+
+	failed = 0;
+	for (i = 0; i < count; i++) {
+		batch_job* job = &b.jobs[i];
+		double mips = job->seconds > 0 ? job->retired / job->seconds / 1e6 : 0;
+		printf("%s\t%s\t%llu instr\t%.2f Minstr/s", job->passed ? "PASS" : "FAIL",
+				job->image, (unsigned long long) job->retired, mips);
+		if (!job->passed) {
+			printf("\t(%s)", job->reason);
+			failed++;
+		}
+		printf("\n");
+	}
+	printf("%d/%d passed, %d threads, %.3fs\n", count - failed, count, started, elapsed);
+
+out:
+	for (i = 0; i < ready; i++) {
+		pthread_mutex_destroy(&b.deques[i].lock);
+		free(b.deques[i].jobs);
+	}
+	free(b.deques);
+	free(tids);
+	free(args);
+	free(units);
+	free_jobs(b.jobs, count);
+
+	return failed;
+}
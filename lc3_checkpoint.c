@@ -0,0 +1,163 @@
+#include "lc3.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+/* Checkpoints
+ * An append-only log of records. Each holds the registers and the pages
+ * written since the record before it, so replaying records 0..n in order
+ * rebuilds memory[] as of checkpoint n. Every record ends in a checksum;
+ * a record torn by a crash is cut off by the next rollback. A new VM has
+ * all pages dirty, so the first record of a log is complete. */
+
+#define CKPT_MAGIC 0x54504B43 /* "CKPT" */
+
+typedef struct {
+	uint32_t magic;
+	uint32_t pages;     /* ckpt_page records that follow */
+	uint64_t retired;
+	uint16_t registers[R_COUNT];
+	uint8_t running;
+	uint8_t fault;
+} ckpt_header;
+
+typedef struct {
+	uint16_t page;
+	uint16_t words[DIRTY_PAGE_WORDS];
+} ckpt_page;
+
+/* FNV-1a */
+static uint32_t checksum(uint32_t h, const void* data, size_t len) {
+	const uint8_t* p = data;
+	while (len-- > 0) {
+		h = (h ^ *p++) * 16777619u;
+	}
+	return h;
+}
+
+bool lc3_checkpoint(lc3_vm* vm, FILE* log) {
+	lc3_sync_flags(vm);
+
+	ckpt_header h;
+	memset(&h, 0, sizeof(h));
+	h.magic = CKPT_MAGIC;
+	h.retired = vm->retired;
+	memcpy(h.registers, vm->registers, sizeof(h.registers));
+	h.running = vm->running;
+	h.fault = vm->fault;
+
+	ckpt_page* pages = malloc(DIRTY_PAGES * sizeof(ckpt_page));
+	if (!pages) {
+		return false;
+	}
+	int i;
+	for (i = 0; i < DIRTY_PAGES; i++) {
+		if (vm->dirty[i]) {
+			ckpt_page* p = &pages[h.pages++];
+			p->page = i;
+			memcpy(p->words, vm->memory + i * DIRTY_PAGE_WORDS, sizeof(p->words));
+		}
+	}
+
+	uint32_t sum = checksum(2166136261u, &h, sizeof(h));
+	sum = checksum(sum, pages, h.pages * sizeof(ckpt_page));
+	bool ok = fwrite(&h, sizeof(h), 1, log) == 1 &&
+			fwrite(pages, sizeof(ckpt_page), h.pages, log) == h.pages &&
+			fwrite(&sum, sizeof(sum), 1, log) == 1 &&
+			fflush(log) == 0 && fdatasync(fileno(log)) == 0;
+	free(pages);
+
+	if (!ok) {
+		fprintf(stderr, "checkpoint: %s\n", strerror(errno));
+		return false;
+	}
+	memset(vm->dirty, 0, sizeof(vm->dirty));
+	return true;
+}
+
+/* reads the next record, false at the end of the log or a torn record */
+static bool read_record(FILE* file, ckpt_header* h, ckpt_page* pages) {
+	uint32_t sum;
+	if (fread(h, sizeof(ckpt_header), 1, file) != 1 || h->magic != CKPT_MAGIC ||
+			h->pages > DIRTY_PAGES ||
+			fread(pages, sizeof(ckpt_page), h->pages, file) != h->pages ||
+			fread(&sum, sizeof(sum), 1, file) != 1) {
+		return false;
+	}
+	uint32_t expected = checksum(2166136261u, h, sizeof(ckpt_header));
+	expected = checksum(expected, pages, h->pages * sizeof(ckpt_page));
+	return sum == expected;
+}
+
+long lc3_rollback(lc3_vm* vm, const char* path, long seq) {
+	FILE* file = fopen(path, "rb");
+	if (!file) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	ckpt_page* pages = malloc(DIRTY_PAGES * sizeof(ckpt_page));
+	if (!pages) {
+		fclose(file);
+		return -1;
+	}
+
+	ckpt_header h;
+	ckpt_header last;
+	long n = 0;
+	long valid_end = 0;
+	while (read_record(file, &h, pages)) {
+		if (seq < 0 || n <= seq) {
+			uint32_t i;
+			for (i = 0; i < h.pages; i++) {
+				memcpy(vm->memory + pages[i].page * DIRTY_PAGE_WORDS, pages[i].words,
+						sizeof(pages[i].words));
+			}
+			last = h;
+		}
+		valid_end = ftell(file);
+		n++;
+	}
+	/* whatever follows the last good record was torn by a crash, drop it
+	 * so the records appended next are reachable */
+	bool torn = valid_end != ftell(file) || fgetc(file) != EOF;
+	fclose(file);
+	free(pages);
+	if (torn && truncate(path, valid_end) < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+	}
+
+	if (n == 0 || n <= seq) {
+		fprintf(stderr, "%s: no checkpoint %ld\n", path, seq);
+		return -1;
+	}
+
+	memcpy(vm->registers, last.registers, sizeof(last.registers));
+	vm->running = last.running;
+	vm->fault = last.fault;
+	vm->retired = last.retired;
+	vm->cond_pending = false;
+	lc3_forget_code(vm);
+	/* the log may hold records past seq, the next record must not build
+	 * on them */
+	memset(vm->dirty, 1, sizeof(vm->dirty));
+	return seq < 0 ? n - 1 : seq;
+}
+
+void lc3_run_checkpointed(lc3_vm* vm, void (*run)(lc3_vm*), FILE* log, uint64_t interval) {
+	while (vm->running) {
+		vm->stop_at = vm->retired + interval;
+		if (vm->stop_at > vm->budget) {
+			vm->stop_at = vm->budget;
+		}
+		run(vm);
+		if (!lc3_checkpoint(vm, log)) {
+			break;
+		}
+	}
+	vm->stop_at = vm->budget;
+}
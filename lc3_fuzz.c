@@ -0,0 +1,511 @@
+#include "lc3.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+/* Fuzzer
+ * Runs one guest over and over on generated keyboard input, all in one
+ * VM. Everything the guest does before it first touches the keyboard is
+ * the same for every input, so it runs once and the fuzzer keeps the
+ * state at that point: memory, registers and retired. A case starts
+ * from there, puts back the words of the pages it dirtied (and the
+ * device pages, which devices write behind mem_write()) and drops only
+ * the decoded records of words that changed.
+ * Coverage is AFL's: every BR, JMP, JSR and JSRR bumps a byte of a 64K
+ * map picked by the pair of pc and target, a case is kept when some
+ * edge reaches a hit count bucket no case reached before. Only the bytes
+ * a case touched are looked at and cleared again.
+ * dir/queue holds the seeds and every input kept, dir/crashes the inputs
+ * that ran into a bad instruction or trap and dir/hangs those that ran
+ * out of budget, once per new coverage. Only queued inputs are mutated. */
+
+#define MAP_SIZE (1 << 16)
+#define FUZZ_MAX_INPUT 1024
+#define FUZZ_BUDGET 100000  /* instructions per case unless -l says */
+#define PREFIX_BUDGET 100000000 /* to the first keyboard access */
+#define STATUS_EVERY 4096   /* execs between looks at the clock */
+#define STATUS_SECONDS 1.0
+
+typedef struct {
+	uint8_t* data;
+	size_t len;
+} fuzz_input;
+
+struct lc3_fuzzer {
+	lc3_vm* vm;
+	const char* dir;
+	uint64_t budget;
+
+	/* the state every case starts from */
+	uint16_t memory[MEMORY_SIZE];
+	uint16_t registers[R_COUNT];
+	uint64_t retired;
+	uint8_t device_page[DIRTY_PAGES]; /* always put back */
+
+	uint8_t map[MAP_SIZE];    /* hits of this case */
+	uint8_t virgin[MAP_SIZE]; /* buckets some case reached */
+	uint16_t touched[MAP_SIZE];
+	uint32_t touched_count;
+	uint32_t edges;
+
+	fuzz_input* queue;
+	size_t queue_len;
+	size_t queue_cap;
+	uint64_t rng;
+
+	uint64_t execs;
+	uint64_t crashes;
+	uint64_t hangs;
+	uint64_t saved;   /* names the files written */
+};
+
+static uint64_t next_random(lc3_fuzzer* f) {
+	/* xorshift64 */
+	f->rng ^= f->rng << 13;
+	f->rng ^= f->rng >> 7;
+	f->rng ^= f->rng << 17;
+	return f->rng;
+}
+
+static uint32_t below(lc3_fuzzer* f, uint32_t n) {
+	return (uint32_t) (next_random(f) % n);
+}
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Coverage */
+
+static const bool is_jump[D_COUNT] = {
+	[D_BR] = true,
+	[D_JMP] = true,
+	[D_JSR] = true,
+	[D_JSRR] = true
+};
+
+static void edge(lc3_fuzzer* f, uint16_t from, uint16_t to) {
+	uint16_t i = (uint16_t) ((from * 0x9E37u) >> 1) ^ to;
+	if (f->map[i] == 0) {
+		f->touched[f->touched_count++] = i;
+	}
+	if (f->map[i] < 255) {
+		f->map[i]++;
+	}
+}
+
+/* lc3_run() that records an edge at every jump, not taken BRs included */
+static void run_case(lc3_fuzzer* f) {
+	lc3_vm* vm = f->vm;
+	while (vm->running && vm->retired < vm->stop_at) {
+		uint16_t pc = vm->registers[R_PC]++;
+		lc3_decoded* d = &vm->decoded[pc];
+		vm->retired++;
+		lc3_execute(vm, d);
+		if (is_jump[d->handler]) {
+			edge(f, pc, vm->registers[R_PC]);
+		}
+	}
+	lc3_sync_flags(vm);
+	lc3_check_budget(vm);
+}
+
+/* AFL's hit count buckets, one bit each */
+static uint8_t bucket(uint8_t hits) {
+	if (hits <= 3) {
+		return 1 << (hits - 1);
+	}
+	return hits <= 7 ? 1 << 3 : hits <= 15 ? 1 << 4 : hits <= 31 ? 1 << 5 : hits <= 127 ? 1 << 6 : 1 << 7;
+}
+
+/* drops the edges of a run nobody judges */
+static void forget_edges(lc3_fuzzer* f) {
+	while (f->touched_count > 0) {
+		f->map[f->touched[--f->touched_count]] = 0;
+	}
+}
+
+/* folds the case into virgin and clears map, true if it found something new */
+static bool new_coverage(lc3_fuzzer* f) {
+	bool found = false;
+	uint32_t i;
+	for (i = 0; i < f->touched_count; i++) {
+		uint16_t e = f->touched[i];
+		uint8_t b = bucket(f->map[e]);
+		if (!(f->virgin[e] & b)) {
+			f->edges += f->virgin[e] == 0;
+			f->virgin[e] |= b;
+			found = true;
+		}
+		f->map[e] = 0;
+	}
+	f->touched_count = 0;
+	return found;
+}
+
+/* Cases */
+
+static void reset(lc3_fuzzer* f) {
+	lc3_vm* vm = f->vm;
+	int page;
+	for (page = 0; page < DIRTY_PAGES; page++) {
+		if (!vm->dirty[page] && !f->device_page[page]) {
+			continue;
+		}
+		uint32_t loc = page * DIRTY_PAGE_WORDS;
+		uint32_t end = loc + DIRTY_PAGE_WORDS;
+		for (; loc < end; loc++) {
+			if (vm->memory[loc] != f->memory[loc]) {
+				vm->memory[loc] = f->memory[loc];
+				if (vm->code_map[loc] & MAP_CODE) {
+					vm->code_map[loc] &= ~MAP_CODE;
+					vm->decoded[loc].handler = D_DECODE;
+				}
+			}
+		}
+		vm->dirty[page] = 0;
+	}
+
+	memcpy(vm->registers, f->registers, sizeof(vm->registers));
+	vm->cond_pending = false;
+	vm->running = true;
+	vm->fault = LC3_OK;
+	vm->retired = f->retired;
+	vm->stop_at = vm->budget = UINT64_MAX;
+	lc3_set_budget(vm, f->budget);
+	vm->out.used = 0;
+	vm->out.newline = false;
+	vm->out.mem_len = 0;
+}
+
+static int exec_case(lc3_fuzzer* f, const uint8_t* data, size_t len) {
+	reset(f);
+	lc3_input_mem(f->vm, data, len);
+	run_case(f);
+	f->execs++;
+	return f->vm->fault;
+}
+
+/* Files */
+
+static bool make_dir(const char* path) {
+	if (mkdir(path, 0777) < 0 && errno != EEXIST) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+static void save(lc3_fuzzer* f, const char* sub, const char* what, const uint8_t* data, size_t len) {
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/%s/id-%06llu%s%s", f->dir, sub,
+			(unsigned long long) f->saved++, what ? "-" : "", what ? what : "");
+	FILE* file = fopen(path, "wb");
+	if (!file || fwrite(data, 1, len, file) != len) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+	}
+	if (file) {
+		fclose(file);
+	}
+}
+
+static bool enqueue(lc3_fuzzer* f, const uint8_t* data, size_t len) {
+	if (f->queue_len == f->queue_cap) {
+		size_t cap = f->queue_cap ? f->queue_cap * 2 : 64;
+		fuzz_input* grown = realloc(f->queue, cap * sizeof(fuzz_input));
+		if (!grown) {
+			return false;
+		}
+		f->queue = grown;
+		f->queue_cap = cap;
+	}
+	uint8_t* copy = malloc(len ? len : 1);
+	if (!copy) {
+		return false;
+	}
+	memcpy(copy, data, len);
+	f->queue[f->queue_len].data = copy;
+	f->queue[f->queue_len].len = len;
+	f->queue_len++;
+	return true;
+}
+
+/* what the case did, returns true if it was kept */
+static bool judge(lc3_fuzzer* f, int fault, const uint8_t* data, size_t len, bool seed) {
+	if (!new_coverage(f)) {
+		return false;
+	}
+	/* neither is mutated further, a hang would eat the budget every time */
+	if (fault == LC3_BUDGET) {
+		f->hangs++;
+		save(f, "hangs", NULL, data, len);
+		return false;
+	}
+	if (fault != LC3_OK) {
+		f->crashes++;
+		save(f, "crashes", fault == LC3_BAD_TRAP ? "trap" : "instr", data, len);
+		return false;
+	}
+	if (!seed) {
+		save(f, "queue", NULL, data, len);
+	}
+	return enqueue(f, data, len);
+}
+
+/* files written later are numbered past every id- file in sub */
+static void skip_ids(lc3_fuzzer* f, const char* sub) {
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/%s", f->dir, sub);
+	DIR* d = opendir(path);
+	struct dirent* ent;
+	while (d && (ent = readdir(d))) {
+		unsigned long long id;
+		if (sscanf(ent->d_name, "id-%llu", &id) == 1 && id >= f->saved) {
+			f->saved = id + 1;
+		}
+	}
+	if (d) {
+		closedir(d);
+	}
+}
+
+static void load_seeds(lc3_fuzzer* f) {
+	char path[4096];
+	uint8_t data[FUZZ_MAX_INPUT];
+	skip_ids(f, "queue");
+	skip_ids(f, "crashes");
+	skip_ids(f, "hangs");
+
+	snprintf(path, sizeof(path), "%s/queue", f->dir);
+	DIR* d = opendir(path);
+	struct dirent* ent;
+	while (d && (ent = readdir(d))) {
+		if (ent->d_name[0] == '.') {
+			continue;
+		}
+		snprintf(path, sizeof(path), "%s/queue/%s", f->dir, ent->d_name);
+		FILE* file = fopen(path, "rb");
+		if (!file) {
+			continue;
+		}
+		size_t len = fread(data, 1, sizeof(data), file);
+		fclose(file);
+		judge(f, exec_case(f, data, len), data, len, true);
+	}
+	if (d) {
+		closedir(d);
+	}
+	/* the empty input is always worth a try, and mutating needs a parent */
+	if (!judge(f, exec_case(f, data, 0), data, 0, f->queue_len > 0) && f->queue_len == 0) {
+		enqueue(f, data, 0);
+	}
+}
+
+/* Mutation
+ * a stack of 1 to 8 random edits, AFL's havoc stage with keys guests
+ * are likely to compare against */
+
+static const uint8_t interesting[] = {
+	0, '\n', '\r', ' ', '0', '1', '9', 'a', 'q', 'y', 'n', 'A', 'Z', '-', '+', 0x7F, 0xFF
+};
+
+static size_t mutate(lc3_fuzzer* f, uint8_t* data, size_t len) {
+	int edits = 1 << below(f, 4);
+	int i;
+	for (i = 0; i < edits; i++) {
+		size_t pos = len ? below(f, len) : 0;
+		switch (below(f, 7)) {
+			case 0: /* flip a bit */
+				if (len) {
+					data[pos] ^= 1 << below(f, 8);
+				}
+				break;
+			case 1: /* random byte */
+				if (len) {
+					data[pos] = (uint8_t) next_random(f);
+				}
+				break;
+			case 2: /* interesting byte */
+				if (len) {
+					data[pos] = interesting[below(f, sizeof(interesting))];
+				}
+				break;
+			case 3: /* small add or subtract */
+				if (len) {
+					data[pos] += (uint8_t) (below(f, 35) - 17);
+				}
+				break;
+			case 4: /* insert a byte */
+				if (len < FUZZ_MAX_INPUT) {
+					memmove(data + pos + 1, data + pos, len - pos);
+					data[pos] = below(f, 2) ? interesting[below(f, sizeof(interesting))] :
+							(uint8_t) below(f, 128);
+					len++;
+				}
+				break;
+			case 5: /* delete a run */
+				if (len) {
+					size_t n = 1 + below(f, len - pos);
+					memmove(data + pos, data + pos + n, len - pos - n);
+					len -= n;
+				}
+				break;
+			default: { /* splice in a piece of another input */
+				fuzz_input* other = &f->queue[below(f, f->queue_len)];
+				if (other->len) {
+					size_t from = below(f, other->len);
+					size_t n = 1 + below(f, other->len - from);
+					if (n > FUZZ_MAX_INPUT - pos) {
+						n = FUZZ_MAX_INPUT - pos;
+					}
+					memcpy(data + pos, other->data + from, n);
+					if (pos + n > len) {
+						len = pos + n;
+					}
+				}
+			}
+		}
+	}
+	return len;
+}
+
+static void status(lc3_fuzzer* f, double start, const char* end) {
+	double elapsed = now() - start;
+	fprintf(stderr, "fuzz: %llu execs, %.0f/s, %zu queued, %u edges, %llu crashes, %llu hangs%s",
+			(unsigned long long) f->execs, elapsed > 0 ? f->execs / elapsed : 0.0, f->queue_len,
+			f->edges, (unsigned long long) f->crashes, (unsigned long long) f->hangs, end);
+}
+
+/* state before the instruction that first touches the keyboard */
+static bool fork_point(lc3_fuzzer* f) {
+	lc3_vm* vm = f->vm;
+	static const uint8_t none[1];
+	lc3_input_mem(vm, none, 0);
+	lc3_set_budget(vm, PREFIX_BUDGET);
+	run_case(f);
+	/* cases start past the edges to the keyboard, they never see them */
+	forget_edges(f);
+	uint64_t first_use = vm->in_mem.first_use;
+	if (first_use == 0) {
+		fprintf(stderr, "fuzz: the guest %s without reading the keyboard\n",
+				vm->fault == LC3_BUDGET ? "ran out of budget" : "stopped");
+		return false;
+	}
+	return true;
+}
+
+lc3_fuzzer* lc3_fuzzer_create(char* const* paths, int count, uint64_t budget) {
+	lc3_fuzzer* f = calloc(1, sizeof(lc3_fuzzer));
+	if (!f) {
+		return NULL;
+	}
+	f->budget = budget == UINT64_MAX ? FUZZ_BUDGET : budget;
+
+	/* once to find the fork point, then from scratch up to it */
+	uint64_t first_use = 0;
+	int pass;
+	for (pass = 0; pass < 2; pass++) {
+		if (f->vm) {
+			first_use = f->vm->in_mem.first_use;
+			lc3_vm_destroy(f->vm);
+		}
+		f->vm = lc3_vm_create();
+		if (!f->vm || !lc3_load_images(f->vm, paths, count)) {
+			fprintf(stderr, "fuzz: cannot load the images\n");
+			goto fail;
+		}
+		lc3_output_mem(f->vm);
+		f->vm->quiet = true; /* crashes are what we are after */
+		if (pass == 0 && !fork_point(f)) {
+			goto fail;
+		}
+	}
+	f->vm->stop_at = first_use - 1;
+	lc3_run(f->vm);
+	if (!f->vm->running) {
+		fprintf(stderr, "fuzz: the guest stopped on its way to the keyboard\n");
+		goto fail;
+	}
+
+	memcpy(f->memory, f->vm->memory, sizeof(f->memory));
+	memcpy(f->registers, f->vm->registers, sizeof(f->registers));
+	f->retired = f->vm->retired;
+	int i;
+	for (i = 0; i < IO_PAGES; i++) {
+		if (f->vm->io_page[i]) {
+			f->device_page[DIRTY_PAGE(i << 8)] = 1;
+		}
+	}
+	memset(f->vm->dirty, 1, sizeof(f->vm->dirty)); /* the first reset checks it all */
+	return f;
+
+fail:
+	lc3_fuzzer_destroy(f);
+	return NULL;
+}
+
+lc3_vm* lc3_fuzz_case(lc3_fuzzer* f, const uint8_t* data, size_t len) {
+	exec_case(f, data, len);
+	forget_edges(f);
+	return f->vm;
+}
+
+void lc3_fuzzer_destroy(lc3_fuzzer* f) {
+	if (!f) {
+		return;
+	}
+	lc3_vm_destroy(f->vm);
+	size_t q;
+	for (q = 0; q < f->queue_len; q++) {
+		free(f->queue[q].data);
+	}
+	free(f->queue);
+	free(f);
+}
+
+int lc3_fuzz(char* const* paths, int count, const char* dir, uint64_t budget, uint64_t execs) {
+	char path[4096];
+	const char* subs[] = { "queue", "crashes", "hangs" };
+	int i;
+	bool ok = make_dir(dir);
+	for (i = 0; i < 3 && ok; i++) {
+		snprintf(path, sizeof(path), "%s/%s", dir, subs[i]);
+		ok = make_dir(path);
+	}
+	lc3_fuzzer* f = ok ? lc3_fuzzer_create(paths, count, budget) : NULL;
+	if (!f) {
+		return -1;
+	}
+	f->dir = dir;
+	f->rng = (uint64_t) time(NULL) * 0x9E3779B97F4A7C15ull | 1;
+
+	load_seeds(f);
+	double start = now();
+	double shown = start;
+	uint8_t data[FUZZ_MAX_INPUT];
+	while (execs == 0 || f->execs < execs) {
+		fuzz_input* parent = &f->queue[below(f, f->queue_len)];
+		memcpy(data, parent->data, parent->len);
+		size_t len = mutate(f, data, parent->len);
+		judge(f, exec_case(f, data, len), data, len, false);
+		if (f->execs % STATUS_EVERY == 0 && now() - shown >= STATUS_SECONDS) {
+			shown = now();
+			status(f, start, isatty(STDERR_FILENO) ? "\r" : "\n");
+		}
+	}
+	status(f, start, "\n");
+	int found = f->crashes + f->hangs > INT32_MAX ? INT32_MAX : (int) (f->crashes + f->hangs);
+	lc3_fuzzer_destroy(f);
+	return found;
+}
@@ -0,0 +1,237 @@
+#include "lc3.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Loop idioms
+ * LC-3 has no multiply, divide or block move, so guests spin through
+ * loops like these. With vm->fuse set the record at the head of one runs
+ * the whole loop natively and leaves registers, R_COND, memory and
+ * retired as the loop would have.
+ *
+ *   D_MUL_LOOP   L: ADD Ra, Ra, Rb|#imm     D_DIV_LOOP   L: ADD Ra, Ra, Rn|#-imm
+ *                   ADD Rc, Rc, #-1                         BRn out
+ *                   BRp L                                   ADD Rq, Rq, #1
+ *                                                           BR L
+ *   D_COPY_LOOP  L: LDR Rt, Rs, #a          D_FILL_LOOP  L: STR Rv, Rd, #b
+ *                   STR Rt, Rd, #b                          ADD Rd, Rd, #1
+ *                   ADD Rs, Rs, #1                          ADD Rc, Rc, #-1
+ *                   ADD Rd, Rd, #1                          BRp L
+ *                   ADD Rc, Rc, #-1
+ *                   BRp L
+ *
+ * The registers named differently must be different. */
+
+static bool is_addi(const lc3_decoded* d, int r, int imm) {
+	return d->handler == D_ADDI && d->dst == r && d->src1 == r && d->imm == imm;
+}
+
+/* BR with exactly nzp back to the head, from the last of len records */
+static bool is_loop_br(const lc3_decoded* d, int nzp, int len) {
+	return d->handler == D_BR && d->dst == nzp && d->imm == -len;
+}
+
+/* ADD Ra, Ra, x */
+static bool is_accumulate(const lc3_decoded* d) {
+	return (d->handler == D_ADD || d->handler == D_ADDI) && d->dst == d->src1 &&
+			(d->handler == D_ADDI || d->src2 != d->dst);
+}
+
+static bool distinct(int a, int b, int c, int d) {
+	return a != b && a != c && a != d && b != c && b != d && c != d;
+}
+
+uint8_t idiom_match(const lc3_decoded* loop, int n, int* len) {
+	const lc3_decoded* d = loop;
+	if (n >= 2 && is_accumulate(&d[0]) && is_addi(&d[1], d[1].dst, -1) &&
+			is_loop_br(&d[2], FL_POS, 3) && d[1].dst != d[0].dst && (d[0].handler == D_ADDI || d[1].dst != d[0].src2)) {
+		*len = 3;
+		return D_MUL_LOOP;
+	}
+	if (n >= 3 && is_accumulate(&d[0]) && (d[0].handler == D_ADD || d[0].imm < 0) &&
+			d[1].handler == D_BR && d[1].dst == FL_NEG &&
+			is_addi(&d[2], d[2].dst, 1) && d[2].dst != d[0].dst &&
+			(d[0].handler == D_ADDI || d[2].dst != d[0].src2) &&
+			is_loop_br(&d[3], FL_NEG | FL_ZRO | FL_POS, 4)) {
+		*len = 4;
+		return D_DIV_LOOP;
+	}
+	if (n >= 5 && d[0].handler == D_LDR && d[1].handler == D_STR && d[1].dst == d[0].dst &&
+			is_addi(&d[2], d[0].src1, 1) && is_addi(&d[3], d[1].src1, 1) &&
+			is_addi(&d[4], d[4].dst, -1) &&
+			is_loop_br(&d[5], FL_POS, 6) &&
+			distinct(d[0].dst, d[0].src1, d[1].src1, d[4].dst)) {
+		*len = 6;
+		return D_COPY_LOOP;
+	}
+	if (n >= 3 && d[0].handler == D_STR && is_addi(&d[1], d[0].src1, 1) &&
+			is_addi(&d[2], d[2].dst, -1) &&
+			is_loop_br(&d[3], FL_POS, 4) &&
+			d[0].dst != d[0].src1 && d[0].dst != d[2].dst && d[0].src1 != d[2].dst) {
+		*len = 4;
+		return D_FILL_LOOP;
+	}
+	return D_DECODE;
+}
+
+/* times an "ADD Rc, Rc, #-1; BRp" loop goes round with Rc = c at its head */
+static uint32_t trips(uint16_t c) {
+	uint16_t left = c - 1;
+	return (int16_t) left > 0 ? (uint32_t) left + 1 : 1;
+}
+
+/* [loc, loc + n) does not wrap and holds no device registers, nor any
+ * code if the loop writes it */
+static bool plain(lc3_vm* vm, uint16_t loc, uint32_t n, bool write) {
+	if (loc + n > MEMORY_SIZE) {
+		return false;
+	}
+	uint32_t i;
+	for (i = IO_PAGE(loc); i <= IO_PAGE(loc + n - 1); i++) {
+		if (vm->io_page[i]) {
+			return false;
+		}
+	}
+	if (write) {
+		for (i = loc; i < loc + n; i++) {
+			if (vm->code_map[i]) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+static void mark_dirty(lc3_vm* vm, uint16_t loc, uint32_t n) {
+	uint32_t i;
+	for (i = DIRTY_PAGE(loc); i <= DIRTY_PAGE(loc + n - 1); i++) {
+		vm->dirty[i] = 1;
+	}
+}
+
+/* the rest of the loop after its first instruction, which the engine
+ * has already counted, fits before stop_at */
+static bool fits(lc3_vm* vm, uint64_t instrs) {
+	return vm->retired + instrs - 1 <= vm->stop_at;
+}
+
+/* the loop at d has run, or d is what to run instruction by instruction.
+ * Operands the loop cannot be run natively for turn d back into a plain
+ * record, so the check is not repeated every time round. */
+bool idiom_run(lc3_vm* vm, lc3_decoded* d) {
+	uint16_t* reg = vm->registers;
+	uint16_t pc = reg[R_PC] - 1;
+	uint64_t* count = vm->stats.handlers;
+	/* d[0] is the loop's record now, the word says if it was ADD or ADDI */
+	bool by_reg = !((vm->memory[pc] >> 5) & 1);
+
+	switch (d->handler) {
+		case D_MUL_LOOP: {
+			int rc = d[1].dst;
+			uint32_t k = trips(reg[rc]);
+			if (!fits(vm, 3 * k)) {
+				return false;
+			}
+			uint16_t add = by_reg ? reg[d[0].src2] : d[0].imm;
+			reg[d[0].dst] += (uint16_t) (k * add);
+			reg[rc] -= k;
+			update_flags(vm, rc);
+			reg[R_PC] = pc + 3;
+			vm->retired += 3 * k - 1;
+			count[by_reg ? D_ADD : D_ADDI] += k;
+			count[D_ADDI] += k;
+			count[D_BR] += k;
+			return true;
+		}
+		case D_DIV_LOOP: {
+			int ra = d[0].dst;
+			int16_t a = reg[ra];
+			int32_t div = by_reg ? -(int16_t) reg[d[0].src2] : -d[0].imm;
+			if (a < 0 || div <= 0 || div > INT16_MAX) {
+				break;
+			}
+			uint32_t q = a / div;
+			if (!fits(vm, 4 * (uint64_t) q + 2)) {
+				return false;
+			}
+			reg[ra] = a - (int32_t) (q + 1) * div;
+			reg[d[2].dst] += q;
+			update_flags(vm, ra);
+			reg[R_PC] = pc + 2 + d[1].imm;
+			vm->retired += 4 * (uint64_t) q + 1;
+			count[by_reg ? D_ADD : D_ADDI] += q + 1;
+			count[D_BR] += 2 * q + 1;
+			count[D_ADDI] += q;
+			return true;
+		}
+		case D_COPY_LOOP: {
+			int rc = d[4].dst;
+			uint32_t k = trips(reg[rc]);
+			if (!fits(vm, 6 * k)) {
+				return false;
+			}
+			uint16_t src = reg[d[0].src1] + d[0].imm;
+			uint16_t dst = reg[d[1].src1] + d[1].imm;
+			if (!plain(vm, src, k, false) || !plain(vm, dst, k, true)) {
+				break;
+			}
+			mark_dirty(vm, dst, k);
+			uint16_t* mem = vm->memory;
+			if (dst <= src || dst >= src + k) {
+				memmove(mem + dst, mem + src, k * sizeof(uint16_t));
+			} else {
+				/* the loop copies what it has just written again */
+				uint32_t i;
+				for (i = 0; i < k; i++) {
+					mem[dst + i] = mem[src + i];
+				}
+			}
+			reg[d[0].dst] = mem[dst + k - 1];
+			reg[d[0].src1] += k;
+			reg[d[1].src1] += k;
+			reg[rc] -= k;
+			update_flags(vm, rc);
+			reg[R_PC] = pc + 6;
+			vm->retired += 6 * k - 1;
+			count[D_LDR] += k;
+			count[D_STR] += k;
+			count[D_ADDI] += 3 * k;
+			count[D_BR] += k;
+			return true;
+		}
+		case D_FILL_LOOP: {
+			int rc = d[2].dst;
+			uint32_t k = trips(reg[rc]);
+			if (!fits(vm, 4 * k)) {
+				return false;
+			}
+			uint16_t dst = reg[d[0].src1] + d[0].imm;
+			if (!plain(vm, dst, k, true)) {
+				break;
+			}
+			mark_dirty(vm, dst, k);
+			uint16_t val = reg[d[0].dst];
+			uint16_t* mem = vm->memory + dst;
+			if (val == 0) {
+				memset(mem, 0, k * sizeof(uint16_t));
+			} else {
+				uint32_t i;
+				for (i = 0; i < k; i++) {
+					mem[i] = val;
+				}
+			}
+			reg[d[0].src1] += k;
+			reg[rc] -= k;
+			update_flags(vm, rc);
+			reg[R_PC] = pc + 4;
+			vm->retired += 4 * k - 1;
+			count[D_STR] += k;
+			count[D_ADDI] += 2 * k;
+			count[D_BR] += k;
+			return true;
+		}
+	}
+	lc3_decode(vm->memory[pc], d);
+	return false;
+}
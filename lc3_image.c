@@ -0,0 +1,221 @@
+#define _GNU_SOURCE /* memfd_create */
+#include "lc3.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+/* Image loading
+ * An image is a big-endian origin followed by big-endian words. Files
+ * are mapped rather than read and swapped into memory[] 16 or 8 words at
+ * a time with pshufb when the CPU has AVX2 or SSSE3. lc3_image_load()
+ * does this once into a memfd that any number of VMs then map. */
+
+typedef struct {
+	const char* path;
+	uint8_t* data;  /* the whole file */
+	size_t size;
+	uint16_t origin;
+	uint32_t count; /* words loaded at origin */
+} mapped_image;
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static size_t swap_avx2(uint16_t* dst, const uint8_t* src, size_t n) {
+	const __m256i shuf = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+			1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+	size_t i;
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m256i v = _mm256_loadu_si256((const __m256i*) (src + 2 * i));
+		_mm256_storeu_si256((__m256i*) (dst + i), _mm256_shuffle_epi8(v, shuf));
+	}
+	return i;
+}
+
+__attribute__((target("ssse3")))
+static size_t swap_ssse3(uint16_t* dst, const uint8_t* src, size_t n) {
+	const __m128i shuf = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+	size_t i;
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i*) (src + 2 * i));
+		_mm_storeu_si128((__m128i*) (dst + i), _mm_shuffle_epi8(v, shuf));
+	}
+	return i;
+}
+#endif
+
+/* n big-endian words from src to host order in dst, dst may be src */
+static void swap_words(uint16_t* dst, const uint8_t* src, size_t n) {
+	size_t i = 0;
+#if defined(__x86_64__) || defined(__i386__)
+	if (__builtin_cpu_supports("avx2")) {
+		i = swap_avx2(dst, src, n);
+	} else if (__builtin_cpu_supports("ssse3")) {
+		i = swap_ssse3(dst, src, n);
+	}
+#endif
+	for (; i < n; i++) {
+		dst[i] = (src[2 * i] << 8) | src[2 * i + 1];
+	}
+}
+
+void read_image_file(lc3_vm* vm, FILE* file) {
+	/* the origin tells us where in memory to place the image */
+	uint8_t be[2];
+	if (fread(be, sizeof(be), 1, file) != 1) {
+		return;
+	}
+	uint16_t origin = (be[0] << 8) | be[1];
+
+	/* we know the maximum file size so we only need one fread */
+	uint16_t* p = vm->memory + origin;
+	size_t read = fread(p, sizeof(uint16_t), MEMORY_SIZE - origin, file);
+	swap_words(p, (uint8_t*) p, read);
+}
+
+static bool map_image(const char* path, mapped_image* img) {
+	memset(img, 0, sizeof(mapped_image));
+	img->path = path;
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0 || st.st_size < 2) {
+		fprintf(stderr, "%s: not an image\n", path);
+		close(fd);
+		return false;
+	}
+	img->size = st.st_size;
+	img->data = mmap(NULL, img->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (img->data == MAP_FAILED) {
+		img->data = NULL;
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return false;
+	}
+
+	img->origin = (img->data[0] << 8) | img->data[1];
+	img->count = (img->size - 2) / 2;
+	if (img->count > MEMORY_SIZE - img->origin) {
+		fprintf(stderr, "%s: runs past xFFFF, truncated\n", path);
+		img->count = MEMORY_SIZE - img->origin;
+	}
+	return true;
+}
+
+static bool images_collide(mapped_image* imgs, int count) {
+	bool collide = false;
+	int i, k;
+	for (i = 0; i < count; i++) {
+		for (k = i + 1; k < count; k++) {
+			mapped_image* a = &imgs[i];
+			mapped_image* b = &imgs[k];
+			if (a->count == 0 || b->count == 0) {
+				continue;
+			}
+			uint32_t start = a->origin > b->origin ? a->origin : b->origin;
+			uint32_t end_a = a->origin + a->count - 1;
+			uint32_t end_b = b->origin + b->count - 1;
+			uint32_t end = end_a < end_b ? end_a : end_b;
+			if (start <= end) {
+				fprintf(stderr, "%s and %s overlap at x%04X-x%04X\n",
+						a->path, b->path, start, end);
+				collide = true;
+			}
+		}
+	}
+	return collide;
+}
+
+static bool load_images(uint16_t* memory, char* const* paths, int count) {
+	mapped_image* imgs = calloc(count, sizeof(mapped_image));
+	if (!imgs) {
+		return false;
+	}
+
+	bool ok = true;
+	int i;
+	for (i = 0; i < count && ok; i++) {
+		ok = map_image(paths[i], &imgs[i]);
+	}
+	if (ok && images_collide(imgs, count)) {
+		ok = false;
+	}
+	for (i = 0; i < count; i++) {
+		if (ok) {
+			swap_words(memory + imgs[i].origin, imgs[i].data + 2, imgs[i].count);
+		}
+		if (imgs[i].data) {
+			munmap(imgs[i].data, imgs[i].size);
+		}
+	}
+
+	free(imgs);
+	return ok;
+}
+
+bool lc3_load_images(lc3_vm* vm, char* const* paths, int count) {
+	return load_images(vm->memory, paths, count);
+}
+
+int read_image(lc3_vm* vm, const char* image_path) {
+	return lc3_load_images(vm, (char* const*) &image_path, 1);
+}
+
+lc3_image* lc3_image_load(char* const* paths, int count) {
+	size_t size = MEMORY_SIZE * sizeof(uint16_t);
+	int fd = memfd_create("lc3-image", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0) {
+		perror("memfd_create");
+		return NULL;
+	}
+	if (ftruncate(fd, size) < 0) {
+		perror("ftruncate");
+		close(fd);
+		return NULL;
+	}
+
+	uint16_t* memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (memory == MAP_FAILED) {
+		perror("mmap");
+		close(fd);
+		return NULL;
+	}
+	bool ok = load_images(memory, paths, count);
+	munmap(memory, size);
+
+	/* nothing may change the pages VMs share from now on */
+	if (ok && fcntl(fd, F_ADD_SEALS, F_SEAL_WRITE | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+		perror("fcntl");
+		ok = false;
+	}
+	lc3_image* image = ok ? malloc(sizeof(lc3_image)) : NULL;
+	if (!image) {
+		close(fd);
+		return NULL;
+	}
+	image->fd = fd;
+	return image;
+}
+
+void lc3_image_free(lc3_image* image) {
+	if (image) {
+		close(image->fd);
+		free(image);
+	}
+}
@@ -0,0 +1,680 @@
+#include "lc3.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <stddef.h>
+
+#include <sys/mman.h>
+
+#if defined(__x86_64__)
+
+/* Basic block JIT
+ * Blocks start at a guest pc that was reached JIT_THRESHOLD times and run
+ * until BR/JMP/JSR/JSRR or the first instruction the JIT leaves to the
+ * interpreter (TRAP, RTI, reserved, device pages). Inside a block guest
+ * R0-R7 live in host r8-r15 and the condition codes are only computed at
+ * exits. Loads whose address is only known at run time leave the block
+ * for device pages (io_page), stores for any word flagged in code_map,
+ * the interpreter then runs that instruction through mem_read() or
+ * mem_write(). */
+
+#define JIT_THRESHOLD 16
+#define JIT_NEVER 0xFF
+#define JIT_MAX_INSTRS 64
+#define JIT_MAX_BLOCKS 4096
+#define JIT_CODE_SIZE (4 << 20)
+#define JIT_BLOCK_RESERVE (16 << 10) /* worst case code for one block */
+#define JIT_MAX_EXITS (JIT_MAX_INSTRS * 2)
+#define JIT_MAX_COUNTERS (64 << 10)
+
+typedef void (*jit_block)(lc3_vm* vm, uint16_t* mem, uint8_t* code_map);
+
+/* side exits waiting to be emitted after the block body */
+typedef struct {
+	size_t patch;   /* rel32 of the jcc jumping to the exit */
+	uint16_t pc;
+	int flag_src;
+	int retired;    /* guest instructions completed before the exit */
+} jit_exit;
+
+typedef struct {
+	uint64_t taken;
+	uint32_t handlers; /* index of the block's first D_* in handlers[] */
+	uint32_t retired;
+} exit_counter;
+
+struct lc3_jit {
+	jit_block blocks[MEMORY_SIZE];
+	uint8_t heat[MEMORY_SIZE];
+	struct {
+		uint16_t start;
+		uint16_t end; /* last guest word of the block */
+	} ranges[JIT_MAX_BLOCKS];
+	int range_count;
+
+	uint8_t* code;
+	size_t code_used;
+
+	jit_exit exits[JIT_MAX_EXITS];
+	int exit_count;
+
+	/* stats: how often each exit was taken, and the D_* of every
+	 * compiled block, which give the instructions run per handler */
+	exit_counter counters[JIT_MAX_COUNTERS];
+	int counter_count;
+	uint8_t handlers[JIT_MAX_BLOCKS * JIT_MAX_INSTRS];
+	size_t handlers_used;
+};
+
+/* host registers */
+enum {
+	H_RAX = 0,
+	H_RCX = 1,
+	H_RDX = 2,
+	H_RSI = 6,
+	H_RDI = 7,
+	H_R8 = 8 /* guest R0, R1 is r9 ... R7 is r15 */
+};
+
+/* x86 condition codes for jcc */
+enum {
+	CC_AE = 0x3,
+	CC_E = 0x4,
+	CC_NE = 0x5,
+	CC_S = 0x8,
+	CC_NS = 0x9,
+	CC_LE = 0xE,
+	CC_G = 0xF
+};
+
+/* blocks get the VM as their registers pointer */
+_Static_assert(offsetof(lc3_vm, registers) == 0, "registers must be first in lc3_vm");
+
+#define REG_OFF(r) ((r) * 2) /* offset of registers[r] */
+
+static void emit8(lc3_jit* j, uint8_t b) {
+	j->code[j->code_used++] = b;
+}
+
+static void emit16(lc3_jit* j, uint16_t w) {
+	memcpy(j->code + j->code_used, &w, 2);
+	j->code_used += 2;
+}
+
+static void emit32(lc3_jit* j, uint32_t d) {
+	memcpy(j->code + j->code_used, &d, 4);
+	j->code_used += 4;
+}
+
+static void patch32(lc3_jit* j, size_t at, size_t target) {
+	int32_t rel = (int32_t) (target - (at + 4));
+	memcpy(j->code + at, &rel, 4);
+}
+
+static uint8_t guest(int r) {
+	return H_R8 + r;
+}
+
+static void emit_rex(lc3_jit* j, int w, int reg, int rm) {
+	uint8_t rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | (rm >> 3);
+	if (rex != 0x40) {
+		emit8(j, rex);
+	}
+}
+
+static void emit_modrm(lc3_jit* j, int mod, int reg, int rm) {
+	emit8(j, (mod << 6) | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* movzx dst32, word [rdi + disp8] */
+static void emit_load_reg(lc3_jit* j, int host, int r) {
+	emit_rex(j, 0, host, H_RDI);
+	emit8(j, 0x0F); emit8(j, 0xB7);
+	emit_modrm(j, 1, host, H_RDI);
+	emit8(j, REG_OFF(r));
+}
+
+/* mov word [rdi + disp8], src16 */
+static void emit_store_reg(lc3_jit* j, int r, int host) {
+	emit8(j, 0x66);
+	emit_rex(j, 0, host, H_RDI);
+	emit8(j, 0x89);
+	emit_modrm(j, 1, host, H_RDI);
+	emit8(j, REG_OFF(r));
+}
+
+/* mov word [rdi + disp8], imm16 */
+static void emit_store_reg_imm(lc3_jit* j, int r, uint16_t imm) {
+	emit8(j, 0x66); emit8(j, 0xC7);
+	emit_modrm(j, 1, 0, H_RDI);
+	emit8(j, REG_OFF(r));
+	emit16(j, imm);
+}
+
+/* mov dst32, src32 */
+static void emit_mov(lc3_jit* j, int dst, int src) {
+	emit_rex(j, 0, src, dst);
+	emit8(j, 0x89);
+	emit_modrm(j, 3, src, dst);
+}
+
+/* mov dst32, imm32 */
+static void emit_mov_imm(lc3_jit* j, int dst, uint32_t imm) {
+	emit_rex(j, 0, 0, dst);
+	emit8(j, 0xB8 + (dst & 7));
+	emit32(j, imm);
+}
+
+/* movzx dst32, src16 */
+static void emit_movzx(lc3_jit* j, int dst, int src) {
+	emit_rex(j, 0, dst, src);
+	emit8(j, 0x0F); emit8(j, 0xB7);
+	emit_modrm(j, 3, dst, src);
+}
+
+/* 16 bit op dst, src: add 0x01, and 0x21, test 0x85 */
+static void emit_alu16(lc3_jit* j, uint8_t op, int dst, int src) {
+	emit8(j, 0x66);
+	emit_rex(j, 0, src, dst);
+	emit8(j, op);
+	emit_modrm(j, 3, src, dst);
+}
+
+/* 16 bit op dst, imm16: add /0, and /4 */
+static void emit_alu16_imm(lc3_jit* j, int ext, int dst, uint16_t imm) {
+	emit8(j, 0x66);
+	emit_rex(j, 0, 0, dst);
+	emit8(j, 0x81);
+	emit_modrm(j, 3, ext, dst);
+	emit16(j, imm);
+}
+
+/* movzx dst32, word [rsi + disp32] */
+static void emit_load_mem(lc3_jit* j, int dst, uint16_t addr) {
+	emit_rex(j, 0, dst, H_RSI);
+	emit8(j, 0x0F); emit8(j, 0xB7);
+	emit_modrm(j, 2, dst, H_RSI);
+	emit32(j, addr * 2);
+}
+
+/* movzx dst32, word [rsi + rax * 2] */
+static void emit_load_mem_rax(lc3_jit* j, int dst) {
+	emit_rex(j, 0, dst, 0);
+	emit8(j, 0x0F); emit8(j, 0xB7);
+	emit_modrm(j, 0, dst, 4);
+	emit8(j, 0x46);
+}
+
+/* mov word [rsi + disp32], src16 */
+static void emit_store_mem(lc3_jit* j, uint16_t addr, int src) {
+	emit8(j, 0x66);
+	emit_rex(j, 0, src, H_RSI);
+	emit8(j, 0x89);
+	emit_modrm(j, 2, src, H_RSI);
+	emit32(j, addr * 2);
+}
+
+/* mov word [rsi + rax * 2], src16 */
+static void emit_store_mem_rax(lc3_jit* j, int src) {
+	emit8(j, 0x66);
+	emit_rex(j, 0, src, 0);
+	emit8(j, 0x89);
+	emit_modrm(j, 0, src, 4);
+	emit8(j, 0x46);
+}
+
+/* mov byte [rdi + dirty + page], 1 */
+static void emit_mark_dirty(lc3_jit* j, uint16_t addr) {
+	emit8(j, 0xC6); emit_modrm(j, 2, 0, H_RDI);
+	emit32(j, offsetof(lc3_vm, dirty) + DIRTY_PAGE(addr)); emit8(j, 1);
+}
+
+/* same for the address in eax */
+static void emit_mark_dirty_rax(lc3_jit* j) {
+	emit8(j, 0x89); emit8(j, 0xC1);             /* mov ecx, eax */
+	emit8(j, 0xC1); emit8(j, 0xE9); emit8(j, 9); /* shr ecx, 9 */
+	/* mov byte [rdi + rcx + dirty], 1 */
+	emit8(j, 0xC6); emit8(j, 0x84); emit8(j, 0x0F);
+	emit32(j, offsetof(lc3_vm, dirty)); emit8(j, 1);
+}
+
+/* jcc rel32, returns where the rel32 has to be patched */
+static size_t emit_jcc(lc3_jit* j, uint8_t cc) {
+	emit8(j, 0x0F); emit8(j, 0x80 | cc);
+	emit32(j, 0);
+	return j->code_used - 4;
+}
+
+static void add_exit(lc3_jit* j, size_t patch, uint16_t pc, int flag_src, int retired) {
+	j->exits[j->exit_count].patch = patch;
+	j->exits[j->exit_count].pc = pc;
+	j->exits[j->exit_count].flag_src = flag_src;
+	j->exits[j->exit_count].retired = retired;
+	j->exit_count++;
+}
+
+/* leave the block if eax is in a device page */
+static void emit_io_check(lc3_jit* j, uint16_t pc, int flag_src, int retired) {
+	emit8(j, 0x89); emit8(j, 0xC1);             /* mov ecx, eax */
+	emit8(j, 0xC1); emit8(j, 0xE9); emit8(j, 8); /* shr ecx, 8 */
+	/* cmp byte [rdi + rcx + io_page], 0 */
+	emit8(j, 0x80); emit8(j, 0xBC); emit8(j, 0x0F);
+	emit32(j, offsetof(lc3_vm, io_page)); emit8(j, 0x00);
+	add_exit(j, emit_jcc(j, CC_NE), pc, flag_src, retired);
+}
+
+/* leave the block if a store to eax would hit cached code or a device */
+static void emit_code_check(lc3_jit* j, uint16_t pc, int flag_src, int retired) {
+	emit8(j, 0x80); emit8(j, 0x3C); emit8(j, 0x02); emit8(j, 0x00); /* cmp byte [rdx + rax], 0 */
+	add_exit(j, emit_jcc(j, CC_NE), pc, flag_src, retired);
+}
+
+static void emit_code_check_imm(lc3_jit* j, uint16_t addr, uint16_t pc, int flag_src, int retired) {
+	emit8(j, 0x80); emit_modrm(j, 2, 7, H_RDX); emit32(j, addr); emit8(j, 0x00); /* cmp byte [rdx + addr], 0 */
+	add_exit(j, emit_jcc(j, CC_NE), pc, flag_src, retired);
+}
+
+/* registers[R_COND] = N/Z/P of the guest register in flag_src */
+static void emit_flags(lc3_jit* j, int flag_src) {
+	emit_alu16(j, 0x85, guest(flag_src), guest(flag_src)); /* test */
+	emit8(j, 0x0F); emit8(j, 0x94); emit8(j, 0xC0);           /* setz al */
+	emit8(j, 0x0F); emit8(j, 0x98); emit8(j, 0xC1);           /* sets cl */
+	emit8(j, 0x0F); emit8(j, 0xB6); emit8(j, 0xC0);           /* movzx eax, al */
+	emit8(j, 0x0F); emit8(j, 0xB6); emit8(j, 0xC9);           /* movzx ecx, cl */
+	emit8(j, 0x8D); emit8(j, 0x44); emit8(j, 0x48); emit8(j, 0x01); /* lea eax, [rax + rcx * 2 + 1] */
+	emit8(j, 0x01); emit8(j, 0xC8);                        /* add eax, ecx */
+	emit8(j, 0x66); emit8(j, 0x89); emit_modrm(j, 1, H_RAX, H_RDI); emit8(j, REG_OFF(R_COND));
+}
+
+/* one more trip through this exit, its counter says which handlers ran */
+static void emit_exit_counter(lc3_jit* j, int retired) {
+	exit_counter* c = &j->counters[j->counter_count++];
+	c->taken = 0;
+	c->handlers = j->handlers_used;
+	c->retired = retired;
+	emit8(j, 0x48); emit8(j, 0xB8); /* mov rax, imm64 */
+	uint64_t addr = (uint64_t) &c->taken;
+	emit32(j, (uint32_t) addr);
+	emit32(j, (uint32_t) (addr >> 32));
+	emit8(j, 0x48); emit8(j, 0xFF); emit8(j, 0x00); /* inc qword [rax] */
+}
+
+/* write guest state back and return, pc_reg < 0 means the pc is known */
+static void emit_exit(lc3_jit* j, uint16_t pc, int pc_reg, int flag_src, int retired) {
+	int r;
+	if (retired > 0) {
+		/* add qword [rdi + retired], imm32 */
+		emit8(j, 0x48); emit8(j, 0x81); emit_modrm(j, 2, 0, H_RDI);
+		emit32(j, offsetof(lc3_vm, retired));
+		emit32(j, retired);
+		emit_exit_counter(j, retired);
+	}
+	for (r = R_0; r <= R_7; r++) {
+		emit_store_reg(j, r, guest(r));
+	}
+	if (pc_reg >= 0) {
+		emit_store_reg(j, R_PC, guest(pc_reg));
+	} else {
+		emit_store_reg_imm(j, R_PC, pc);
+	}
+	if (flag_src >= 0) {
+		emit_flags(j, flag_src);
+	}
+	for (r = 15; r >= 12; r--) {
+		emit8(j, 0x41); emit8(j, 0x58 + (r & 7)); /* pop */
+	}
+	emit8(j, 0xC3);
+}
+
+static void emit_prologue(lc3_jit* j) {
+	int r;
+	for (r = 12; r <= 15; r++) {
+		emit8(j, 0x41); emit8(j, 0x50 + (r & 7)); /* push */
+	}
+	for (r = R_0; r <= R_7; r++) {
+		emit_load_reg(j, guest(r), r);
+	}
+}
+
+/* jcc that is taken when BR with this nzp mask branches on flag_src */
+static uint8_t br_cc(uint8_t nzp) {
+	switch (nzp) {
+		case FL_NEG: return CC_S;
+		case FL_ZRO: return CC_E;
+		case FL_POS: return CC_G;
+		case FL_NEG | FL_ZRO: return CC_LE;
+		case FL_NEG | FL_POS: return CC_NE;
+		default: return CC_NS; /* FL_ZRO | FL_POS */
+	}
+}
+
+static void count_handlers(lc3_jit* j, uint64_t* handlers) {
+	int i;
+	uint32_t k;
+	for (i = 0; i < j->counter_count; i++) {
+		exit_counter* c = &j->counters[i];
+		for (k = 0; c->taken && k < c->retired; k++) {
+			handlers[j->handlers[c->handlers + k]] += c->taken;
+		}
+	}
+}
+
+static void flush(lc3_vm* vm) {
+	lc3_jit* j = vm->jit;
+	count_handlers(j, vm->stats.handlers);
+	j->counter_count = 0;
+	j->handlers_used = 0;
+	memset(j->blocks, 0, sizeof(j->blocks));
+	memset(j->heat, 0, sizeof(j->heat));
+	j->range_count = 0;
+	j->code_used = 0;
+}
+
+static jit_block compile(lc3_vm* vm, uint16_t start) {
+	lc3_jit* j = vm->jit;
+
+	if (j->code_used + JIT_BLOCK_RESERVE > JIT_CODE_SIZE || j->range_count == JIT_MAX_BLOCKS ||
+			j->counter_count + JIT_MAX_EXITS + 1 > JIT_MAX_COUNTERS) {
+		flush(vm);
+	}
+
+	size_t entry = j->code_used;
+	uint16_t pc = start;
+	int flag_src = -1;
+	int count = 0;
+	bool done = false;
+	j->exit_count = 0;
+	int counters = j->counter_count;
+	uint8_t* handlers = j->handlers + j->handlers_used;
+
+	emit_prologue(j);
+
+	/* never runs into MMIO space, so blocks do not wrap around 0xFFFF */
+	while (!done && count < JIT_MAX_INSTRS && pc != 0xFFFF && !vm->io_page[IO_PAGE(pc)] &&
+			vm->decoded[pc].handler != D_BREAK) {
+		lc3_decoded d;
+		bool compiled = true;
+		lc3_decode(vm->memory[pc], &d);
+		handlers[count] = d.handler;
+		uint16_t next = pc + 1;
+		uint16_t addr = next + d.imm;
+
+		switch (d.handler) {
+			case D_ADD:
+			case D_AND:
+				emit_mov(j, H_RAX, guest(d.src1));
+				emit_alu16(j, d.handler == D_ADD ? 0x01 : 0x21, H_RAX, guest(d.src2));
+				emit_mov(j, guest(d.dst), H_RAX);
+				flag_src = d.dst;
+				break;
+			case D_ADDI:
+			case D_ANDI:
+				emit_mov(j, H_RAX, guest(d.src1));
+				emit_alu16_imm(j, d.handler == D_ADDI ? 0 : 4, H_RAX, d.imm);
+				emit_mov(j, guest(d.dst), H_RAX);
+				flag_src = d.dst;
+				break;
+			case D_NOT:
+				emit_mov(j, H_RAX, guest(d.src1));
+				emit8(j, 0x66); emit8(j, 0xF7); emit8(j, 0xD0); /* not ax */
+				emit_mov(j, guest(d.dst), H_RAX);
+				flag_src = d.dst;
+				break;
+			case D_LEA:
+				emit_mov_imm(j, guest(d.dst), addr);
+				flag_src = d.dst;
+				break;
+			case D_LD:
+				if (vm->io_page[IO_PAGE(addr)]) {
+					compiled = false;
+					break;
+				}
+				emit_load_mem(j, guest(d.dst), addr);
+				flag_src = d.dst;
+				break;
+			case D_LDR:
+				emit_movzx(j, H_RAX, guest(d.src1));
+				emit_alu16_imm(j, 0, H_RAX, d.imm);
+				emit_io_check(j, pc, flag_src, count);
+				emit_load_mem_rax(j, guest(d.dst));
+				flag_src = d.dst;
+				break;
+			case D_LDI:
+				if (vm->io_page[IO_PAGE(addr)]) {
+					compiled = false;
+					break;
+				}
+				emit_load_mem(j, H_RAX, addr);
+				emit_io_check(j, pc, flag_src, count);
+				emit_load_mem_rax(j, guest(d.dst));
+				flag_src = d.dst;
+				break;
+			case D_ST:
+				if (vm->io_page[IO_PAGE(addr)]) {
+					compiled = false;
+					break;
+				}
+				emit_code_check_imm(j, addr, pc, flag_src, count);
+				emit_mark_dirty(j, addr);
+				emit_store_mem(j, addr, guest(d.dst));
+				break;
+			case D_STR:
+				emit_movzx(j, H_RAX, guest(d.src1));
+				emit_alu16_imm(j, 0, H_RAX, d.imm);
+				emit_code_check(j, pc, flag_src, count);
+				emit_mark_dirty_rax(j);
+				emit_store_mem_rax(j, guest(d.dst));
+				break;
+			case D_STI:
+				if (vm->io_page[IO_PAGE(addr)]) {
+					compiled = false;
+					break;
+				}
+				emit_load_mem(j, H_RAX, addr);
+				emit_code_check(j, pc, flag_src, count);
+				emit_mark_dirty_rax(j);
+				emit_store_mem_rax(j, guest(d.dst));
+				break;
+			case D_BR:
+				if (d.dst == 0) {
+					break; /* never taken */
+				}
+				if (d.dst != (FL_NEG | FL_ZRO | FL_POS)) {
+					size_t taken;
+					if (flag_src >= 0) {
+						emit_alu16(j, 0x85, guest(flag_src), guest(flag_src));
+						taken = emit_jcc(j, br_cc(d.dst));
+					} else {
+						/* test word [rdi + R_COND], nzp */
+						emit8(j, 0x66); emit8(j, 0xF7); emit_modrm(j, 1, 0, H_RDI); emit8(j, REG_OFF(R_COND));
+						emit16(j, d.dst);
+						taken = emit_jcc(j, CC_NE);
+					}
+					emit_exit(j, next, -1, flag_src, count + 1);
+					patch32(j, taken, j->code_used);
+				}
+				emit_exit(j, addr, -1, flag_src, count + 1);
+				done = true;
+				break;
+			case D_JMP:
+				emit_exit(j, 0, d.src1, flag_src, count + 1);
+				done = true;
+				break;
+			case D_JSR:
+			case D_JSRR:
+				if (flag_src == R_7) {
+					emit_flags(j, flag_src);
+					flag_src = -1;
+				}
+				emit_mov_imm(j, guest(R_7), next);
+				if (d.handler == D_JSR) {
+					emit_exit(j, next + d.imm, -1, flag_src, count + 1);
+				} else {
+					emit_exit(j, 0, d.src1, flag_src, count + 1);
+				}
+				done = true;
+				break;
+			default:
+				compiled = false;
+		}
+
+		if (!compiled) {
+			break;
+		}
+		pc++;
+		count++;
+	}
+
+	if (count == 0) {
+		j->code_used = entry;
+		j->counter_count = counters;
+		return NULL;
+	}
+
+	if (!done) {
+		emit_exit(j, pc, -1, flag_src, count);
+	}
+	pc--; /* last guest word of the block */
+
+	int i;
+	for (i = 0; i < j->exit_count; i++) {
+		patch32(j, j->exits[i].patch, j->code_used);
+		emit_exit(j, j->exits[i].pc, -1, j->exits[i].flag_src, j->exits[i].retired);
+	}
+
+	memset(vm->code_map + start, MAP_CODE, pc - start + 1);
+	j->handlers_used += count;
+
+	j->ranges[j->range_count].start = start;
+	j->ranges[j->range_count].end = pc;
+	j->range_count++;
+
+	return (jit_block) (j->code + entry);
+}
+
+static bool jit_init(lc3_vm* vm) {
+	if (vm->jit) {
+		return true;
+	}
+	lc3_jit* j = calloc(1, sizeof(lc3_jit));
+	if (!j) {
+		return false;
+	}
+	void* p = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		free(j);
+		return false;
+	}
+	j->code = p;
+	vm->jit = j;
+	return true;
+}
+
+void jit_count(lc3_vm* vm, uint64_t* handlers) {
+	if (vm->jit) {
+		count_handlers(vm->jit, handlers);
+	}
+}
+
+void jit_destroy(lc3_jit* j) {
+	munmap(j->code, JIT_CODE_SIZE);
+	free(j);
+}
+
+static bool ends_block(uint8_t handler) {
+	switch (handler) {
+		case D_BR:
+		case D_JMP:
+		case D_JSR:
+		case D_JSRR:
+		case D_TRAP:
+		case D_RTI:
+		case D_BREAK:
+			return true;
+		default:
+			return false;
+	}
+}
+
+void jit_invalidate(lc3_vm* vm, uint16_t loc) {
+	lc3_jit* j = vm->jit;
+	if (!j) {
+		return;
+	}
+
+	int i = 0;
+	while (i < j->range_count) {
+		if (j->ranges[i].start <= loc && loc <= j->ranges[i].end) {
+			j->blocks[j->ranges[i].start] = NULL;
+			j->heat[j->ranges[i].start] = 0;
+			j->ranges[i] = j->ranges[--j->range_count];
+		} else {
+			i++;
+		}
+	}
+}
+
+void lc3_run_jit(lc3_vm* vm) {
+	if (!jit_init(vm)) {
+		fprintf(stderr, "jit: no executable memory, using the interpreter\n");
+		lc3_run(vm);
+		return;
+	}
+	lc3_jit* j = vm->jit;
+
+	while (vm->running && vm->retired < vm->stop_at) {
+		uint16_t pc = vm->registers[R_PC];
+		jit_block block = j->blocks[pc];
+
+		if (!block && j->heat[pc] != JIT_NEVER && ++j->heat[pc] >= JIT_THRESHOLD) {
+			block = compile(vm, pc);
+			if (block) {
+				j->blocks[pc] = block;
+			} else {
+				j->heat[pc] = JIT_NEVER;
+			}
+		}
+
+		if (block) {
+			uint64_t retired = vm->retired;
+			lc3_sync_flags(vm); /* blocks read and write R_COND directly */
+			block(vm, vm->memory, vm->code_map);
+			if (vm->retired != retired) {
+				continue;
+			}
+			/* side exit on the first instruction, interpret it */
+		}
+
+		/* interpret up to the end of the basic block */
+		lc3_decoded* d;
+		do {
+			vm->retired++;
+			d = &vm->decoded[vm->registers[R_PC]++];
+			lc3_execute(vm, d);
+		} while (vm->running && !ends_block(d->handler));
+	}
+	lc3_sync_flags(vm);
+	lc3_check_budget(vm);
+}
+
+#else
+
+void jit_invalidate(lc3_vm* vm, uint16_t loc) {
+}
+
+void jit_count(lc3_vm* vm, uint64_t* handlers) {
+}
+
+void jit_destroy(lc3_jit* jit) {
+}
+
+void lc3_run_jit(lc3_vm* vm) {
+	fprintf(stderr, "jit: x86-64 only, using the interpreter\n");
+	lc3_run(vm);
+}
+
+#endif
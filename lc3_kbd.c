@@ -0,0 +1,297 @@
+#include "lc3.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <sys/stat.h>
+
+/* Keyboard
+ * A reader thread per VM moves bytes from vm->in into a single producer,
+ * single consumer ring, so a guest polling KBSR costs an atomic load
+ * instead of a select() call. The thread is started by the first keyboard
+ * access. Regular files and streams without a descriptor (fmemopen)
+ * never block, they are read directly so batch runs stay deterministic.
+ * Input set by lc3_input_mem() needs neither. */
+
+#define KBD_RING_SIZE 4096 /* power of two */
+
+struct lc3_kbd {
+	int fd;              /* -1: no reader thread, use stdio */
+	pthread_t thread;
+	int wake[2];         /* kbd_destroy() writes here to stop the reader */
+	atomic_uint head;    /* next slot the reader fills */
+	atomic_uint tail;    /* next slot the guest takes */
+	atomic_bool eof;
+	atomic_bool waiting; /* reader sleeps on a full ring */
+	atomic_ullong syscalls;
+	bool stop;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint8_t ring[KBD_RING_SIZE];
+};
+
+static void wake_all(lc3_kbd* k) {
+	pthread_mutex_lock(&k->lock);
+	pthread_cond_broadcast(&k->cond);
+	pthread_mutex_unlock(&k->lock);
+}
+
+static bool ring_full(lc3_kbd* k) {
+	return atomic_load(&k->head) - atomic_load(&k->tail) == KBD_RING_SIZE;
+}
+
+/* false once kbd_destroy() asked the reader to stop */
+static bool wait_for_space(lc3_kbd* k) {
+	pthread_mutex_lock(&k->lock);
+	atomic_store(&k->waiting, true);
+	while (ring_full(k) && !k->stop) {
+		pthread_cond_wait(&k->cond, &k->lock);
+	}
+	atomic_store(&k->waiting, false);
+	bool stop = k->stop;
+	pthread_mutex_unlock(&k->lock);
+	return !stop;
+}
+
+static void* reader(void* p) {
+	lc3_kbd* k = p;
+	uint8_t buf[256];
+
+	while (1) {
+		if (ring_full(k) && !wait_for_space(k)) {
+			break;
+		}
+
+		struct pollfd fds[2] = {
+			{ .fd = k->fd, .events = POLLIN },
+			{ .fd = k->wake[0], .events = POLLIN }
+		};
+		atomic_fetch_add_explicit(&k->syscalls, 1, memory_order_relaxed);
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		if (fds[1].revents) {
+			break;
+		}
+
+		unsigned head = atomic_load_explicit(&k->head, memory_order_relaxed);
+		unsigned space = KBD_RING_SIZE - (head - atomic_load(&k->tail));
+		atomic_fetch_add_explicit(&k->syscalls, 1, memory_order_relaxed);
+		ssize_t n = read(k->fd, buf, space < sizeof(buf) ? space : sizeof(buf));
+		if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+
+		ssize_t i;
+		for (i = 0; i < n; i++) {
+			k->ring[(head + i) & (KBD_RING_SIZE - 1)] = buf[i];
+		}
+		atomic_store_explicit(&k->head, head + n, memory_order_release);
+		wake_all(k);
+	}
+
+	/* end of input or stopped, a guest waiting in GETC sees EOF */
+	atomic_store_explicit(&k->eof, true, memory_order_release);
+	wake_all(k);
+	return NULL;
+}
+
+static lc3_kbd* kbd_open(lc3_vm* vm) {
+	if (vm->kbd) {
+		return vm->kbd;
+	}
+
+	lc3_kbd* k = calloc(1, sizeof(lc3_kbd));
+	if (!k) {
+		return NULL;
+	}
+	struct stat st;
+	k->fd = fileno(vm->in);
+	if (k->fd >= 0 && fstat(k->fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		k->fd = -1;
+	}
+	if (k->fd >= 0) {
+		pthread_mutex_init(&k->lock, NULL);
+		pthread_cond_init(&k->cond, NULL);
+		if (pipe(k->wake) < 0) {
+			k->fd = -1;
+		} else if (pthread_create(&k->thread, NULL, reader, k) != 0) {
+			close(k->wake[0]);
+			close(k->wake[1]);
+			k->fd = -1;
+		}
+		if (k->fd < 0) {
+			pthread_cond_destroy(&k->cond);
+			pthread_mutex_destroy(&k->lock);
+		}
+	}
+	vm->kbd = k;
+	return k;
+}
+
+/* a key is waiting (or the input ended) */
+static bool kbd_ready(lc3_kbd* k) {
+	return atomic_load_explicit(&k->head, memory_order_acquire) !=
+			atomic_load_explicit(&k->tail, memory_order_relaxed) ||
+			atomic_load_explicit(&k->eof, memory_order_acquire);
+}
+
+void lc3_input_mem(lc3_vm* vm, const uint8_t* data, size_t len) {
+	vm->in_mem.data = data;
+	vm->in_mem.len = len;
+	vm->in_mem.pos = 0;
+	vm->in_mem.first_use = 0;
+}
+
+/* input from memory is always ready */
+static bool mem_ready(lc3_vm* vm) {
+	if (vm->in_mem.first_use == 0) {
+		vm->in_mem.first_use = vm->retired;
+	}
+	return true;
+}
+
+static bool poll_live(lc3_vm* vm) {
+	if (vm->in_mem.data) {
+		return mem_ready(vm);
+	}
+	lc3_kbd* k = kbd_open(vm);
+	if (!k || k->fd < 0) {
+		return true; /* read directly, never blocks */
+	}
+	return kbd_ready(k);
+}
+
+static bool wait_live(lc3_vm* vm, int timeout_ms) {
+	if (vm->in_mem.data) {
+		return mem_ready(vm);
+	}
+	lc3_kbd* k = kbd_open(vm);
+	if (!k || k->fd < 0) {
+		return true;
+	}
+	if (kbd_ready(k)) {
+		return true;
+	}
+
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&k->lock);
+	while (!kbd_ready(k)) {
+		if (pthread_cond_timedwait(&k->cond, &k->lock, &deadline) == ETIMEDOUT) {
+			break;
+		}
+	}
+	pthread_mutex_unlock(&k->lock);
+	return kbd_ready(k);
+}
+
+static uint16_t getc_live(lc3_vm* vm) {
+	lc3_input* in = &vm->in_mem;
+	if (in->data) {
+		mem_ready(vm);
+		return in->pos < in->len ? in->data[in->pos++] : (uint16_t) EOF;
+	}
+	lc3_kbd* k = kbd_open(vm);
+	if (!k || k->fd < 0) {
+		return (uint16_t) getc(vm->in);
+	}
+
+	if (!kbd_ready(k)) {
+		pthread_mutex_lock(&k->lock);
+		while (!kbd_ready(k)) {
+			pthread_cond_wait(&k->cond, &k->lock);
+		}
+		pthread_mutex_unlock(&k->lock);
+	}
+
+	unsigned tail = atomic_load_explicit(&k->tail, memory_order_relaxed);
+	if (tail == atomic_load_explicit(&k->head, memory_order_acquire)) {
+		return (uint16_t) EOF;
+	}
+	uint8_t c = k->ring[tail & (KBD_RING_SIZE - 1)];
+	atomic_store(&k->tail, tail + 1);
+	if (atomic_load(&k->waiting)) {
+		wake_all(k);
+	}
+	return c;
+}
+
+/* the guest sees what a replayed run saw, else what the input has and
+ * that is recorded if asked for */
+bool kbd_poll(lc3_vm* vm) {
+	if (replaying(vm)) {
+		return replay_ready(vm);
+	}
+	bool ready = poll_live(vm);
+	if (ready) {
+		record_ready(vm);
+	}
+	return ready;
+}
+
+bool kbd_wait(lc3_vm* vm, int timeout_ms) {
+	if (replaying(vm)) {
+		return replay_ready(vm);
+	}
+	bool ready = wait_live(vm, timeout_ms);
+	if (ready) {
+		record_ready(vm);
+	}
+	return ready;
+}
+
+uint16_t kbd_getc(lc3_vm* vm) {
+	if (replaying(vm)) {
+		return replay_getc(vm);
+	}
+	uint16_t c = getc_live(vm);
+	record_key(vm, c);
+	return c;
+}
+
+/* regular files are read through stdio, those reads are not counted */
+uint64_t kbd_syscalls(lc3_vm* vm) {
+	return vm->kbd ? atomic_load_explicit(&vm->kbd->syscalls, memory_order_relaxed) : 0;
+}
+
+void kbd_destroy(lc3_kbd* k) {
+	if (k->fd >= 0) {
+		char c = 0;
+		if (write(k->wake[1], &c, 1) < 0) {
+			perror("kbd");
+		}
+		pthread_mutex_lock(&k->lock);
+		k->stop = true;
+		pthread_cond_broadcast(&k->cond);
+		pthread_mutex_unlock(&k->lock);
+
+		pthread_join(k->thread, NULL);
+		close(k->wake[0]);
+		close(k->wake[1]);
+		pthread_cond_destroy(&k->cond);
+		pthread_mutex_destroy(&k->lock);
+	}
+	free(k);
+}
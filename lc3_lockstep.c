@@ -0,0 +1,381 @@
+#include "lc3.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Lockstep engine
+ * Runs up to LOCKSTEP_LANES VMs as one group. The registers of the group
+ * are kept as vectors with one lane per VM, so an ADD is one vector add
+ * for all of them. Every step picks the lowest pc any running lane is
+ * at and runs that instruction for exactly the lanes at it. Lanes that
+ * branched apart run in turns and merge again once the ones behind catch
+ * up, as at the exit of a loop some lanes left earlier.
+ * Loads and stores run once per lane through that VM's memory and
+ * mem_write(), so devices, dirty pages and cached code work as in the
+ * other engines. Traps, RTI, reserved opcodes, code in device pages,
+ * breakpoints and words that are not the same in every lane fall back
+ * to lc3_step() on each VM. Retired counts and budgets are exact per VM. A lane that
+ * spins forever holds back the lanes waiting at higher pcs until it
+ * runs out of budget. */
+
+typedef uint16_t lanes __attribute__((vector_size(LOCKSTEP_LANES * sizeof(uint16_t))));
+typedef int16_t signed_lanes __attribute__((vector_size(LOCKSTEP_LANES * sizeof(uint16_t))));
+typedef uint64_t lane_words __attribute__((vector_size(LOCKSTEP_LANES * sizeof(uint16_t))));
+
+#define BLEND(old, new, m) (((new) & (m)) | ((old) & ~(m)))
+#define BROADCAST(v) ((lanes) { 0 } + (uint16_t) (v))
+
+typedef struct {
+	lanes regs[R_COUNT];  /* regs[r][lane], R_PC and R_COND included */
+	lanes live;           /* 0xFFFF: lane still running */
+	lanes mask;           /* 0xFFFF: lane runs this step */
+	lanes pending;        /* instructions not added to vm->retired yet */
+	uint32_t steps;       /* steps since the last sync() */
+	uint32_t sync_at;     /* steps until a lane could reach its stop_at */
+	lc3_vm* vms[LOCKSTEP_LANES];
+	int count;
+	int lead;             /* a live lane, -1 once all stopped */
+	/* pcs are compared across lanes only where some lane stored */
+	bool check_all;
+	bool breaks;          /* some VM has a breakpoint */
+	uint8_t written[MEMORY_SIZE / 8];
+} group;
+
+/* by pointer, a 32 byte vector passed by value makes GCC note an ABI change */
+static inline __attribute__((always_inline)) bool none(const lanes* v) {
+	lane_words w = (lane_words) *v;
+	uint64_t any = 0;
+	int i;
+	for (i = 0; i < (int) (sizeof(lanes) / sizeof(uint64_t)); i++) {
+		any |= w[i];
+	}
+	return any == 0;
+}
+
+static inline __attribute__((always_inline)) uint32_t lane_bits(group* g) {
+	uint32_t bits = 0;
+	int l;
+	for (l = 0; l < g->count; l++) {
+		bits |= (uint32_t) (g->mask[l] & 1) << l;
+	}
+	return bits;
+}
+
+static void store_lane(group* g, int l) {
+	lc3_vm* vm = g->vms[l];
+	int r;
+	for (r = 0; r < R_COUNT; r++) {
+		vm->registers[r] = g->regs[r][l];
+	}
+	vm->cond_pending = false;
+}
+
+static void load_lane(group* g, int l) {
+	lc3_vm* vm = g->vms[l];
+	lc3_sync_flags(vm);
+	int r;
+	for (r = 0; r < R_COUNT; r++) {
+		g->regs[r][l] = vm->registers[r];
+	}
+}
+
+/* brings every vm->retired up to date, stops the lanes that reached
+ * stop_at or halted and works out how long the group may run before
+ * the next check */
+static void sync(group* g) {
+	uint64_t left = 0xFFFF; /* pending must not wrap */
+	int l;
+	g->lead = -1;
+	for (l = 0; l < g->count; l++) {
+		lc3_vm* vm = g->vms[l];
+		vm->retired += g->pending[l];
+		if (!g->live[l]) {
+			continue;
+		}
+		if (!vm->running || vm->retired >= vm->stop_at) {
+			store_lane(g, l);
+			lc3_check_budget(vm);
+			g->live[l] = 0;
+			continue;
+		}
+		if (vm->stop_at - vm->retired < left) {
+			left = vm->stop_at - vm->retired;
+		}
+		if (g->lead < 0) {
+			g->lead = l;
+		}
+	}
+	g->pending = (lanes) { 0 };
+	g->steps = 0;
+	g->sync_at = left;
+}
+
+/* devices may look at vm->retired and the registers, the keyboard at
+ * the pc and the words around it, bring the lane's up to date */
+static void settle(group* g, int l) {
+	g->vms[l]->retired += g->pending[l];
+	g->pending[l] = 0;
+	store_lane(g, l);
+}
+
+static uint16_t load(group* g, int l, uint16_t addr) {
+	lc3_vm* vm = g->vms[l];
+	if (vm->io_page[IO_PAGE(addr)]) {
+		settle(g, l);
+		return mem_read(vm, addr);
+	}
+	return vm->memory[addr];
+}
+
+/* loads and stores, lane by lane through the lane's VM */
+static inline __attribute__((always_inline)) void memory_step(group* g, const lc3_decoded* d, uint16_t pc) {
+	uint16_t next = pc + 1;
+	uint32_t bits = lane_bits(g);
+	bool stopped = false;
+	g->pending -= g->mask; /* -1 in the lanes that run */
+	while (bits) {
+		int l = __builtin_ctz(bits);
+		bits &= bits - 1;
+		lc3_vm* vm = g->vms[l];
+		uint16_t addr = next + d->imm;
+		uint16_t v;
+		g->regs[R_PC][l] = next;
+
+		switch (d->handler) {
+			case D_LDI:
+				addr = load(g, l, addr);
+				/* fall through */
+			case D_LD:
+				v = load(g, l, addr);
+				break;
+			case D_LDR:
+				v = load(g, l, g->regs[d->src1][l] + d->imm);
+				break;
+			default: /* stores */
+				if (d->handler == D_STI) {
+					addr = load(g, l, addr);
+				} else if (d->handler == D_STR) {
+					addr = g->regs[d->src1][l] + d->imm;
+				}
+				if (vm->io_page[IO_PAGE(addr)]) {
+					settle(g, l);
+				}
+				g->written[addr >> 3] |= 1 << (addr & 7);
+				mem_write(vm, addr, g->regs[d->dst][l]);
+				stopped |= !vm->running;
+				continue;
+		}
+		g->regs[d->dst][l] = v;
+		g->regs[R_COND][l] = v == 0 ? FL_ZRO : (v >> 15) ? FL_NEG : FL_POS;
+		stopped |= !vm->running;
+	}
+	if (stopped || ++g->steps >= g->sync_at) {
+		sync(g);
+	}
+}
+
+static bool is_store(uint8_t handler) {
+	return handler == D_ST || handler == D_STR || handler == D_STI;
+}
+
+/* each lane in the mask on its own VM */
+static void scalar_step(group* g) {
+	uint32_t bits = lane_bits(g);
+	sync(g);
+	while (bits) {
+		int l = __builtin_ctz(bits);
+		bits &= bits - 1;
+		if (!g->live[l]) {
+			continue;
+		}
+		lc3_vm* vm = g->vms[l];
+		lc3_decoded d;
+		lc3_decode(vm->memory[g->regs[R_PC][l]], &d);
+		if (is_store(d.handler)) {
+			g->check_all = true; /* its address is not worth working out */
+		}
+		store_lane(g, l);
+		lc3_step(vm);
+		load_lane(g, l);
+	}
+	sync(g);
+}
+
+/* the lanes in the mask all hold the same word at pc */
+static bool same_word(group* g, uint16_t pc, uint16_t word) {
+	if (!g->check_all && !(g->written[pc >> 3] & (1 << (pc & 7)))) {
+		return true;
+	}
+	int l;
+	for (l = 0; l < g->count; l++) {
+		if (g->mask[l] && g->vms[l]->memory[pc] != word) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* a lane in the mask stops at pc */
+static bool breaks_at(group* g, uint16_t pc) {
+	int l;
+	for (l = 0; l < g->count; l++) {
+		if (g->mask[l] && g->vms[l]->decoded[pc].handler == D_BREAK) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* picks the lanes to run next, returns one of them */
+static int schedule(group* g) {
+	int first = g->lead;
+	uint16_t pc = g->regs[R_PC][first];
+	int l;
+	for (l = first + 1; l < g->count; l++) {
+		if (g->live[l] && g->regs[R_PC][l] < pc) {
+			first = l;
+			pc = g->regs[R_PC][l];
+		}
+	}
+	g->mask = (lanes) (g->regs[R_PC] == BROADCAST(pc)) & g->live;
+	return first;
+}
+
+static inline __attribute__((always_inline)) void run_lanes(group* g) {
+	lanes* r = g->regs;
+	while (g->lead >= 0) {
+		/* lanes that agree on pc are the common case, the scan is not */
+		int first = g->lead;
+		uint16_t pc = r[R_PC][first];
+		g->mask = (lanes) (r[R_PC] == BROADCAST(pc)) & g->live;
+		lanes behind = g->mask ^ g->live;
+		if (!none(&behind)) {
+			first = schedule(g);
+			pc = r[R_PC][first];
+		}
+
+		lc3_vm* vm = g->vms[first];
+		uint16_t word = vm->memory[pc];
+		if (vm->io_page[IO_PAGE(pc)] || !same_word(g, pc, word) ||
+				(g->breaks && breaks_at(g, pc))) {
+			scalar_step(g);
+			continue;
+		}
+		/* decoded once for the group, in the cache of the lane it came from */
+		lc3_decoded* d = &vm->decoded[pc];
+		if (d->handler == D_DECODE) {
+			lc3_decode(word, d);
+			vm->code_map[pc] |= MAP_CODE;
+		}
+
+		lanes m = g->mask;
+		uint16_t next = pc + 1;
+		lanes res;
+		switch (d->handler) {
+			case D_ADD:  res = r[d->src1] + r[d->src2]; break;
+			case D_ADDI: res = r[d->src1] + (uint16_t) d->imm; break;
+			case D_AND:  res = r[d->src1] & r[d->src2]; break;
+			case D_ANDI: res = r[d->src1] & (uint16_t) d->imm; break;
+			case D_NOT:  res = ~r[d->src1]; break;
+			case D_LEA:  res = BROADCAST(next + d->imm); break;
+			case D_BR: {
+				lanes taken = (lanes) ((r[R_COND] & d->dst) != 0);
+				lanes target = BLEND(BROADCAST(next), BROADCAST(next + d->imm), taken);
+				r[R_PC] = BLEND(r[R_PC], target, m);
+				goto retire;
+			}
+			case D_JMP:
+				r[R_PC] = BLEND(r[R_PC], r[d->src1], m);
+				goto retire;
+			case D_JSR:
+				r[R_7] = BLEND(r[R_7], BROADCAST(next), m);
+				r[R_PC] = BLEND(r[R_PC], BROADCAST(next + d->imm), m);
+				goto retire;
+			case D_JSRR:
+				/* JSRR R7 jumps to the return address, as in d_jsrr */
+				r[R_7] = BLEND(r[R_7], BROADCAST(next), m);
+				r[R_PC] = BLEND(r[R_PC], r[d->src1], m);
+				goto retire;
+			case D_LD:
+			case D_LDR:
+			case D_LDI:
+			case D_ST:
+			case D_STR:
+			case D_STI:
+				memory_step(g, d, pc);
+				continue;
+			default:
+				scalar_step(g);
+				continue;
+		}
+		lanes zero = (lanes) (res == 0);
+		lanes neg = (lanes) ((signed_lanes) res < 0);
+		lanes cond = (zero & FL_ZRO) | (neg & FL_NEG) | (~(zero | neg) & FL_POS);
+		r[d->dst] = BLEND(r[d->dst], res, m);
+		r[R_COND] = BLEND(r[R_COND], cond, m);
+		r[R_PC] = BLEND(r[R_PC], BROADCAST(next), m);
+retire:
+		g->pending -= m; /* -1 in the lanes that ran */
+		if (++g->steps >= g->sync_at) {
+			sync(g);
+		}
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static void run_avx2(group* g) {
+	run_lanes(g);
+}
+#endif
+
+static void run_generic(group* g) {
+	run_lanes(g);
+}
+
+static void run_group(group* g) {
+	int l;
+	for (l = 0; l < g->count; l++) {
+		load_lane(g, l);
+		g->live[l] = g->vms[l]->running ? 0xFFFF : 0;
+		if (memcmp(g->vms[l]->memory, g->vms[0]->memory, MEMORY_SIZE * sizeof(uint16_t)) != 0) {
+			g->check_all = true;
+		}
+		int pc;
+		for (pc = 0; pc < MEMORY_SIZE && !g->breaks; pc++) {
+			g->breaks = g->vms[l]->decoded[pc].handler == D_BREAK;
+		}
+	}
+	sync(g);
+#if defined(__x86_64__) || defined(__i386__)
+	if (__builtin_cpu_supports("avx2")) {
+		run_avx2(g);
+		return;
+	}
+#endif
+	run_generic(g);
+}
+
+void lc3_run_lockstep(lc3_vm** vms, int count) {
+	group* g = aligned_alloc(32, (sizeof(group) + 31) & ~(size_t) 31);
+	if (!g) {
+		fprintf(stderr, "lockstep: out of memory, running one VM at a time\n");
+		int i;
+		for (i = 0; i < count; i++) {
+			lc3_run(vms[i]);
+		}
+		return;
+	}
+	while (count > 0) {
+		memset(g, 0, sizeof(group));
+		g->count = count < LOCKSTEP_LANES ? count : LOCKSTEP_LANES;
+		memcpy(g->vms, vms, g->count * sizeof(lc3_vm*));
+		run_group(g);
+		vms += g->count;
+		count -= g->count;
+	}
+	free(g);
+}
@@ -0,0 +1,97 @@
+#include "lc3.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+/* Console output
+ * Guest output is collected in vm->out.buf and leaves it in one write()
+ * per flush. Where it goes is the file descriptor, or the growing mem
+ * buffer when fd is -1. */
+
+void lc3_output_fd(lc3_vm* vm, int fd, int policy) {
+	out_flush(vm);
+	vm->out.fd = fd;
+	vm->out.policy = policy;
+}
+
+void lc3_output_mem(lc3_vm* vm) {
+	out_flush(vm);
+	vm->out.fd = -1;
+	vm->out.policy = OUT_FULL;
+}
+
+static void write_fd(lc3_vm* vm, int fd, const char* data, size_t len) {
+	while (len > 0) {
+		ssize_t n = write(fd, data, len);
+		vm->stats.writes++;
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("output");
+			return;
+		}
+		data += n;
+		len -= n;
+	}
+}
+
+static void write_mem(lc3_output* o, const char* data, size_t len) {
+	if (o->mem_len + len > o->mem_cap) {
+		size_t cap = o->mem_cap ? o->mem_cap : OUT_BUF_SIZE;
+		while (cap < o->mem_len + len) {
+			cap *= 2;
+		}
+		char* grown = realloc(o->mem, cap);
+		if (!grown) {
+			fprintf(stderr, "output: out of memory\n");
+			return;
+		}
+		o->mem = grown;
+		o->mem_cap = cap;
+	}
+	memcpy(o->mem + o->mem_len, data, len);
+	o->mem_len += len;
+}
+
+void out_flush(lc3_vm* vm) {
+	lc3_output* o = &vm->out;
+	if (o->used > 0) {
+		vm->stats.flushes++;
+		if (o->fd >= 0) {
+			write_fd(vm, o->fd, o->buf, o->used);
+		} else {
+			write_mem(o, o->buf, o->used);
+		}
+		o->used = 0;
+	}
+	o->newline = false;
+}
+
+void out_putc(lc3_vm* vm, char c) {
+	lc3_output* o = &vm->out;
+	if (o->used == OUT_BUF_SIZE) {
+		out_flush(vm);
+	}
+	o->buf[o->used++] = c;
+	o->newline |= c == '\n';
+}
+
+void out_commit(lc3_vm* vm) {
+	lc3_output* o = &vm->out;
+	if (o->policy == OUT_UNBUFFERED || (o->policy == OUT_LINE && o->newline)) {
+		out_flush(vm);
+	}
+}
+
+void out_close(lc3_vm* vm) {
+	out_flush(vm);
+	free(vm->out.mem);
+	vm->out.mem = NULL;
+	vm->out.mem_len = vm->out.mem_cap = 0;
+}
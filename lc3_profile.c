@@ -0,0 +1,277 @@
+#include "lc3.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Exact profiler
+ * lc3_run_profiled() is lc3_run() plus counters, the other engines carry
+ * none of them. Every instruction counts for its pc and for the node of
+ * the current call path in a call tree that JSR/JSRR and RET (JMP R7)
+ * walk. A RET that does not match the innermost call unwinds to the
+ * call it does match, or is ignored. */
+
+#define PROFILE_MAX_DEPTH 256
+#define PROFILE_TOP 40
+
+typedef struct {
+	uint16_t func;   /* entry pc, the start pc for the root */
+	int parent;
+	int first_child;
+	int next_sibling;
+	uint64_t self;   /* instructions run in func on this path */
+	uint64_t calls;
+} call_node;
+
+typedef struct {
+	int node;
+	uint16_t ret;    /* pc the call returns to */
+} call_frame;
+
+struct lc3_profile {
+	uint64_t count[MEMORY_SIZE];
+	uint64_t taken[MEMORY_SIZE]; /* BR sites only */
+	call_node* nodes;
+	int node_count;
+	int node_cap;
+	call_frame stack[PROFILE_MAX_DEPTH];
+	int depth;
+	int node;        /* current call path */
+};
+
+static int new_node(lc3_profile* p, int parent, uint16_t func) {
+	if (p->node_count == p->node_cap) {
+		int cap = p->node_cap ? p->node_cap * 2 : 256;
+		call_node* grown = realloc(p->nodes, cap * sizeof(call_node));
+		if (!grown) {
+			return -1;
+		}
+		p->nodes = grown;
+		p->node_cap = cap;
+	}
+	int n = p->node_count++;
+	call_node* node = &p->nodes[n];
+	memset(node, 0, sizeof(call_node));
+	node->func = func;
+	node->parent = parent;
+	node->first_child = -1;
+	node->next_sibling = -1;
+	if (parent >= 0) {
+		node->next_sibling = p->nodes[parent].first_child;
+		p->nodes[parent].first_child = n;
+	}
+	return n;
+}
+
+static lc3_profile* profile_open(lc3_vm* vm) {
+	if (vm->profile) {
+		return vm->profile;
+	}
+	lc3_profile* p = calloc(1, sizeof(lc3_profile));
+	if (!p) {
+		return NULL;
+	}
+	p->node = new_node(p, -1, vm->registers[R_PC]);
+	if (p->node < 0) {
+		free(p);
+		return NULL;
+	}
+	vm->profile = p;
+	return p;
+}
+
+static void call(lc3_profile* p, uint16_t target, uint16_t ret) {
+	if (p->depth == PROFILE_MAX_DEPTH) {
+		return; /* too deep, charge the innermost function */
+	}
+	int child = p->nodes[p->node].first_child;
+	while (child >= 0 && p->nodes[child].func != target) {
+		child = p->nodes[child].next_sibling;
+	}
+	if (child < 0) {
+		child = new_node(p, p->node, target);
+		if (child < 0) {
+			return;
+		}
+	}
+	p->nodes[child].calls++;
+	p->stack[p->depth].node = p->node;
+	p->stack[p->depth].ret = ret;
+	p->depth++;
+	p->node = child;
+}
+
+static void ret(lc3_profile* p, uint16_t to) {
+	int d = p->depth;
+	while (d > 0 && p->stack[d - 1].ret != to) {
+		d--;
+	}
+	if (d > 0) {
+		p->depth = d - 1;
+		p->node = p->stack[p->depth].node;
+	}
+}
+
+void lc3_run_profiled(lc3_vm* vm) {
+	lc3_profile* p = profile_open(vm);
+	if (!p) {
+		fprintf(stderr, "profile: out of memory, not profiling\n");
+		lc3_run(vm);
+		return;
+	}
+
+	while (vm->running && vm->retired < vm->stop_at) {
+		uint16_t pc = vm->registers[R_PC]++;
+		lc3_decoded* d = &vm->decoded[pc];
+		vm->retired++;
+		p->count[pc]++;
+		p->nodes[p->node].self++;
+		lc3_execute(vm, d);
+
+		/* d is decoded by now, unless the instruction overwrote itself */
+		switch (d->handler) {
+			case D_BR:
+				if (d->dst & vm->registers[R_COND]) {
+					p->taken[pc]++;
+				}
+				break;
+			case D_JSR:
+			case D_JSRR:
+				call(p, vm->registers[R_PC], pc + 1);
+				break;
+			case D_JMP:
+				if (d->src1 == R_7) {
+					ret(p, vm->registers[R_PC]);
+				}
+				break;
+		}
+	}
+	lc3_sync_flags(vm);
+	lc3_check_budget(vm);
+}
+
+static lc3_profile* profile_of(lc3_vm* vm) {
+	lc3_profile* p = vm->profile;
+	if (!p) {
+		fprintf(stderr, "profile: nothing was profiled\n");
+	}
+	return p;
+}
+
+static const uint64_t* sort_key;
+
+static int by_key_desc(const void* a, const void* b) {
+	uint64_t ka = sort_key[*(const uint16_t*) a];
+	uint64_t kb = sort_key[*(const uint16_t*) b];
+	return ka < kb ? 1 : ka > kb ? -1 : 0;
+}
+
+/* pcs where key is nonzero, sorted by key, not reentrant */
+static int sorted_pcs(const uint64_t* key, uint16_t* pcs, bool (*want)(lc3_vm*, uint16_t), lc3_vm* vm) {
+	int n = 0;
+	uint32_t pc;
+	for (pc = 0; pc < MEMORY_SIZE; pc++) {
+		if (key[pc] && (!want || want(vm, pc))) {
+			pcs[n++] = pc;
+		}
+	}
+	sort_key = key;
+	qsort(pcs, n, sizeof(uint16_t), by_key_desc);
+	return n;
+}
+
+/* BR with no condition bits is a no-op, not a branch */
+static bool is_branch(lc3_vm* vm, uint16_t pc) {
+	return vm->decoded[pc].handler == D_BR && vm->decoded[pc].dst != 0;
+}
+
+static bool is_backward_branch(lc3_vm* vm, uint16_t pc) {
+	return is_branch(vm, pc) && vm->decoded[pc].imm < 0;
+}
+
+bool lc3_profile_report(lc3_vm* vm, FILE* out) {
+	lc3_profile* p = profile_of(vm);
+	if (!p) {
+		return false;
+	}
+	uint16_t* pcs = malloc(MEMORY_SIZE * sizeof(uint16_t));
+	if (!pcs) {
+		return false;
+	}
+	double total = vm->retired ? (double) vm->retired : 1;
+	int i, n;
+
+	fprintf(out, "%llu instructions\n\nhot instructions\n  pc       count      %%\n",
+			(unsigned long long) vm->retired);
+	n = sorted_pcs(p->count, pcs, NULL, NULL);
+	for (i = 0; i < n && i < PROFILE_TOP; i++) {
+		fprintf(out, "  x%04X %10llu %6.2f\n", pcs[i],
+				(unsigned long long) p->count[pcs[i]], 100 * p->count[pcs[i]] / total);
+	}
+
+	/* a taken backward branch is one more trip around a loop */
+	fprintf(out, "\nhot loops\n  head   branch      trips\n");
+	n = sorted_pcs(p->taken, pcs, is_backward_branch, vm);
+	for (i = 0; i < n && i < PROFILE_TOP; i++) {
+		uint16_t head = pcs[i] + 1 + vm->decoded[pcs[i]].imm;
+		fprintf(out, "  x%04X  x%04X %10llu\n", head, pcs[i], (unsigned long long) p->taken[pcs[i]]);
+	}
+
+	fprintf(out, "\nbranches\n  pc          taken  not taken\n");
+	n = sorted_pcs(p->count, pcs, is_branch, vm);
+	for (i = 0; i < n && i < PROFILE_TOP; i++) {
+		uint64_t taken = p->taken[pcs[i]];
+		fprintf(out, "  x%04X %10llu %10llu\n", pcs[i], (unsigned long long) taken,
+				(unsigned long long) (p->count[pcs[i]] - taken));
+	}
+
+	/* per function, summed over every path that reaches it */
+	uint64_t* self = calloc(MEMORY_SIZE, sizeof(uint64_t));
+	uint64_t* calls = calloc(MEMORY_SIZE, sizeof(uint64_t));
+	if (self && calls) {
+		for (i = 0; i < p->node_count; i++) {
+			self[p->nodes[i].func] += p->nodes[i].self;
+			calls[p->nodes[i].func] += p->nodes[i].calls;
+		}
+		fprintf(out, "\nhot functions\n  entry       self      %%      calls\n");
+		n = sorted_pcs(self, pcs, NULL, NULL);
+		for (i = 0; i < n && i < PROFILE_TOP; i++) {
+			fprintf(out, "  x%04X %10llu %6.2f %10llu\n", pcs[i], (unsigned long long) self[pcs[i]],
+					100 * self[pcs[i]] / total, (unsigned long long) calls[pcs[i]]);
+		}
+	}
+	free(self);
+	free(calls);
+	free(pcs);
+	return true;
+}
+
+static void print_path(lc3_profile* p, int n, FILE* out) {
+	if (p->nodes[n].parent >= 0) {
+		print_path(p, p->nodes[n].parent, out);
+		fputc(';', out);
+	}
+	fprintf(out, "x%04X", p->nodes[n].func);
+}
+
+bool lc3_profile_folded(lc3_vm* vm, FILE* out) {
+	lc3_profile* p = profile_of(vm);
+	if (!p) {
+		return false;
+	}
+	int i;
+	for (i = 0; i < p->node_count; i++) {
+		if (p->nodes[i].self) {
+			print_path(p, i, out);
+			fprintf(out, " %llu\n", (unsigned long long) p->nodes[i].self);
+		}
+	}
+	return true;
+}
+
+void profile_destroy(lc3_profile* p) {
+	free(p->nodes);
+	free(p);
+}
@@ -0,0 +1,185 @@
+#include "lc3.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+/* Input record/replay
+ * The guest only sees the outside world through the keyboard: whether a
+ * key is waiting when it polls KBSR, and which key GETC, IN or KBDR hand
+ * it. Recording logs each poll that found a key and each key, with the
+ * instruction count it happened at. Polls that found nothing are left
+ * out, on replay a poll finds a key exactly when the next event is due
+ * at the current instruction. Replay never touches the real input, so a
+ * replayed run does the same work on every engine and every machine.
+ * Once the log runs out the input looks closed. */
+
+#define REPLAY_MAGIC "LC3INPUT"
+#define REPLAY_VERSION 1
+
+enum {
+	EV_READY = 0, /* a poll found a key */
+	EV_KEY        /* value is the key */
+};
+
+typedef struct {
+	uint64_t retired;
+	uint16_t kind;
+	uint16_t value;
+	uint32_t pad;
+} replay_event;
+
+struct lc3_replay {
+	FILE* file;
+	bool replaying;
+	bool more;          /* next holds an event */
+	replay_event next;
+};
+
+static lc3_replay* replay_open(lc3_vm* vm, const char* path, bool replaying) {
+	lc3_replay* r = calloc(1, sizeof(lc3_replay));
+	if (!r) {
+		return NULL;
+	}
+	r->replaying = replaying;
+	r->file = fopen(path, replaying ? "rb" : "wb");
+	if (!r->file) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		free(r);
+		return NULL;
+	}
+
+	char magic[8];
+	uint32_t version = REPLAY_VERSION;
+	bool ok;
+	if (replaying) {
+		ok = fread(magic, sizeof(magic), 1, r->file) == 1 &&
+				fread(&version, sizeof(version), 1, r->file) == 1 &&
+				memcmp(magic, REPLAY_MAGIC, sizeof(magic)) == 0 && version == REPLAY_VERSION;
+		if (!ok) {
+			fprintf(stderr, "%s: not an input log\n", path);
+		}
+	} else {
+		ok = fwrite(REPLAY_MAGIC, sizeof(magic), 1, r->file) == 1 &&
+				fwrite(&version, sizeof(version), 1, r->file) == 1;
+		if (!ok) {
+			fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		}
+	}
+	if (!ok) {
+		fclose(r->file);
+		free(r);
+		return NULL;
+	}
+
+	if (vm->replay) {
+		replay_destroy(vm->replay);
+	}
+	vm->replay = r;
+	return r;
+}
+
+static void read_next(lc3_replay* r) {
+	r->more = fread(&r->next, sizeof(r->next), 1, r->file) == 1;
+}
+
+bool lc3_record_input(lc3_vm* vm, const char* path) {
+	return replay_open(vm, path, false) != NULL;
+}
+
+bool lc3_replay_input(lc3_vm* vm, const char* path) {
+	lc3_replay* r = replay_open(vm, path, true);
+	if (r) {
+		read_next(r);
+	}
+	return r != NULL;
+}
+
+bool replaying(lc3_vm* vm) {
+	return vm->replay && vm->replay->replaying;
+}
+
+/* the guest did something the recorded run did not, stop it */
+static void diverged(lc3_vm* vm, const char* what) {
+	if (vm->fault == LC3_DIVERGED) {
+		return;
+	}
+	fprintf(stderr, "replay: %s at instruction %llu\n", what, (unsigned long long) vm->retired);
+	vm->fault = LC3_DIVERGED;
+	vm->running = false;
+	vm->stop_at = vm->retired; /* the threaded engine checks it on jumps */
+}
+
+/* an event of kind is due now, anything older was missed */
+static bool due(lc3_vm* vm, int kind) {
+	lc3_replay* r = vm->replay;
+	if (!r->more) {
+		return false;
+	}
+	if (r->next.retired < vm->retired) {
+		diverged(vm, "missed an input event");
+		return false;
+	}
+	return r->next.retired == vm->retired && r->next.kind == kind;
+}
+
+bool replay_ready(lc3_vm* vm) {
+	lc3_replay* r = vm->replay;
+	if (!r->more) {
+		return true; /* as closed input */
+	}
+	if (due(vm, EV_READY)) {
+		read_next(r);
+		return true;
+	}
+	return false;
+}
+
+uint16_t replay_getc(lc3_vm* vm) {
+	lc3_replay* r = vm->replay;
+	if (!r->more) {
+		return (uint16_t) EOF;
+	}
+	if (!due(vm, EV_KEY)) {
+		diverged(vm, "read a key the recording does not have");
+		return (uint16_t) EOF;
+	}
+	uint16_t c = r->next.value;
+	read_next(r);
+	return c;
+}
+
+static void record(lc3_vm* vm, int kind, uint16_t value) {
+	lc3_replay* r = vm->replay;
+	if (!r || r->replaying || !r->file) {
+		return;
+	}
+	replay_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.retired = vm->retired;
+	ev.kind = kind;
+	ev.value = value;
+	if (fwrite(&ev, sizeof(ev), 1, r->file) != 1) {
+		perror("record");
+		fclose(r->file);
+		r->file = NULL;
+	}
+}
+
+void record_ready(lc3_vm* vm) {
+	record(vm, EV_READY, 0);
+}
+
+void record_key(lc3_vm* vm, uint16_t c) {
+	record(vm, EV_KEY, c);
+}
+
+void replay_destroy(lc3_replay* r) {
+	if (r->file && fclose(r->file) != 0) {
+		perror("record");
+	}
+	free(r);
+}
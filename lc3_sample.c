@@ -0,0 +1,139 @@
+#include "lc3.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <stdatomic.h>
+
+#include <sys/mman.h>
+#include <sys/time.h>
+
+/* Sampling profiler
+ * setitimer(ITIMER_PROF) raises SIGPROF as the process uses CPU time, the
+ * handler copies R_PC and R7 of the sampled VM into a preallocated
+ * buffer, claiming its slot with one atomic add. Nothing is aggregated
+ * until lc3_sampler_report(), so a sample costs a few stores. Only one
+ * VM per process can be sampled at a time.
+ * R_PC is the next instruction while one runs in the interpreters and
+ * the block entry while a JIT block runs. R7 is the return address of
+ * the innermost JSR/JSRR, as far as the guest left it alone. */
+
+#define SAMPLE_CAP (1 << 22) /* over an hour at 1000 Hz */
+
+typedef struct {
+	uint16_t pc;
+	uint16_t r7;
+} sample;
+
+static lc3_vm* volatile sampled_vm;
+static sample* samples;
+static atomic_ullong sample_count;
+static struct sigaction old_action;
+
+static void on_sigprof(int sig) {
+	lc3_vm* vm = sampled_vm;
+	if (!vm) {
+		return;
+	}
+	unsigned long long i = atomic_fetch_add_explicit(&sample_count, 1, memory_order_relaxed);
+	if (i < SAMPLE_CAP) {
+		samples[i].pc = vm->registers[R_PC];
+		samples[i].r7 = vm->registers[R_7];
+	}
+}
+
+bool lc3_sampler_start(lc3_vm* vm, int hz) {
+	if (!samples) {
+		/* untouched pages of the mapping cost nothing */
+		samples = mmap(NULL, SAMPLE_CAP * sizeof(sample), PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (samples == MAP_FAILED) {
+			samples = NULL;
+			perror("sampler");
+			return false;
+		}
+	}
+	atomic_store(&sample_count, 0);
+	sampled_vm = vm;
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_sigprof;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGPROF, &sa, &old_action);
+
+	struct itimerval timer;
+	timer.it_interval.tv_sec = 0;
+	timer.it_interval.tv_usec = 1000000 / hz;
+	timer.it_value = timer.it_interval;
+	if (setitimer(ITIMER_PROF, &timer, NULL) < 0) {
+		perror("setitimer");
+		lc3_sampler_stop();
+		return false;
+	}
+	return true;
+}
+
+void lc3_sampler_stop() {
+	struct itimerval timer;
+	memset(&timer, 0, sizeof(timer));
+	setitimer(ITIMER_PROF, &timer, NULL);
+	sigaction(SIGPROF, &old_action, NULL);
+	sampled_vm = NULL;
+}
+
+typedef struct {
+	uint16_t key;
+	uint64_t count;
+} bucket;
+
+static int by_count_desc(const void* a, const void* b) {
+	uint64_t ca = ((const bucket*) a)->count;
+	uint64_t cb = ((const bucket*) b)->count;
+	return ca < cb ? 1 : ca > cb ? -1 : 0;
+}
+
+static void print_histogram(FILE* out, const char* title, bucket* hist, uint64_t total) {
+	qsort(hist, MEMORY_SIZE, sizeof(bucket), by_count_desc);
+	fprintf(out, "\n%s\n", title);
+	int i;
+	for (i = 0; i < 40 && hist[i].count; i++) {
+		fprintf(out, "  x%04X %10llu %6.2f\n", hist[i].key,
+				(unsigned long long) hist[i].count, 100.0 * hist[i].count / total);
+	}
+}
+
+bool lc3_sampler_report(FILE* out) {
+	unsigned long long taken = atomic_load(&sample_count);
+	uint64_t kept = taken < SAMPLE_CAP ? taken : SAMPLE_CAP;
+	bucket* pcs = calloc(MEMORY_SIZE, sizeof(bucket));
+	bucket* r7s = calloc(MEMORY_SIZE, sizeof(bucket));
+	if (!pcs || !r7s) {
+		free(pcs);
+		free(r7s);
+		return false;
+	}
+
+	uint32_t i;
+	for (i = 0; i < MEMORY_SIZE; i++) {
+		pcs[i].key = r7s[i].key = i;
+	}
+	for (i = 0; i < kept; i++) {
+		pcs[samples[i].pc].count++;
+		r7s[samples[i].r7].count++;
+	}
+
+	fprintf(out, "%llu samples, %llu dropped\n", (unsigned long long) kept,
+			(unsigned long long) (taken - kept));
+	if (kept > 0) {
+		print_histogram(out, "pc          samples      %", pcs, kept);
+		print_histogram(out, "r7          samples      %", r7s, kept);
+	}
+	free(pcs);
+	free(r7s);
+	return true;
+}
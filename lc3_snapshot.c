@@ -0,0 +1,106 @@
+#include "lc3.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Snapshots
+ * A header padded to one page, then memory[] in host byte order so a
+ * restore can map it straight into the VM. Snapshots are only meant to
+ * be restored on the machine type that wrote them. */
+
+#define SNAP_MAGIC "LC3SNAP"
+#define SNAP_VERSION 1
+#define SNAP_HEADER_SIZE 4096
+#define SNAP_MEMORY_SIZE (MEMORY_SIZE * sizeof(uint16_t))
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint16_t registers[R_COUNT];
+	uint8_t running;
+	uint8_t fault;
+	uint64_t retired;
+} snap_header;
+
+bool lc3_snapshot_save(lc3_vm* vm, const char* path) {
+	lc3_sync_flags(vm);
+
+	static char page[SNAP_HEADER_SIZE];
+	snap_header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, SNAP_MAGIC, sizeof(SNAP_MAGIC));
+	h.version = SNAP_VERSION;
+	memcpy(h.registers, vm->registers, sizeof(h.registers));
+	h.running = vm->running;
+	h.fault = vm->fault;
+	h.retired = vm->retired;
+
+	FILE* file = fopen(path, "wb");
+	if (!file) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return false;
+	}
+	bool ok = fwrite(&h, sizeof(h), 1, file) == 1 &&
+			fwrite(page, SNAP_HEADER_SIZE - sizeof(h), 1, file) == 1 &&
+			fwrite(vm->memory, SNAP_MEMORY_SIZE, 1, file) == 1;
+	if (fclose(file) != 0) {
+		ok = false;
+	}
+	if (!ok) {
+		fprintf(stderr, "%s: cannot write snapshot\n", path);
+	}
+	return ok;
+}
+
+bool lc3_snapshot_restore(lc3_vm* vm, const char* path) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return false;
+	}
+
+	struct stat st;
+	snap_header* h = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size == SNAP_HEADER_SIZE + SNAP_MEMORY_SIZE) {
+		h = mmap(NULL, SNAP_HEADER_SIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	if (h == MAP_FAILED || memcmp(h->magic, SNAP_MAGIC, sizeof(SNAP_MAGIC)) != 0 ||
+			h->version != SNAP_VERSION) {
+		fprintf(stderr, "%s: not a snapshot\n", path);
+		if (h != MAP_FAILED) {
+			munmap(h, SNAP_HEADER_SIZE);
+		}
+		close(fd);
+		return false;
+	}
+
+	/* replaces the old pages in place, vm->memory stays valid */
+	uint16_t* memory = mmap(vm->memory, SNAP_MEMORY_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_FIXED, fd, SNAP_HEADER_SIZE);
+	close(fd);
+	if (memory == MAP_FAILED) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		munmap(h, SNAP_HEADER_SIZE);
+		return false;
+	}
+
+	memcpy(vm->registers, h->registers, sizeof(h->registers));
+	vm->running = h->running;
+	vm->fault = h->fault;
+	vm->retired = h->retired;
+	vm->cond_pending = false;
+	munmap(h, SNAP_HEADER_SIZE);
+
+	lc3_forget_code(vm);
+	memset(vm->dirty, 1, sizeof(vm->dirty));
+	return true;
+}
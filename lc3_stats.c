@@ -0,0 +1,166 @@
+#include "lc3.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+
+/* Stats
+ * The engines bump vm->stats as they go, this file only reports. The
+ * signal thread reads the counters while the VM runs on another thread,
+ * so a report taken that way may be a few instructions stale. */
+
+#define NOT_AN_OPCODE 0xFF
+
+static const uint8_t opcode_of[D_COUNT] = {
+	[D_DECODE] = NOT_AN_OPCODE,
+	[D_BR]     = OP_BR,
+	[D_ADD]    = OP_ADD,
+	[D_ADDI]   = OP_ADD,
+	[D_LD]     = OP_LD,
+	[D_ST]     = OP_ST,
+	[D_JSR]    = OP_JSR,
+	[D_JSRR]   = OP_JSR,
+	[D_AND]    = OP_AND,
+	[D_ANDI]   = OP_AND,
+	[D_LDR]    = OP_LDR,
+	[D_STR]    = OP_STR,
+	[D_RTI]    = OP_RTI,
+	[D_NOT]    = OP_NOT,
+	[D_LDI]    = OP_LDI,
+	[D_STI]    = OP_STI,
+	[D_JMP]    = OP_JMP,
+	[D_RES]    = OP_RES,
+	[D_LEA]    = OP_LEA,
+	[D_TRAP]   = OP_TRAP,
+	[D_BREAK]  = NOT_AN_OPCODE,
+	/* fused handlers count their instructions one by one */
+	[D_ADDI_BR]      = NOT_AN_OPCODE,
+	[D_ANDI_ADDI]    = NOT_AN_OPCODE,
+	[D_LEA_TRAP]     = NOT_AN_OPCODE,
+	[D_LDR_ADD_STR]  = NOT_AN_OPCODE,
+	[D_LDR_ADDI_STR] = NOT_AN_OPCODE,
+	[D_MUL_LOOP]     = NOT_AN_OPCODE,
+	[D_DIV_LOOP]     = NOT_AN_OPCODE,
+	[D_COPY_LOOP]    = NOT_AN_OPCODE,
+	[D_FILL_LOOP]    = NOT_AN_OPCODE
+};
+
+static const char* const opcode_names[16] = {
+	"BR", "ADD", "LD", "ST", "JSR", "AND", "LDR", "STR",
+	"RTI", "NOT", "LDI", "STI", "JMP", "RES", "LEA", "TRAP"
+};
+
+static const char* const trap_names[] = {
+	"GETC", "OUT", "PUTS", "IN", "PUTSP", "HALT"
+};
+
+#define TRAP_NAMES (sizeof(trap_names) / sizeof(trap_names[0]))
+
+static unsigned long long ull(uint64_t n) {
+	return (unsigned long long) n;
+}
+
+void lc3_stats_json(lc3_vm* vm, FILE* out) {
+	const lc3_stats* s = &vm->stats;
+	uint64_t handlers[D_COUNT];
+	memcpy(handlers, s->handlers, sizeof(handlers));
+	jit_count(vm, handlers);
+
+	uint64_t ops[16] = { 0 };
+	int i;
+	for (i = 0; i < D_COUNT; i++) {
+		if (opcode_of[i] != NOT_AN_OPCODE) {
+			ops[opcode_of[i]] += handlers[i];
+		}
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double wall = (now.tv_sec - s->start.tv_sec) + (now.tv_nsec - s->start.tv_nsec) / 1e9;
+
+	fprintf(out, "{\"retired\":%llu,\"wall_seconds\":%.6f,\"decodes\":%llu,\"opcodes\":{",
+			ull(vm->retired), wall, ull(s->handlers[D_DECODE]));
+	for (i = 0; i < 16; i++) {
+		fprintf(out, "%s\"%s\":%llu", i ? "," : "", opcode_names[i], ull(ops[i]));
+	}
+
+	/* LDI and STI read the pointer first */
+	uint64_t loads = ops[OP_LD] + ops[OP_LDR] + 2 * ops[OP_LDI] + ops[OP_STI];
+	uint64_t stores = ops[OP_ST] + ops[OP_STR] + ops[OP_STI];
+	fprintf(out, "},\"loads\":%llu,\"stores\":%llu,\"mmio_reads\":{\"KBSR\":%llu,\"KBDR\":%llu},\"traps\":{",
+			ull(loads), ull(stores), ull(s->kbsr_reads), ull(s->kbdr_reads));
+
+	uint64_t other = 0;
+	for (i = 0; i < 256; i++) {
+		if (i < TRAP_GETC || i >= TRAP_GETC + (int) TRAP_NAMES) {
+			other += s->traps[i];
+		}
+	}
+	for (i = 0; i < (int) TRAP_NAMES; i++) {
+		fprintf(out, "\"%s\":%llu,", trap_names[i], ull(s->traps[TRAP_GETC + i]));
+	}
+	fprintf(out, "\"other\":%llu},\"syscalls\":{\"keyboard\":%llu,\"output\":%llu},\"flushes\":%llu}\n",
+			ull(other), ull(kbd_syscalls(vm)), ull(s->writes), ull(s->flushes));
+	fflush(out);
+}
+
+/* Signal thread
+ * sig stays blocked and is taken with sigwait(), so the report runs on
+ * an ordinary thread and may use stdio */
+
+static pthread_t signal_thread;
+static bool signal_running;
+static volatile bool signal_stop;
+static int signal_sig;
+static lc3_vm* signal_vm;
+static FILE* signal_out;
+
+static void* wait_signal(void* p) {
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, signal_sig);
+	while (1) {
+		int sig;
+		if (sigwait(&set, &sig) != 0 || signal_stop) {
+			break;
+		}
+		lc3_stats_json(signal_vm, signal_out);
+	}
+	return NULL;
+}
+
+bool lc3_stats_on_signal(lc3_vm* vm, int sig, FILE* out) {
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, sig);
+	if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0) {
+		return false;
+	}
+	signal_sig = sig;
+	signal_vm = vm;
+	signal_out = out;
+	signal_stop = false;
+	if (pthread_create(&signal_thread, NULL, wait_signal, NULL) != 0) {
+		pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+		perror("stats");
+		return false;
+	}
+	signal_running = true;
+	return true;
+}
+
+void lc3_stats_stop_signal() {
+	if (!signal_running) {
+		return;
+	}
+	signal_stop = true;
+	pthread_kill(signal_thread, signal_sig);
+	pthread_join(signal_thread, NULL);
+	signal_running = false;
+	/* sig stays blocked, one that arrives late must not kill us */
+}
@@ -1,11 +1,18 @@
 #include "lc3.h"
 #include <stdio.h>
 #include <assert.h>
+#include <pthread.h>
 #include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+lc3_vm* vm;
 
 void before() {
-	zero_registers();
-	zero_memory();
+	zero_registers(vm);
+	zero_memory(vm);
 }
 
 /**
@@ -31,28 +38,28 @@ void add_test() {
 	const int16_t rimm_neg_expected = -3;*/
 	
 	uint16_t pc = 0x3000;
-	registers[R_PC] = pc;
-	registers[R_1] = 1;
-	registers[R_2] = 3;
+	vm->registers[R_PC] = pc;
+	vm->registers[R_1] = 1;
+	vm->registers[R_2] = 3;
 	
-	memory[pc] = rr_pos;
-	lc3_add(mem_read(registers[R_PC]));
-	assert(registers[R_0] == rr_pos_expected);
+	vm->memory[pc] = rr_pos;
+	lc3_add(vm, mem_read(vm, vm->registers[R_PC]));
+	assert(vm->registers[R_0] == rr_pos_expected);
 	
-	memory[pc] = rimm_pos;
-	lc3_add(mem_read(registers[R_PC]));
-	assert(registers[R_0] == rimm_pos_expected);
+	vm->memory[pc] = rimm_pos;
+	lc3_add(vm, mem_read(vm, vm->registers[R_PC]));
+	assert(vm->registers[R_0] == rimm_pos_expected);
 
-	registers[R_2] = -3;
+	vm->registers[R_2] = -3;
 	
-	memory[pc] = rr_neg;
-	lc3_add(mem_read(registers[R_PC]));
-	assert(((int16_t) registers[R_0]) == rr_neg_expected);
+	vm->memory[pc] = rr_neg;
+	lc3_add(vm, mem_read(vm, vm->registers[R_PC]));
+	assert(((int16_t) vm->registers[R_0]) == rr_neg_expected);
 
 /*
-	memory[pc] = rimm_neg;
-	lc3_add(mem_read(registers[R_PC]));
-	assert(((int16_t) registers[R_0]) == rimm_neg_expected);*/
+	vm->memory[pc] = rimm_neg;
+	lc3_add(vm, mem_read(vm, vm->registers[R_PC]));
+	assert(((int16_t) vm->registers[R_0]) == rimm_neg_expected);*/
 }
 
 void ldi_test() {
@@ -65,18 +72,18 @@ void ldi_test() {
 	const uint16_t ldi_pos = 0xA010; /* positive 0x10 offset from RPC, value should be 0x111 */
 	const uint16_t ldi_neg = 0xA110; /* negative 0x10 offset from RPC, value should be 0x222 */
 	
-	registers[R_PC] = 0x3000;
-	mem_write(ldi_pos_addr, ldi_pos_offset_addr);
-	mem_write(ldi_pos_offset_addr, ldi_pos_expected);
-	mem_write(ldi_neg_addr, ldi_neg_offset_addr);
-	mem_write(ldi_neg_offset_addr, ldi_neg_expected);
+	vm->registers[R_PC] = 0x3000;
+	mem_write(vm, ldi_pos_addr, ldi_pos_offset_addr);
+	mem_write(vm, ldi_pos_offset_addr, ldi_pos_expected);
+	mem_write(vm, ldi_neg_addr, ldi_neg_offset_addr);
+	mem_write(vm, ldi_neg_offset_addr, ldi_neg_expected);
 
 	
-	lc3_ldi(ldi_pos);
-	assert(registers[R_0] == ldi_pos_expected);
+	lc3_ldi(vm, ldi_pos);
+	assert(vm->registers[R_0] == ldi_pos_expected);
 	printf("pass - pos\n");
-	lc3_ldi(ldi_neg);
-	assert(registers[R_0] == ldi_neg_expected);
+	lc3_ldi(vm, ldi_neg);
+	assert(vm->registers[R_0] == ldi_neg_expected);
 	printf("pass - neg\n");
 }
 
@@ -91,15 +98,15 @@ void and_test() {
 	const uint16_t and_rimm_instr = 0x5065; // r0 = r1 & imm5
 	const uint16_t and_rimm_expected = 0x4;
 
-	registers[R_1] = 0x5;
-	registers[R_2] = 0x3;
-	lc3_and(and_rr_instr);
-	assert(registers[R_0] == and_rr_expected);
+	vm->registers[R_1] = 0x5;
+	vm->registers[R_2] = 0x3;
+	lc3_and(vm, and_rr_instr);
+	assert(vm->registers[R_0] == and_rr_expected);
 	printf("pass - rr\n");
 
-	registers[R_1] = 0x6;
-	lc3_and(and_rimm_instr);
-	assert(registers[R_0] == and_rimm_expected);
+	vm->registers[R_1] = 0x6;
+	lc3_and(vm, and_rimm_instr);
+	assert(vm->registers[R_0] == and_rimm_expected);
 	printf("pass - rimm\n");
 }
 
@@ -129,67 +136,77 @@ void br_test() {
 	const uint16_t brnzp_neg_instr  = 0xFF0;
 	const uint16_t neg_expected = 0x3040;
 
-	registers[R_PC] = 0x3000;
-	lc3_br(br_pos_instr);
-	assert(registers[R_PC] == pos_expected);
-	printf("pass - br pos\n");
+	/* nzp = 000 is never taken, a no-op */
+	vm->registers[R_PC] = 0x3000;
+	vm->registers[R_COND] = FL_POS;
+	lc3_br(vm, br_pos_instr);
+	assert(vm->registers[R_PC] == 0x3000);
+	printf("pass - br never\n");
 
-	registers[R_PC] = 0x3000;
-	registers[R_COND] = 0x1;
-	lc3_br(brn_pos_instr);
-	assert(registers[R_PC] == pos_expected);
+	vm->registers[R_PC] = 0x3000;
+	vm->registers[R_COND] = FL_NEG;
+	lc3_br(vm, brn_pos_instr);
+	assert(vm->registers[R_PC] == pos_expected);
 	printf("pass - brn pos\n");
 
-	registers[R_PC] = 0x3000;
-	registers[R_COND] = 0x1;
-	lc3_br(brz_pos_instr);
-	assert(registers[R_PC] == pos_expected);
+	vm->registers[R_PC] = 0x3000;
+	vm->registers[R_COND] = FL_ZRO;
+	lc3_br(vm, brz_pos_instr);
+	assert(vm->registers[R_PC] == pos_expected);
 	printf("pass - brz pos\n");
 	
-	registers[R_PC] = 0x3000;
-	registers[R_COND] = 0x1;
-	lc3_br(brp_pos_instr);
-	assert(registers[R_PC] == pos_expected);
+	vm->registers[R_PC] = 0x3000;
+	vm->registers[R_COND] = FL_POS;
+	lc3_br(vm, brp_pos_instr);
+	assert(vm->registers[R_PC] == pos_expected);
 	printf("pass - brp pos\n");
 	
-	registers[R_PC] = 0x3050;
-	lc3_br(brzp_neg_instr);
-	assert(registers[R_PC] == neg_expected);
+	vm->registers[R_PC] = 0x3050;
+	vm->registers[R_COND] = FL_ZRO;
+	lc3_br(vm, brzp_neg_instr);
+	assert(vm->registers[R_PC] == neg_expected);
 	printf("pass - br neg\n");
 	
-	registers[R_PC] = 0x3050;
-	lc3_br(brnp_neg_instr);
-	assert(registers[R_PC] == neg_expected);
+	vm->registers[R_PC] = 0x3050;
+	vm->registers[R_COND] = FL_NEG;
+	lc3_br(vm, brnp_neg_instr);
+	assert(vm->registers[R_PC] == neg_expected);
 	printf("pass - brn neg\n");
 	
-	registers[R_PC] = 0x3050;
-	lc3_br(brz_neg_instr);
-	assert(registers[R_PC] == neg_expected);
+	vm->registers[R_PC] = 0x3050;
+	vm->registers[R_COND] = FL_ZRO;
+	lc3_br(vm, brz_neg_instr);
+	assert(vm->registers[R_PC] == neg_expected);
 	printf("pass - brz neg\n");
 	
-	registers[R_PC] = 0x3050;
-	lc3_br(brp_neg_instr);
-	assert(registers[R_PC] == neg_expected);
+	vm->registers[R_PC] = 0x3050;
+	vm->registers[R_COND] = FL_POS;
+	lc3_br(vm, brp_neg_instr);
+	assert(vm->registers[R_PC] == neg_expected);
 	printf("pass - brp neg\n");
 	
-	registers[R_PC] = 0x3050;
-	lc3_br(brzp_neg_instr);
-	assert(registers[R_PC] == neg_expected);
+	vm->registers[R_PC] = 0x3050;
+	vm->registers[R_COND] = FL_ZRO;
+	lc3_br(vm, brzp_neg_instr);
+	assert(vm->registers[R_PC] == neg_expected);
 	printf("pass - brzp neg\n");
 	
-	registers[R_PC] = 0x3050;
-	lc3_br(brnp_neg_instr);
-	assert(registers[R_PC] == neg_expected);
+	vm->registers[R_PC] = 0x3050;
+	vm->registers[R_COND] = FL_NEG;
+	lc3_br(vm, brnp_neg_instr);
+	assert(vm->registers[R_PC] == neg_expected);
 	printf("pass - brnp neg\n");
 	
-	registers[R_PC] = 0x3050;
-	lc3_br(brnz_neg_instr);
-	assert(registers[R_PC] == neg_expected);
+	vm->registers[R_PC] = 0x3050;
+	vm->registers[R_COND] = FL_NEG;
+	lc3_br(vm, brnz_neg_instr);
+	assert(vm->registers[R_PC] == neg_expected);
 	printf("pass - brnz neg\n");
 	
-	registers[R_PC] = 0x3050;
-	lc3_br(brnzp_neg_instr);
-	assert(registers[R_PC] == neg_expected);
+	vm->registers[R_PC] = 0x3050;
+	vm->registers[R_COND] = FL_NEG;
+	lc3_br(vm, brnzp_neg_instr);
+	assert(vm->registers[R_PC] == neg_expected);
 	printf("pass - brnzp neg\n");
 }
 
@@ -200,10 +217,10 @@ void jmp_ret_test() {
 	const uint16_t jmp_ret_instr = 0xC1C0;
 	const uint16_t addr_expected = 0x2000;
 
-	registers[R_PC] = 0x3000;
-	registers[R_7] = 0x2000;
-	lc3_jmp_ret(jmp_ret_instr);
-	assert(registers[R_PC] == addr_expected);
+	vm->registers[R_PC] = 0x3000;
+	vm->registers[R_7] = 0x2000;
+	lc3_jmp_ret(vm, jmp_ret_instr);
+	assert(vm->registers[R_PC] == addr_expected);
 }
 
 void jsrr_test() {
@@ -223,30 +240,30 @@ void jsrr_test() {
 	const uint16_t jsrr_rpc_expected = 0x4000;
 	const uint16_t jsrr_r7_expected = 0x3000;
 
-	registers[R_PC] = 0x3000;
-	registers[R_0] = 0x4000;
+	vm->registers[R_PC] = 0x3000;
+	vm->registers[R_0] = 0x4000;
 
-	lc3_jsrr(jsr_pos_instr);
-	dump_registers();
-	assert(registers[R_PC] == jsr_pos_rpc_expected);
-	assert(registers[R_7] == jsr_pos_r7_expected);
+	lc3_jsrr(vm, jsr_pos_instr);
+	dump_registers(vm);
+	assert(vm->registers[R_PC] == jsr_pos_rpc_expected);
+	assert(vm->registers[R_7] == jsr_pos_r7_expected);
 	printf("pass - jsr pos\n");
 	
-	lc3_jsrr(jsr_neg_instr);
-	assert(registers[R_PC] == jsr_neg_rpc_expected);
-	assert(registers[R_7] == jsr_neg_r7_expected);
+	lc3_jsrr(vm, jsr_neg_instr);
+	assert(vm->registers[R_PC] == jsr_neg_rpc_expected);
+	assert(vm->registers[R_7] == jsr_neg_r7_expected);
 	printf("pass - jsr neg\n");
 
-	lc3_jsrr(jsrr_instr);
-	assert(registers[R_PC] == jsrr_rpc_expected);
-	assert(registers[R_7] == jsrr_r7_expected);
+	lc3_jsrr(vm, jsrr_instr);
+	assert(vm->registers[R_PC] == jsrr_rpc_expected);
+	assert(vm->registers[R_7] == jsrr_r7_expected);
 	printf("pass - jsrr\n");
 }
 
 void ld_test() {
 	/*
-	 * memory[0x3000] = -1
-	 * memory[0x3020] = 10
+	 * vm->memory[0x3000] = -1
+	 * vm->memory[0x3020] = 10
 	 * read value into r1
 	 */
 	const uint16_t ld_pos_instr = 0x2210;
@@ -254,31 +271,31 @@ void ld_test() {
 	const uint16_t ld_neg_instr = 0x23F0;
 	const int16_t ld_neg_expected = -1;
 
-	registers[R_PC] = 0x3010;
-	mem_write(0x3020, ld_pos_expected);
-	mem_write(0x3000, (uint16_t) ld_neg_expected);
+	vm->registers[R_PC] = 0x3010;
+	mem_write(vm, 0x3020, ld_pos_expected);
+	mem_write(vm, 0x3000, (uint16_t) ld_neg_expected);
 
-	lc3_ld(ld_pos_instr);
-	dump_registers();
-	assert(registers[R_1] == ld_pos_expected);
-	assert(registers[R_COND] == FL_POS);
+	lc3_ld(vm, ld_pos_instr);
+	dump_registers(vm);
+	assert(vm->registers[R_1] == ld_pos_expected);
+	assert(vm->registers[R_COND] == FL_POS);
 	printf("pass - pos\n");
 
-	lc3_ld(ld_neg_instr);
-	int16_t val = (int16_t) registers[R_1];
+	lc3_ld(vm, ld_neg_instr);
+	int16_t val = (int16_t) vm->registers[R_1];
 	assert(val == ld_neg_expected);
-	assert(registers[R_COND] == FL_NEG);
+	assert(vm->registers[R_COND] == FL_NEG);
 	printf("pass - neg\n");
 }
 /*
 void ldi_test() {
 	* rpc = 0x3000
 	 * ldi_pos: offset = +0x10
-	 * memory[0x3020] = 0x2000
-	 * memory[0x2000] = -12;
+	 * vm->memory[0x3020] = 0x2000
+	 * vm->memory[0x2000] = -12;
 	 * ldi_neg: offset = -0x10
-	 * memory[0x3000] = 0x2500
-	 * memory[0x2500] = 12;
+	 * vm->memory[0x3000] = 0x2500
+	 * vm->memory[0x2500] = 12;
 	 *
 
 	const uint16_t ldi_pos_instr = 0xA210; //ldi r1,+LABEL
@@ -286,20 +303,20 @@ void ldi_test() {
 	const uint16_t ldi_neg_instr = 0xA319; //ldi r1,-LABEL
 	const int16_t ldi_neg_expecetd = 12;
 
-	mem_write(0x3020, 0x2000);
-	mem_write(0x2000, (uint16_t) ldi_pos_expected);
-	mem_write(0x3000, 0x2500);
-	mem_write(0x2500, (uint16_t) ldi_neg_expected);
+	mem_write(vm, 0x3020, 0x2000);
+	mem_write(vm, 0x2000, (uint16_t) ldi_pos_expected);
+	mem_write(vm, 0x3000, 0x2500);
+	mem_write(vm, 0x2500, (uint16_t) ldi_neg_expected);
 
-	registers[R_PC] = 0x3000;
-	lc3_ldi(ldi_pos_instr);
-	assert(((int16_t)  registers[R_1]) == ldi_pos_expected);
-	assert(registers[R_COND] == FL_NEG);
+	vm->registers[R_PC] = 0x3000;
+	lc3_ldi(vm, ldi_pos_instr);
+	assert(((int16_t)  vm->registers[R_1]) == ldi_pos_expected);
+	assert(vm->registers[R_COND] == FL_NEG);
 	printf("pass - ldi_pos\n");
 
-	ld3_ldi(ldi_neg_instr);
-	assert(((int16_t) registers[R_1]) == ldi_neg_expeceted);
-	assert(registers[R_COND] == FL_POS);
+	ld3_ldi(vm, ldi_neg_instr);
+	assert(((int16_t) vm->registers[R_1]) == ldi_neg_expeceted);
+	assert(vm->registers[R_COND] == FL_POS);
 	printf("pass - ldi_neg\n");
 }*/
 
@@ -307,9 +324,9 @@ void ldr_test() {
 	/*
 	 * baseR = r1
 	 * destR = r0
-	 * registers[r1] = 0x3010
-	 * memory[0x3020] = -12;
-	 * memory[0x3000] = 12;
+	 * vm->registers[r1] = 0x3010
+	 * vm->memory[0x3020] = -12;
+	 * vm->memory[0x3000] = 12;
 	 */
 	const uint16_t ldr_pos_instr = 0x6050; //ldr r0,r1,imm10
 	const int16_t ldr_pos_expected = -12;
@@ -317,20 +334,20 @@ void ldr_test() {
 	const int16_t ldr_neg_expected = 12;
 	int16_t val = 0;
 
-	mem_write(0x3020, (uint16_t) -12);
-	mem_write(0x3000, (uint16_t) 12);
-	registers[R_1] = 0x3010;
+	mem_write(vm, 0x3020, (uint16_t) -12);
+	mem_write(vm, 0x3000, (uint16_t) 12);
+	vm->registers[R_1] = 0x3010;
 
-	lc3_ldr(ldr_pos_instr);
-	val = (int16_t) registers[R_0];
+	lc3_ldr(vm, ldr_pos_instr);
+	val = (int16_t) vm->registers[R_0];
 	assert(val == ldr_pos_expected);
-	assert(registers[R_COND] == FL_NEG);
+	assert(vm->registers[R_COND] == FL_NEG);
 	printf("pass - pos\n");
 
-	lc3_ldr(ldr_neg_instr);
-	val = (int16_t) registers[R_0];
+	lc3_ldr(vm, ldr_neg_instr);
+	val = (int16_t) vm->registers[R_0];
 	assert(val == ldr_neg_expected);
-	assert(registers[R_COND] == FL_POS);
+	assert(vm->registers[R_COND] == FL_POS);
 }
 
 void lea_test() {
@@ -343,74 +360,74 @@ void lea_test() {
 	const uint16_t lea_neg_instr = 0xE3F0; //lea r1,-LABEL
 	const uint16_t lea_neg_expected = 0x3000;
 
-	mem_write(0x3020, (uint16_t) lea_pos_expected);
-	mem_write(0x3000, (uint16_t) lea_neg_expected);
-	registers[R_PC] = 0x3010;
+	mem_write(vm, 0x3020, (uint16_t) lea_pos_expected);
+	mem_write(vm, 0x3000, (uint16_t) lea_neg_expected);
+	vm->registers[R_PC] = 0x3010;
 
-	lc3_lea(lea_pos_instr);
-	assert(registers[R_1] == lea_pos_expected);
-	assert(registers[R_COND] == FL_POS);
+	lc3_lea(vm, lea_pos_instr);
+	assert(vm->registers[R_1] == lea_pos_expected);
+	assert(vm->registers[R_COND] == FL_POS);
 	printf("pass - pos\n");
 	
-	lc3_lea(lea_neg_instr);
-	assert(registers[R_1] == lea_neg_expected);
-	assert(registers[R_COND] == FL_POS);
+	lc3_lea(vm, lea_neg_instr);
+	assert(vm->registers[R_1] == lea_neg_expected);
+	assert(vm->registers[R_COND] == FL_POS);
 	printf("pass - neg\n");
 }
 
 void not_test() {
 	const uint16_t not_instr = 0x907F; //not r0,r1
-	registers[R_1] = 12;
+	vm->registers[R_1] = 12;
 
-	lc3_not(not_instr);
-	assert(registers[R_0] == (uint16_t) ~12);
-	assert(registers[R_COND] == FL_NEG);
+	lc3_not(vm, not_instr);
+	assert(vm->registers[R_0] == (uint16_t) ~12);
+	assert(vm->registers[R_COND] == FL_NEG);
 	printf("pass - neg\n");
 
-	registers[R_1] = -8;
-	lc3_not(not_instr);
-	assert(registers[R_0] == (uint16_t) ~(-8));
-	assert(registers[R_COND] == FL_POS);
+	vm->registers[R_1] = -8;
+	lc3_not(vm, not_instr);
+	assert(vm->registers[R_0] == (uint16_t) ~(-8));
+	assert(vm->registers[R_COND] == FL_POS);
 	printf("pass - pos\n");
 }
 
 void st_test() {
 	/**
 	 * rpc = 0x3010
-	 * memory[0x3020] = 0x1111;
-	 * memory[0x3000] = 0x2222;
+	 * vm->memory[0x3020] = 0x1111;
+	 * vm->memory[0x3000] = 0x2222;
 	 */
 	const uint16_t st_instr_pos = 0x3210; //st r1,imm10
 	const uint16_t st_instr_neg = 0x33F0; //st r1,imm-10
 	const uint16_t pos_expected = 0x1111;
 	const uint16_t neg_expected = 0x2222;
-	registers[R_PC] = 0x3010;
+	vm->registers[R_PC] = 0x3010;
 
-	registers[R_1] = pos_expected;
-	lc3_st(st_instr_pos);
-	assert(mem_read(0x3020) == pos_expected);
+	vm->registers[R_1] = pos_expected;
+	lc3_st(vm, st_instr_pos);
+	assert(mem_read(vm, 0x3020) == pos_expected);
 	printf("pass - pos\n");
 
-	registers[R_1] = neg_expected;
-	lc3_st(st_instr_neg);
-	assert(((int16_t) mem_read(0x3000) == neg_expected));
+	vm->registers[R_1] = neg_expected;
+	lc3_st(vm, st_instr_neg);
+	assert(((int16_t) mem_read(vm, 0x3000) == neg_expected));
 	printf("pass - neg\n");
 }
 
 void sti_test() {
 	/**
-	 * memory[0x3010] = 0x2000;
+	 * vm->memory[0x3010] = 0x2000;
 	 * rpc = 0x3000
 	 * offset = 0x10
 	 */
 	const uint16_t sti_instr = 0xB210; //sti r1,LABEL
 	const uint16_t sti_expected = 0x1234;
-	registers[R_PC] = 0x3000;
-	registers[R_1] = sti_expected;
-	mem_write(0x3010, 0x2000);
+	vm->registers[R_PC] = 0x3000;
+	vm->registers[R_1] = sti_expected;
+	mem_write(vm, 0x3010, 0x2000);
 
-	lc3_sti(sti_instr);
-	assert(mem_read(0x2000) == sti_expected);
+	lc3_sti(vm, sti_instr);
+	assert(mem_read(vm, 0x2000) == sti_expected);
 }
 
 void str_test() {
@@ -420,14 +437,1405 @@ void str_test() {
 	 * src = 0x1234 (r0)
 	 */
 	const uint16_t str_instr = 0x7050; //str r0,r1,imm10
-	registers[R_0] = 0x1234;
-	registers[R_1] = 0x3000;
+	vm->registers[R_0] = 0x1234;
+	vm->registers[R_1] = 0x3000;
+
+	lc3_str(vm, str_instr);
+	assert(mem_read(vm, 0x3010) == 0x1234);
+}
+
+/* Guest programs
+ * a fresh VM with words at 0x3000 and the pc there, no keyboard and the
+ * console kept in memory, so runs on different engines can be compared.
+ * words may be NULL when n is 0. */
+#define ORIGIN 0x3000
+#define WORDS(a) (sizeof(a) / sizeof((a)[0]))
+
+static lc3_vm* guest(const uint16_t* words, size_t n) {
+	static const uint8_t no_keys[1];
+	lc3_vm* g = lc3_vm_create();
+	assert(g);
+	if (n > 0) {
+		memcpy(g->memory + ORIGIN, words, n * sizeof(uint16_t));
+	}
+	g->registers[R_PC] = ORIGIN;
+	lc3_input_mem(g, no_keys, 0);
+	lc3_output_mem(g);
+	return g;
+}
+
+/* b ended where a did */
+static void assert_same(lc3_vm* a, lc3_vm* b) {
+	assert(memcmp(a->registers, b->registers, sizeof(a->registers)) == 0);
+	assert(memcmp(a->memory, b->memory, MEMORY_SIZE * sizeof(uint16_t)) == 0);
+	assert(a->retired == b->retired);
+	assert(a->running == b->running);
+	assert(a->fault == b->fault);
+	assert(a->out.mem_len == b->out.mem_len);
+	assert(a->out.mem_len == 0 || memcmp(a->out.mem, b->out.mem, a->out.mem_len) == 0);
+}
+
+/* the OP_* counts lc3_stats_json() reports for g add up to what g
+ * retired, fused records and loop idioms count each instruction once */
+static void assert_opcodes_add_up(lc3_vm* g) {
+	char json[2048];
+	FILE* f = tmpfile();
+	assert(f);
+	lc3_stats_json(g, f);
+	rewind(f);
+	assert(fgets(json, sizeof(json), f));
+	fclose(f);
+
+	unsigned long long retired, n, sum = 0;
+	assert(sscanf(json, "{\"retired\":%llu", &retired) == 1);
+	const char* p = strstr(json, "\"opcodes\":{");
+	assert(p);
+	p += strlen("\"opcodes\":{");
+	int op, used;
+	for (op = 0; op < 16; op++) {
+		assert(sscanf(p, "\"%*[A-Z]\":%llu%n", &n, &used) == 1);
+		sum += n;
+		p += used;
+		assert(*p++ == (op < 15 ? ',' : '}'));
+	}
+	assert(sum == retired);
+}
+
+static void (*const engines[])(lc3_vm*) = { lc3_run, lc3_run_threaded, lc3_run_jit };
+#define ENGINES WORDS(engines)
+
+/* runs BODY 20 times, overwrites its ADD #1 with ADD #2 and runs it 20
+ * times again, R3 ends at 60 */
+static const uint16_t smc_prog[] = {
+	0x220C, /* LD R1, N20 */
+	0x4809, /* L1 JSR BODY */
+	0x127F, /* ADD R1, R1, #-1 */
+	0x03FD, /* BRp L1 */
+	0x2009, /* LD R0, NEWI */
+	0x3005, /* ST R0, BODY */
+	0x2206, /* LD R1, N20 */
+	0x4803, /* L2 JSR BODY */
+	0x127F, /* ADD R1, R1, #-1 */
+	0x03FD, /* BRp L2 */
+	0xF025, /* HALT */
+	0x16E1, /* BODY ADD R3, R3, #1 */
+	0xC1C0, /* RET */
+	0x0014, /* N20 .FILL 20 */
+	0x16E2, /* NEWI ADD R3, R3, #2 */
+};
+
+/* a file for a test to write, name holds at least 32 bytes */
+static void temp_file(char* name) {
+	strcpy(name, "/tmp/lc3_test.XXXXXX");
+	int fd = mkstemp(name);
+	assert(fd >= 0);
+	close(fd);
+}
+
+/* run g up to instruction n, it is still running */
+static void run_to(lc3_vm* g, uint64_t n) {
+	g->stop_at = n;
+	lc3_run(g);
+	g->stop_at = g->budget;
+	assert(g->running && g->retired == n);
+}
+
+/**
+ * Overwrite an instruction of a block every engine has run, and has
+ * decoded or translated, then run the block again
+ */
+void smc_test() {
+	lc3_vm* ref = NULL;
+	size_t i;
+	for (i = 0; i < ENGINES; i++) {
+		lc3_vm* g = guest(smc_prog, WORDS(smc_prog));
+		engines[i](g);
+		assert(g->fault == LC3_OK);
+		assert(g->registers[R_3] == 20 * 1 + 20 * 2);
+		assert_opcodes_add_up(g);
+		if (ref) {
+			assert_same(ref, g);
+			lc3_vm_destroy(g);
+		} else {
+			ref = g;
+		}
+		printf("pass - engine %zu\n", i);
+	}
+	lc3_vm_destroy(ref);
+}
+
+/* the rows of section in a profile report, each parsed with format into
+ * up to 3 numbers, returns how many */
+static int report_rows(FILE* report, const char* section, const char* format,
+		unsigned long long rows[][3], int max) {
+	char line[256];
+	rewind(report);
+	while (fgets(line, sizeof(line), report) && strcmp(line, section) != 0) {
+	}
+	int n = 0;
+	while (fgets(line, sizeof(line), report) && line[0] != '\n') {
+		if (strncmp(line, "  x", 3) == 0) {
+			assert(n < max);
+			assert(sscanf(line, format, &rows[n][0], &rows[n][1], &rows[n][2]) >= 2);
+			n++;
+		}
+	}
+	return n;
+}
+
+/**
+ * Profile smc_prog: every pc, both loops and their branches, and BODY
+ * called 40 times from the two call sites in the one root function
+ */
+void profile_test() {
+	static const unsigned long long count[] = { 1, 20, 20, 20, 1, 1, 1, 20, 20, 20, 1, 40, 40 };
+	lc3_vm* g = guest(smc_prog, WORDS(smc_prog));
+	lc3_run_profiled(g);
+	assert(g->fault == LC3_OK && g->retired == 205);
+
+	FILE* report = tmpfile();
+	assert(report && lc3_profile_report(g, report));
+	unsigned long long rows[16][3];
+	int n = report_rows(report, "hot instructions\n", "  x%llx %llu", rows, 16);
+	assert(n == WORDS(count));
+	int i;
+	for (i = 0; i < n; i++) {
+		assert(rows[i][0] >= ORIGIN && rows[i][0] < ORIGIN + WORDS(count));
+		assert(rows[i][1] == count[rows[i][0] - ORIGIN]);
+	}
+	printf("pass - count\n");
+
+	n = report_rows(report, "hot loops\n", "  x%llx  x%llx %llu", rows, 16);
+	assert(n == 2);
+	for (i = 0; i < n; i++) {
+		assert(rows[i][0] == ORIGIN + 1 || rows[i][0] == ORIGIN + 7);
+		assert(rows[i][1] == rows[i][0] + 2 && rows[i][2] == 19);
+	}
+	n = report_rows(report, "branches\n", "  x%llx %llu %llu", rows, 16);
+	assert(n == 2);
+	for (i = 0; i < n; i++) {
+		assert(rows[i][0] == ORIGIN + 3 || rows[i][0] == ORIGIN + 9);
+		assert(rows[i][1] == 19 && rows[i][2] == 1);
+	}
+	printf("pass - taken\n");
+
+	n = report_rows(report, "hot functions\n", "  x%llx %llu %*f %llu", rows, 16);
+	assert(n == 2);
+	assert(rows[0][0] == ORIGIN && rows[0][1] == 125 && rows[0][2] == 0);
+	assert(rows[1][0] == ORIGIN + 11 && rows[1][1] == 80 && rows[1][2] == 40);
+	fclose(report);
+
+	char folded[64] = { 0 };
+	report = tmpfile();
+	assert(report && lc3_profile_folded(g, report));
+	rewind(report);
+	assert(fread(folded, 1, sizeof(folded) - 1, report) > 0);
+	fclose(report);
+	assert(strcmp(folded, "x3000 125\nx3000;x300B 80\n") == 0);
+	lc3_vm_destroy(g);
+	printf("pass - call tree\n");
+}
+
+/**
+ * Sample a guest that only ever calls SUB: every sample lands on one of
+ * its four instructions or just past the last one, which R_PC is while
+ * RET runs, with R7 at the return address once SUB was first called
+ */
+void sample_test() {
+	static const uint16_t prog[] = {
+		0x4801, /* LOOP JSR SUB */
+		0x0FFE, /* BRnzp LOOP */
+		0x16E1, /* SUB ADD R3, R3, #1 */
+		0xC1C0, /* RET */
+	};
+	lc3_vm* g = guest(prog, WORDS(prog));
+	lc3_set_budget(g, 200000000);
+	assert(lc3_sampler_start(g, 1000));
+	lc3_run(g);
+	lc3_sampler_stop();
+	assert(g->fault == LC3_BUDGET);
+	lc3_vm_destroy(g);
+
+	FILE* report = tmpfile();
+	assert(report && lc3_sampler_report(report));
+	rewind(report);
+	unsigned long long taken, dropped;
+	assert(fscanf(report, "%llu samples, %llu dropped", &taken, &dropped) == 2);
+	assert(taken > 0 && dropped == 0);
+	unsigned long long rows[40][3];
+	unsigned long long sum = 0;
+	int n = report_rows(report, "pc          samples      %\n", "  x%llx %llu", rows, 40);
+	int i;
+	for (i = 0; i < n; i++) {
+		assert(rows[i][0] >= ORIGIN && rows[i][0] <= ORIGIN + WORDS(prog));
+		sum += rows[i][1];
+	}
+	assert(sum == taken);
+	n = report_rows(report, "r7          samples      %\n", "  x%llx %llu", rows, 40);
+	for (i = 0; i < n; i++) {
+		assert(rows[i][0] == ORIGIN + 1 || rows[i][0] == 0);
+	}
+	fclose(report);
+	printf("pass - %llu samples\n", taken);
+}
+
+/**
+ * Snapshot a guest before it rewrites its code, run it to the end, then
+ * restore the snapshot into it and run it to the end again
+ */
+void snapshot_test() {
+	char path[32];
+	temp_file(path);
+	lc3_vm* ref = guest(smc_prog, WORDS(smc_prog));
+	lc3_run(ref);
+
+	lc3_vm* g = guest(smc_prog, WORDS(smc_prog));
+	run_to(g, 30);
+	assert(lc3_snapshot_save(g, path));
+	uint16_t regs[R_COUNT];
+	memcpy(regs, g->registers, sizeof(regs));
+	lc3_run(g);
+	assert_same(ref, g);
+	printf("pass - run after save\n");
+
+	assert(lc3_snapshot_restore(g, path));
+	assert(memcmp(g->registers, regs, sizeof(regs)) == 0);
+	assert(g->retired == 30 && g->running);
+	assert(g->memory[ORIGIN + 11] == smc_prog[11]);
+	lc3_run(g);
+	assert_same(ref, g);
+	printf("pass - run after restore\n");
+
+	unlink(path);
+	lc3_vm_destroy(g);
+	lc3_vm_destroy(ref);
+}
+
+static long file_size(const char* path) {
+	FILE* f = fopen(path, "rb");
+	assert(f && fseek(f, 0, SEEK_END) == 0);
+	long size = ftell(f);
+	fclose(f);
+	return size;
+}
+
+/**
+ * Checkpoint a guest every 25 instructions, roll a new VM back to one
+ * taken before the guest rewrote its code and run it to the end. A last
+ * record that fails its checksum is cut off.
+ */
+void checkpoint_test() {
+	char path[32];
+	temp_file(path);
+	lc3_vm* ref = guest(smc_prog, WORDS(smc_prog));
+	lc3_run(ref);
+
+	lc3_vm* g = guest(smc_prog, WORDS(smc_prog));
+	FILE* log = fopen(path, "wb");
+	assert(log);
+	lc3_run_checkpointed(g, lc3_run, log, 25);
+	fclose(log);
+	assert_same(ref, g);
+	lc3_vm_destroy(g);
+
+	g = guest(NULL, 0);
+	assert(lc3_rollback(g, path, 1) == 1);
+	assert(g->retired == 50 && g->running);
+	assert(g->memory[ORIGIN + 11] == smc_prog[11]);
+	lc3_run(g);
+	assert_same(ref, g);
+	lc3_vm_destroy(g);
+	printf("pass - rollback to 1\n");
+
+	g = guest(NULL, 0);
+	long last = lc3_rollback(g, path, -1);
+	assert(last == (long) ref->retired / 25);
+	assert(memcmp(g->registers, ref->registers, sizeof(ref->registers)) == 0);
+	assert(memcmp(g->memory, ref->memory, MEMORY_SIZE * sizeof(uint16_t)) == 0);
+	assert(g->retired == ref->retired && !g->running);
+	lc3_vm_destroy(g);
+	printf("pass - rollback to last\n");
+
+	/* flip a byte of the last record */
+	long size = file_size(path);
+	FILE* f = fopen(path, "r+b");
+	assert(f && fseek(f, size - 8, SEEK_SET) == 0);
+	int c = fgetc(f);
+	assert(fseek(f, size - 8, SEEK_SET) == 0 && fputc(c ^ 0xFF, f) != EOF);
+	fclose(f);
+	g = guest(NULL, 0);
+	assert(lc3_rollback(g, path, -1) == last - 1);
+	assert(file_size(path) < size);
+	assert(lc3_rollback(g, path, -1) == last - 1);
+	lc3_run(g);
+	assert_same(ref, g);
+	lc3_vm_destroy(g);
+	printf("pass - torn record\n");
+
+	unlink(path);
+	lc3_vm_destroy(ref);
+}
+
+/* twice 65536 trips around a loop that stores, the second time with
+ * its ADD rewritten to add 3, R2 ends at 0x40000 & 0xFFFF */
+static const uint16_t trace_prog[] = {
+	0x2A0B, /* LD R5, TWO */
+	0xE80C, /* LEA R4, CELL */
+	0x5260, /* OUTER AND R1, R1, #0 */
+	0x14A1, /* INC ADD R2, R2, #1 */
+	0x7500, /* STR R2, R4, #0 */
+	0x127F, /* ADD R1, R1, #-1 */
+	0x0BFC, /* BRnp INC */
+	0x2005, /* LD R0, NEWI */
+	0x31FA, /* ST R0, INC */
+	0x1B7F, /* ADD R5, R5, #-1 */
+	0x03F7, /* BRp OUTER */
+	0xF025, /* HALT */
+	0x0002, /* TWO .FILL #2 */
+	0x14A3, /* NEWI ADD R2, R2, #3 */
+	0x0000, /* CELL .FILL #0 */
+};
+
+/* echoes keys while KBSR says one is ready, sums them in R2 and
+ * ends with a GETC once the input is closed */
+static const uint16_t echo_prog[] = {
+	0xA008, /* LOOP LDI R0, KBSRP */
+	0x07FE, /* BRzp LOOP */
+	0xA007, /* LDI R0, KBDRP */
+	0x0803, /* BRn DONE */
+	0xF021, /* OUT */
+	0x1480, /* ADD R2, R2, R0 */
+	0x0FF9, /* BRnzp LOOP */
+	0xF020, /* DONE GETC */
+	0xF025, /* HALT */
+	0xFE00, /* KBSRP .FILL xFE00 */
+	0xFE02, /* KBDRP .FILL xFE02 */
+};
+
+/**
+ * Record a guest that polls KBSR and echoes what it reads, then replay
+ * the recording under each engine with no keyboard behind it
+ */
+void replay_test() {
+	static const uint8_t keys[] = "hello, world";
+	char path[32];
+	temp_file(path);
+
+	lc3_vm* ref = guest(echo_prog, WORDS(echo_prog));
+	lc3_input_mem(ref, keys, sizeof(keys) - 1);
+	assert(lc3_record_input(ref, path));
+	lc3_run(ref);
+	assert(ref->fault == LC3_OK);
+	assert(ref->out.mem_len == sizeof(keys) - 1);
+	replay_destroy(ref->replay);
+	ref->replay = NULL;
+
+	size_t i;
+	for (i = 0; i < ENGINES; i++) {
+		lc3_vm* g = guest(echo_prog, WORDS(echo_prog));
+		assert(lc3_replay_input(g, path));
+		engines[i](g);
+		assert(g->fault != LC3_DIVERGED);
+		assert_same(ref, g);
+		lc3_vm_destroy(g);
+		printf("pass - engine %zu\n", i);
+	}
+
+	/* a guest that polls at another instruction strays from the log */
+	lc3_vm* g = guest(echo_prog, WORDS(echo_prog));
+	g->registers[R_PC] = ORIGIN + 1;
+	assert(lc3_replay_input(g, path));
+	lc3_run(g);
+	assert(g->fault == LC3_DIVERGED);
+	lc3_vm_destroy(g);
+	printf("pass - diverged\n");
+
+	unlink(path);
+	lc3_vm_destroy(ref);
+}
+
+/* echoes keys read with GETC until the input ends */
+static const uint16_t getc_prog[] = {
+	0xF020, /* LOOP GETC */
+	0x1020, /* ADD R0, R0, #0 */
+	0x0802, /* BRn DONE */
+	0xF021, /* OUT */
+	0x0FFB, /* BRnzp LOOP */
+	0xF025, /* DONE HALT */
+};
+
+typedef struct {
+	int fd;
+	const uint8_t* data;
+	size_t len;
+	size_t chunk;
+} feeder;
+
+/* writes data in chunks a millisecond apart, then closes the pipe */
+static void* feed(void* p) {
+	feeder* f = p;
+	size_t at;
+	for (at = 0; at < f->len; at += f->chunk) {
+		size_t n = f->len - at < f->chunk ? f->len - at : f->chunk;
+		assert(write(f->fd, f->data + at, n) == (ssize_t) n);
+		usleep(1000);
+	}
+	close(f->fd);
+	return NULL;
+}
+
+/* runs words on keys from a pipe, fed by a thread if chunk is not 0,
+ * else all written before the guest starts */
+static lc3_vm* piped(const uint16_t* words, size_t n, const uint8_t* keys, size_t len, size_t chunk) {
+	int fds[2];
+	assert(pipe(fds) == 0);
+	feeder f = { fds[1], keys, len, chunk };
+	pthread_t writer;
+	if (chunk) {
+		assert(pthread_create(&writer, NULL, feed, &f) == 0);
+	} else {
+		assert(write(fds[1], keys, len) == (ssize_t) len);
+		close(fds[1]);
+	}
+
+	lc3_vm* g = guest(words, n);
+	lc3_input_mem(g, NULL, 0);
+	g->in = fdopen(fds[0], "r");
+	assert(g->in);
+	lc3_run(g);
+	if (chunk) {
+		pthread_join(writer, NULL);
+	}
+	return g;
+}
+
+/* stops the keyboard thread before the pipe it reads is closed */
+static void unpipe(lc3_vm* g) {
+	FILE* in = g->in;
+	lc3_vm_destroy(g);
+	fclose(in);
+}
+
+/**
+ * Every byte of a pipe reaches the guest through GETC and through KBSR
+ * polling, trickled in or waiting in more than a ring full
+ */
+void pipe_test() {
+	static uint8_t keys[10000];
+	static const struct {
+		size_t len;
+		size_t chunk;
+	} feeds[] = { { sizeof(keys), 0 }, { 64, 5 } };
+	static const struct {
+		const uint16_t* words;
+		size_t n;
+	} progs[] = { { getc_prog, WORDS(getc_prog) }, { echo_prog, WORDS(echo_prog) } };
+	size_t i;
+	for (i = 0; i < sizeof(keys); i++) {
+		keys[i] = (uint8_t) (i * 7);
+	}
+
+	size_t p, f;
+	for (p = 0; p < WORDS(progs); p++) {
+		for (f = 0; f < WORDS(feeds); f++) {
+			lc3_vm* g = piped(progs[p].words, progs[p].n, keys, feeds[f].len, feeds[f].chunk);
+			assert(g->fault == LC3_OK && !g->running);
+			assert(g->out.mem_len == feeds[f].len);
+			assert(memcmp(g->out.mem, keys, feeds[f].len) == 0);
+			assert(g->registers[R_0] == (uint16_t) EOF);
+			unpipe(g);
+			printf("pass - prog %zu, feed %zu\n", p, f);
+		}
+	}
+}
+
+/* echo_prog counting its polls in R3, which makes it no idle loop */
+static const uint16_t spin_prog[] = {
+	0x16E1, /* LOOP ADD R3, R3, #1 */
+	0xA006, /* LDI R0, KBSRP */
+	0x07FD, /* BRzp LOOP */
+	0xA005, /* LDI R0, KBDRP */
+	0x0802, /* BRn DONE */
+	0xF021, /* OUT */
+	0x0FF9, /* BRnzp LOOP */
+	0xF025, /* DONE HALT */
+	0xFE00, /* KBSRP .FILL xFE00 */
+	0xFE02, /* KBDRP .FILL xFE02 */
+};
+
+/**
+ * A guest spinning on KBSR is parked until a trickled key arrives and
+ * ends as it does on input that is always ready, one that counts its
+ * polls is not parked
+ */
+void idle_test() {
+	static const uint8_t keys[] = "parked until the key arrives";
+	static const struct {
+		const uint16_t* words;
+		size_t n;
+	} progs[] = { { echo_prog, WORDS(echo_prog) }, { spin_prog, WORDS(spin_prog) } };
+	size_t p;
+	for (p = 0; p < WORDS(progs); p++) {
+		lc3_vm* ref = guest(progs[p].words, progs[p].n);
+		lc3_input_mem(ref, keys, sizeof(keys) - 1);
+		lc3_run(ref);
+		assert(ref->fault == LC3_OK);
+
+		lc3_vm* g = piped(progs[p].words, progs[p].n, keys, sizeof(keys) - 1, 1);
+		assert(g->out.mem_len == ref->out.mem_len);
+		assert(memcmp(g->out.mem, ref->out.mem, ref->out.mem_len) == 0);
+		if (p == 0) {
+			assert(g->retired == ref->retired);
+			assert(g->stats.kbsr_reads == ref->stats.kbsr_reads);
+			assert(memcmp(g->registers, ref->registers, sizeof(g->registers)) == 0);
+		} else {
+			assert(g->retired > ref->retired);
+			assert(g->registers[R_3] > ref->registers[R_3]);
+		}
+		unpipe(g);
+		lc3_vm_destroy(ref);
+		printf("pass - prog %zu\n", p);
+	}
+}
+
+/* prints "ab\ncde!*" 600 times with PUTS, PUTSP, OUT and a DDR store,
+ * waits for a key and prints "ab\n" */
+static const uint16_t print_prog[] = {
+	0x2A0E, /* LD R5, COUNT */
+	0xE011, /* LOOP LEA R0, MSG */
+	0xF022, /* PUTS */
+	0xE013, /* LEA R0, PACK */
+	0xF024, /* PUTSP */
+	0x200A, /* LD R0, BANG */
+	0xF021, /* OUT */
+	0x2009, /* LD R0, STAR */
+	0xB009, /* STI R0, DDRP */
+	0x1B7F, /* ADD R5, R5, #-1 */
+	0x03F6, /* BRp LOOP */
+	0xF020, /* GETC */
+	0xE006, /* LEA R0, MSG */
+	0xF022, /* PUTS */
+	0xF025, /* HALT */
+	0x0258, /* COUNT .FILL #600 */
+	0x0021, /* BANG .FILL x21 */
+	0x002A, /* STAR .FILL x2A */
+	0xFE06, /* DDRP .FILL xFE06 */
+	0x0061, /* MSG .FILL x61 */
+	0x0062, /* .FILL x62 */
+	0x000A, /* .FILL x0A */
+	0x0000, /* .FILL #0 */
+	0x6463, /* PACK .FILL x6463 */
+	0x0065, /* .FILL x0065 */
+	0x0000, /* .FILL #0 */
+};
+
+/**
+ * Every output policy writes the bytes collected in memory, and holds
+ * them back only as long as it may
+ */
+void output_test() {
+	static const int policies[] = { OUT_UNBUFFERED, OUT_LINE, OUT_FULL };
+	static char want[600 * 8 + 3];
+	size_t i;
+	for (i = 0; i < 600; i++) {
+		memcpy(want + i * 8, "ab\ncde!*", 8);
+	}
+	memcpy(want + i * 8, "ab\n", 3);
+
+	lc3_vm* ref = guest(print_prog, WORDS(print_prog));
+	lc3_run(ref);
+	assert(ref->fault == LC3_OK);
+	assert(ref->out.mem_len == sizeof(want) && memcmp(ref->out.mem, want, sizeof(want)) == 0);
+	lc3_vm_destroy(ref);
+
+	char path[32];
+	temp_file(path);
+	for (i = 0; i < WORDS(policies); i++) {
+		int fd = open(path, O_WRONLY | O_TRUNC);
+		assert(fd >= 0);
+		lc3_vm* g = guest(print_prog, WORDS(print_prog));
+		lc3_output_fd(g, fd, policies[i]);
+		while (g->running) {
+			lc3_step(g);
+			off_t written = lseek(fd, 0, SEEK_CUR);
+			bool waited = g->registers[R_PC] > ORIGIN + 11; /* past the GETC */
+			assert(written + g->out.used <= sizeof(want));
+			if (policies[i] == OUT_UNBUFFERED) {
+				assert(g->out.used == 0);
+			} else if (policies[i] == OUT_LINE) {
+				assert(!memchr(g->out.buf, '\n', g->out.used));
+				assert(waited || written == 0 || want[written - 1] == '\n');
+			} else {
+				assert(waited || written % OUT_BUF_SIZE == 0);
+			}
+		}
+		assert(g->fault == LC3_OK && g->out.used == 0);
+		lc3_vm_destroy(g);
+		close(fd);
+
+		static char got[sizeof(want) + 1];
+		FILE* f = fopen(path, "rb");
+		assert(f);
+		assert(fread(got, 1, sizeof(got), f) == sizeof(want));
+		fclose(f);
+		assert(memcmp(got, want, sizeof(want)) == 0);
+		printf("pass - policy %d\n", policies[i]);
+	}
+	unlink(path);
+}
+
+/* LEA R7, T; JSRR R7 falls through to print "N" as the return address
+ * is the target, then two calls that RET and a JMP R7, R3 ends at 6 */
+static const uint16_t jsrr_prog[] = {
+	0xEE08, /* LEA R7, T */
+	0x41C0, /* JSRR R7 */
+	0x200D, /* LD R0, CN */
+	0xF021, /* OUT */
+	0x4807, /* JSR SUB */
+	0x4806, /* JSR SUB */
+	0xEE07, /* LEA R7, FIN */
+	0xC1C0, /* JMP R7 */
+	0xF025, /* HALT */
+	0x2007, /* T LD R0, CS */
+	0xF021, /* OUT */
+	0xF025, /* HALT */
+	0x16E1, /* SUB ADD R3, R3, #1 */
+	0xC1C0, /* JMP R7 */
+	0x16E4, /* FIN ADD R3, R3, #4 */
+	0xF025, /* HALT */
+	0x004E, /* CN .FILL x4E */
+	0x0053, /* CS .FILL x53 */
+};
+
+#define LANES 8
 
-	lc3_str(str_instr);
-	assert(mem_read(0x3010) == 0x1234);
+/* the guest of lane l in lockstep_test */
+static lc3_vm* lane(int l) {
+	static const uint8_t abc[] = "abc";
+	static const uint8_t hello[] = "hello, world";
+	lc3_vm* g;
+	switch (l) {
+		case 0:
+		case 1:
+		case 2:
+			g = guest(jsrr_prog, WORDS(jsrr_prog));
+			if (l == 2) {
+				lc3_break_at(g, ORIGIN + 5);
+			}
+			return g;
+		case 3:
+			g = guest(echo_prog, WORDS(echo_prog));
+			lc3_input_mem(g, abc, sizeof(abc) - 1);
+			return g;
+		case 4:
+			g = guest(echo_prog, WORDS(echo_prog));
+			lc3_input_mem(g, hello, sizeof(hello) - 1);
+			return g;
+		case 5:
+			return guest(echo_prog, WORDS(echo_prog));
+		default:
+			return guest(smc_prog, WORDS(smc_prog));
+	}
+}
+
+/**
+ * Run a group of guests in lockstep and each of them on its own with
+ * lc3_run, they have to end the same
+ */
+void lockstep_test() {
+	lc3_vm* ref[LANES];
+	lc3_vm* g[LANES];
+	int l;
+	for (l = 0; l < LANES; l++) {
+		ref[l] = lane(l);
+		lc3_run(ref[l]);
+		g[l] = lane(l);
+	}
+	assert(ref[0]->out.mem_len == 1 && ref[0]->out.mem[0] == 'N');
+	assert(ref[0]->registers[R_3] == 6);
+	assert(ref[2]->fault == LC3_OK && ref[2]->registers[R_PC] == ORIGIN + 5);
+
+	/* a group per image, so the lanes run as vectors */
+	lc3_run_lockstep(g, 3);
+	lc3_run_lockstep(g + 3, 3);
+	lc3_run_lockstep(g + 6, LANES - 6);
+	for (l = 0; l < LANES; l++) {
+		assert_same(ref[l], g[l]);
+		printf("pass - lane %d\n", l);
+	}
+
+	/* resumed past the breakpoint */
+	g[2]->running = ref[2]->running = true;
+	lc3_run_lockstep(&g[2], 1);
+	lc3_run(ref[2]);
+	assert_same(ref[0], g[2]);
+	assert_same(ref[2], g[2]);
+	printf("pass - resumed\n");
+
+	for (l = 0; l < LANES; l++) {
+		lc3_vm_destroy(ref[l]);
+		lc3_vm_destroy(g[l]);
+	}
+}
+
+/* the engines that run fused records */
+static void (*const fusing[])(lc3_vm*) = { lc3_run, lc3_run_threaded };
+
+/* runs words from the registers in regs with vm->fuse off, then with it
+ * on under each engine that fuses, they have to end the same. Returns
+ * the run with fusing off. */
+static lc3_vm* fuse_same(const uint16_t* words, size_t n, const uint16_t* regs) {
+	lc3_vm* ref = guest(words, n);
+	memcpy(ref->registers, regs, R_PC * sizeof(uint16_t));
+	lc3_run(ref);
+	size_t i;
+	for (i = 0; i < WORDS(fusing); i++) {
+		lc3_vm* g = guest(words, n);
+		memcpy(g->registers, regs, R_PC * sizeof(uint16_t));
+		g->fuse = true;
+		fusing[i](g);
+		assert_same(ref, g);
+		assert_opcodes_add_up(g);
+		lc3_vm_destroy(g);
+	}
+	return ref;
+}
+
+/* words from regs with fusing off, stopped by stop_at */
+static lc3_vm* stopped_at(const uint16_t* words, size_t n, const uint16_t* regs, uint64_t stop_at) {
+	lc3_vm* g = guest(words, n);
+	memcpy(g->registers, regs, R_PC * sizeof(uint16_t));
+	g->stop_at = stop_at;
+	return g;
+}
+
+/* fused lc3_run() stops at every budget below max where it does with
+ * fusing off. lc3_run_threaded() only looks at stop_at after jumps, it
+ * stops at each of those in the first 4 * max instructions. */
+static void budget_same(const uint16_t* words, size_t n, const uint16_t* regs, uint64_t max) {
+	uint64_t b;
+	for (b = 1; b < max; b++) {
+		lc3_vm* off = stopped_at(words, n, regs, UINT64_MAX);
+		lc3_vm* on = stopped_at(words, n, regs, UINT64_MAX);
+		lc3_set_budget(off, b);
+		lc3_set_budget(on, b);
+		on->fuse = true;
+		lc3_run(off);
+		lc3_run(on);
+		assert_same(off, on);
+		lc3_vm_destroy(off);
+		lc3_vm_destroy(on);
+	}
+
+	lc3_vm* step = stopped_at(words, n, regs, UINT64_MAX);
+	while (step->running && step->retired < 4 * max) {
+		lc3_decoded d;
+		lc3_decode(step->memory[step->registers[R_PC]], &d);
+		lc3_step(step);
+		if (d.handler != D_BR && d.handler != D_JMP && d.handler != D_JSR && d.handler != D_JSRR) {
+			continue;
+		}
+		lc3_vm* off = stopped_at(words, n, regs, step->retired);
+		lc3_vm* on = stopped_at(words, n, regs, step->retired);
+		on->fuse = true;
+		lc3_run(off);
+		lc3_run_threaded(on);
+		assert_same(off, on);
+		lc3_vm_destroy(off);
+		lc3_vm_destroy(on);
+	}
+	lc3_vm_destroy(step);
+}
+
+/**
+ * Every pair lc3_decode fuses, one of them rewritten after it ran, with
+ * vm->fuse off and on
+ */
+void fuse_test() {
+	static const uint16_t prog[] = {
+		0x5B60, /* AND R5, R5, #0 */
+		0x1B62, /* ADD R5, R5, #2 */
+		0x54A0, /* OUTER AND R2, R2, #0 */
+		0x14A5, /* TWEAK ADD R2, R2, #5 */
+		0xE812, /* LEA R4, DATA */
+		0x6700, /* LDR R3, R4, #0 */
+		0x16C2, /* ADD R3, R3, R2 */
+		0x7700, /* STR R3, R4, #0 */
+		0x6701, /* LDR R3, R4, #1 */
+		0x16E3, /* ADD R3, R3, #3 */
+		0x7701, /* STR R3, R4, #1 */
+		0x2209, /* LD R1, TEN */
+		0x127F, /* SPIN ADD R1, R1, #-1 */
+		0x03FE, /* BRp SPIN */
+		0xE00A, /* LEA R0, MSG */
+		0xF022, /* PUTS */
+		0x2005, /* LD R0, NEWT */
+		0x31F1, /* ST R0, TWEAK */
+		0x1B7F, /* ADD R5, R5, #-1 */
+		0x03EE, /* BRp OUTER */
+		0xF025, /* HALT */
+		0x000A, /* TEN .FILL #10 */
+		0x14A7, /* NEWT ADD R2, R2, #7 */
+		0x0064, /* DATA .FILL #100 */
+		0x00C8, /* .FILL #200 */
+		0x006F, /* MSG .STRINGZ "ok" */
+		0x006B,
+		0x0000,
+	};
+	static const uint16_t regs[R_PC];
+	lc3_vm* ref = fuse_same(prog, WORDS(prog), regs);
+	assert(ref->memory[ORIGIN + 23] == 100 + 5 + 7);
+	assert(ref->memory[ORIGIN + 24] == 200 + 3 + 3);
+	assert(ref->out.mem_len == 4 && memcmp(ref->out.mem, "okok", 4) == 0);
+	lc3_vm_destroy(ref);
+	printf("pass - fuse on and off\n");
+
+	lc3_vm* g = guest(prog, WORDS(prog));
+	g->fuse = true;
+	g->stop_at = 20;
+	lc3_run(g);
+	lc3_decoded* d = g->decoded + ORIGIN;
+	assert(d[0].handler == D_ANDI_ADDI);
+	assert(d[2].handler == D_ANDI_ADDI);
+	assert(d[5].handler == D_LDR_ADD_STR);
+	assert(d[8].handler == D_LDR_ADDI_STR);
+	assert(d[12].handler == D_ADDI_BR);
+	g->stop_at = g->budget;
+	lc3_run(g);
+	assert(d[14].handler == D_LEA_TRAP);
+	/* the last store to TWEAK dropped the pairs it is in */
+	assert(d[0].handler == D_DECODE && d[2].handler == D_DECODE);
+	lc3_vm_destroy(g);
+	printf("pass - fused records\n");
+
+	/* a budget that ends inside a fused pair */
+	budget_same(prog, WORDS(prog), regs, 40);
+	printf("pass - budgets\n");
+}
+
+/* loop idiom guests, the loop at ORIGIN, data from ORIGIN + 16 on */
+#define LOOP_DATA 16
+
+/* the loop in words, from regs, ends the same with fusing on and off
+ * and at every short budget. Returns the handler the fused run left in
+ * the loop's first record. */
+static uint8_t idiom_same(const uint16_t* words, const uint16_t* regs) {
+	lc3_vm_destroy(fuse_same(words, 64, regs));
+	budget_same(words, 64, regs, 30);
+	lc3_vm* g = guest(words, 64);
+	memcpy(g->registers, regs, R_PC * sizeof(uint16_t));
+	g->fuse = true;
+	lc3_run(g);
+	uint8_t handler = g->decoded[ORIGIN].handler;
+	lc3_vm_destroy(g);
+	return handler;
+}
+
+/**
+ * Each loop idiom with fusing on and off: counts of 0, negative and
+ * 0x7FFF, products that overflow, dividends and divisors run one
+ * instruction at a time, overlapping copies, and copies and fills into
+ * code and device registers
+ */
+void idiom_test() {
+	uint16_t words[64];
+	memset(words, 0, sizeof(words));
+
+	static const uint16_t mul[] = {
+		0x1001, /* L ADD R0, R0, R1 */
+		0x14BF, /* ADD R2, R2, #-1 */
+		0x03FD, /* BRp L */
+		0x1923, /* LI ADD R4, R4, #3 */
+		0x14BF, /* ADD R2, R2, #-1 */
+		0x03FD, /* BRp LI */
+		0xF025, /* HALT */
+	};
+	/* R1, R2: the second loop goes round once with the count R2 ends at */
+	static const uint16_t mul_regs[][R_PC] = {
+		{ 0, 3, 5 },
+		{ 0, 3, 0 },
+		{ 0, 0x1234, 0x8000 },
+		{ 0, 7, 0x7FFF },
+		{ 0, 1, 0xFFFF },
+	};
+	memcpy(words, mul, sizeof(mul));
+	size_t i;
+	for (i = 0; i < WORDS(mul_regs); i++) {
+		assert(idiom_same(words, mul_regs[i]) == D_MUL_LOOP);
+	}
+	printf("pass - multiply\n");
+
+	static const uint16_t div[] = {
+		0x1001, /* L ADD R0, R0, R1 */
+		0x0802, /* BRn NEXT */
+		0x14A1, /* ADD R2, R2, #1 */
+		0x0FFC, /* BRnzp L */
+		0x16FD, /* NEXT ADD R3, R3, #-3 */
+		0x0802, /* BRn DONE */
+		0x1921, /* ADD R4, R4, #1 */
+		0x0FFC, /* BRnzp NEXT */
+		0xF025, /* DONE HALT */
+	};
+	/* R0 / -R1, then R3 / 3 */
+	static const uint16_t div_regs[][R_PC] = {
+		{ 17, -5, 0, 10 },
+		{ 0, -5, 0, 0 },
+		{ 0x7FFF, -1, 0, 0x7FFF },
+	};
+	memset(words, 0, sizeof(words));
+	memcpy(words, div, sizeof(div));
+	for (i = 0; i < WORDS(div_regs); i++) {
+		assert(idiom_same(words, div_regs[i]) == D_DIV_LOOP);
+	}
+	/* run one instruction at a time, the loop record goes back to ADD */
+	static const uint16_t div_slow[][R_PC] = {
+		{ -7, -5, 0, -4 },
+		{ 20, 5, 0, 1 },
+		{ 5, 0x8000, 0, 2 },
+	};
+	for (i = 0; i < WORDS(div_slow); i++) {
+		assert(idiom_same(words, div_slow[i]) == D_ADD);
+	}
+	printf("pass - divide\n");
+
+	static const uint16_t copy[] = {
+		0x6700, /* L LDR R3, R4, #0 */
+		0x7740, /* STR R3, R5, #0 */
+		0x1921, /* ADD R4, R4, #1 */
+		0x1B61, /* ADD R5, R5, #1 */
+		0x1DBF, /* ADD R6, R6, #-1 */
+		0x03FA, /* BRp L */
+		0xF025, /* HALT */
+	};
+	const uint16_t data = ORIGIN + LOOP_DATA;
+	/* R4 from, R5 to, R6 words */
+	const uint16_t copy_regs[][R_PC] = {
+		{ 0, 0, 0, 0, data, data + 24, 8 },
+		{ 0, 0, 0, 0, data, data + 2, 8 },
+		{ 0, 0, 0, 0, data + 2, data, 8 },
+		{ 0, 0, 0, 0, data, data + 24, 0 },
+		{ 0, 0, 0, 0, data, data + 24, 0x8000 },
+		{ 0, 0, 0, 0, data + 32, ORIGIN, WORDS(copy) - 1 },
+		{ 0, 0, 0, 0, MR_DSR, data + 24, 4 },
+		{ 0, 0, 0, 0, data, MR_DDR, 1 },
+	};
+	memset(words, 0, sizeof(words));
+	memcpy(words, copy, sizeof(copy));
+	for (i = 0; i < 8; i++) {
+		words[LOOP_DATA + i] = 'a' + i;
+	}
+	/* copied over the loop as it runs, the words stay the same */
+	memcpy(words + LOOP_DATA + 32, copy, sizeof(copy) - sizeof(uint16_t));
+	for (i = 0; i < WORDS(copy_regs); i++) {
+		idiom_same(words, copy_regs[i]);
+	}
+	assert(idiom_same(words, copy_regs[0]) == D_COPY_LOOP);
+	printf("pass - copy\n");
+
+	static const uint16_t fill[] = {
+		0x7280, /* L STR R1, R2, #0 */
+		0x14A1, /* ADD R2, R2, #1 */
+		0x16FF, /* ADD R3, R3, #-1 */
+		0x03FC, /* BRp L */
+		0xF025, /* HALT */
+	};
+	/* R1 value, R2 to, R3 words */
+	const uint16_t fill_regs[][R_PC] = {
+		{ 0, 0x1234, data, 10 },
+		{ 0, 0, data, 10 },
+		{ 0, 0x1234, data, 0 },
+		{ 0, 0x1234, data, 0xFFF0 },
+		{ 0, fill[0], ORIGIN, 1 },
+		{ 0, 'x', MR_DDR, 1 },
+	};
+	memset(words, 0, sizeof(words));
+	memcpy(words, fill, sizeof(fill));
+	for (i = 0; i < 10; i++) {
+		words[LOOP_DATA + i] = 0xFFFF;
+	}
+	for (i = 0; i < WORDS(fill_regs); i++) {
+		idiom_same(words, fill_regs[i]);
+	}
+	assert(idiom_same(words, fill_regs[0]) == D_FILL_LOOP);
+	printf("pass - fill\n");
+}
+
+#ifdef CORE
+/**
+ * Translate a guest with lc3_aot(), build and run it, it has to print
+ * what lc3_run() prints. JSRR R7 goes to the return address, and a store
+ * lc3_step() runs, from code the translator did not see, overwrites a
+ * block that already ran.
+ */
+void aot_test() {
+	static const uint16_t prog[] = {
+		0xEE06, /* LEA R7, T */
+		0x41C0, /* JSRR R7 */
+		0x200E, /* LD R0, CN */
+		0xF021, /* OUT */
+		0x4805, /* JSR P */
+		0xE407, /* LEA R2, MID */
+		0xC080, /* JMP R2 */
+		0x200A, /* T LD R0, CS */
+		0xF021, /* OUT */
+		0xF025, /* HALT */
+		0x2008, /* P LD R0, CA */
+		0xF021, /* OUT */
+		0xC1C0, /* RET */
+		0x2007, /* MID LD R0, NEWP */
+		0x31FB, /* ST R0, P */
+		0x4FFA, /* JSR P */
+		0xF025, /* HALT */
+		0x004E, /* CN .FILL x4E */
+		0x0053, /* CS .FILL x53 */
+		0x0041, /* CA .FILL x41 */
+		0x0042, /* CB .FILL x42 */
+		0x2009, /* NEWP LD R0, CB at P */
+	};
+	lc3_vm* ref = guest(prog, WORDS(prog));
+	lc3_run(ref);
+	assert(ref->out.mem_len == 3 && memcmp(ref->out.mem, "NAB", 3) == 0);
+
+	/* translated programs start at pc 0 */
+	lc3_vm* g = lc3_vm_create();
+	assert(g);
+	memcpy(g->memory, prog, sizeof(prog));
+	char src[32];
+	char bin[32];
+	char cmd[1024];
+	temp_file(src);
+	temp_file(bin);
+	FILE* f = fopen(src, "w");
+	assert(f && lc3_aot(g, f));
+	assert(fclose(f) == 0);
+	lc3_vm_destroy(g);
+	snprintf(cmd, sizeof(cmd), "gcc -I. -x c %s -x none " CORE " -o %s -lpthread", src, bin);
+	assert(system(cmd) == 0);
+
+	char out[16];
+	f = popen(bin, "r");
+	assert(f);
+	size_t n = fread(out, 1, sizeof(out), f);
+	assert(pclose(f) == 0);
+	assert(n == ref->out.mem_len && memcmp(out, ref->out.mem, n) == 0);
+	printf("pass - %.*s\n", (int) n, out);
+
+	unlink(src);
+	unlink(bin);
+	lc3_vm_destroy(ref);
+}
+#endif
+
+/**
+ * Trace a guest over several trace buffers, decode the trace and follow
+ * it against the same guest run one instruction at a time. A trace cut
+ * short is rejected.
+ */
+void trace_test() {
+	char path[32];
+	char dump[32];
+	temp_file(path);
+	temp_file(dump);
+
+	lc3_vm* g = guest(trace_prog, WORDS(trace_prog));
+	assert(lc3_trace_start(g, path));
+	lc3_run_traced(g);
+	assert(lc3_trace_stop(g));
+	lc3_vm* ref = guest(trace_prog, WORDS(trace_prog));
+	lc3_run(ref);
+	assert_same(ref, g);
+	assert(ref->registers[R_2] == (uint16_t) (0x10000 + 3 * 0x10000));
+	lc3_vm_destroy(g);
+	printf("pass - traced run\n");
+
+	FILE* in = fopen(path, "rb");
+	FILE* out = fopen(dump, "w+");
+	assert(in && out);
+	assert(lc3_trace_dump(in, out));
+	fclose(in);
+	rewind(out);
+
+	/* registers as the decoded records leave them */
+	lc3_vm* step = guest(trace_prog, WORDS(trace_prog));
+	uint16_t regs[R_COUNT];
+	memcpy(regs, step->registers, sizeof(regs));
+	char line[128];
+	while (fgets(line, sizeof(line), out)) {
+		unsigned long long n;
+		unsigned pc;
+		unsigned word;
+		assert(sscanf(line, "%llu x%x x%x", &n, &pc, &word) == 3);
+		assert(n == step->retired + 1 && pc == step->registers[R_PC] && word == step->memory[pc]);
+		lc3_step(step);
+		regs[R_PC] = pc + 1;
+
+		char* rest;
+		char* tok = strtok_r(line, " \n", &rest);
+		int i;
+		for (i = 0; i < 3; i++) {
+			tok = strtok_r(NULL, " \n", &rest);
+		}
+		while ((tok = strtok_r(NULL, " \n", &rest))) {
+			int r;
+			unsigned a;
+			unsigned v;
+			if (sscanf(tok, "R%d=x%x", &r, &v) == 2) {
+				regs[r] = v;
+			} else if (strncmp(tok, "cc=", 3) == 0) {
+				regs[R_COND] = tok[3] == 'n' ? FL_NEG : tok[3] == 'z' ? FL_ZRO : FL_POS;
+			} else if (sscanf(tok, "pc=x%x", &v) == 1) {
+				regs[R_PC] = v;
+			} else {
+				assert(sscanf(tok, "[x%x]=x%x", &a, &v) == 2);
+				assert(step->memory[a] == v);
+			}
+		}
+		assert(memcmp(regs, step->registers, sizeof(regs)) == 0);
+	}
+	assert(step->retired == ref->retired && !step->running);
+	fclose(out);
+	lc3_vm_destroy(step);
+	printf("pass - decoded %llu records\n", (unsigned long long) ref->retired);
+
+	/* the last block loses its end */
+	FILE* f = fopen(path, "rb");
+	assert(f && fseek(f, 0, SEEK_END) == 0);
+	long size = ftell(f);
+	fclose(f);
+	assert(truncate(path, size - 16) == 0);
+	in = fopen(path, "rb");
+	out = fopen("/dev/null", "w");
+	assert(in && out);
+	assert(!lc3_trace_dump(in, out));
+	fclose(in);
+	fclose(out);
+	printf("pass - truncated\n");
+
+	unlink(path);
+	unlink(dump);
+	lc3_vm_destroy(ref);
+}
+
+/* Image files */
+#define IMAGES 4
+
+/* word i of a test image, distinct bytes so a missed swap shows */
+static uint16_t image_word(uint16_t origin, uint32_t i) {
+	return (uint16_t) ((origin + i) * 0x9E37u + 0x0102u);
+}
+
+/* an image file at origin with n words */
+static void write_image(const char* path, uint16_t origin, uint32_t n) {
+	FILE* f = fopen(path, "wb");
+	assert(f);
+	uint32_t i;
+	for (i = 0; i <= n; i++) {
+		uint16_t w = i == 0 ? origin : image_word(origin, i - 1);
+		assert(fputc(w >> 8, f) != EOF && fputc(w & 0xFF, f) != EOF);
+	}
+	assert(fclose(f) == 0);
+}
+
+/* memory holds n words of the image at origin and nothing around them */
+static void assert_image(const uint16_t* memory, uint16_t origin, uint32_t n) {
+	uint32_t i;
+	for (i = 0; i < n; i++) {
+		assert(memory[origin + i] == image_word(origin, i));
+	}
+	assert(origin == 0 || memory[origin - 1] == 0);
+	assert(origin + n == MEMORY_SIZE || memory[origin + n] == 0);
+}
+
+/**
+ * Load images whose word counts are not whole vectors, one ending at
+ * xFFFF and one running past it, and images that overlap
+ */
+void image_test() {
+	static const struct {
+		uint16_t origin;
+		uint32_t words;
+	} imgs[IMAGES] = {
+		{ 0x3000, 37 },    /* two AVX2 vectors and 5 words */
+		{ 0x4001, 13 },    /* one SSSE3 vector and 5 words */
+		{ 0x5000, 7 },     /* no whole vector */
+		{ 0xFFF9, 7 },     /* ends at xFFFF */
+	};
+	char paths[IMAGES][32];
+	char* list[IMAGES];
+	int i;
+	for (i = 0; i < IMAGES; i++) {
+		temp_file(paths[i]);
+		write_image(paths[i], imgs[i].origin, imgs[i].words);
+		list[i] = paths[i];
+	}
+
+	lc3_vm* g = lc3_vm_create();
+	assert(g && lc3_load_images(g, list, IMAGES));
+	for (i = 0; i < IMAGES; i++) {
+		assert_image(g->memory, imgs[i].origin, imgs[i].words);
+	}
+	lc3_vm_destroy(g);
+	printf("pass - mapped\n");
+
+	lc3_image* shared = lc3_image_load(list, IMAGES);
+	assert(shared);
+	g = lc3_vm_create_from(shared);
+	assert(g);
+	/* a new VM sets MCR over what the last image left there */
+	assert(g->memory[MR_MCR] == 1 << 15);
+	g->memory[MR_MCR] = image_word(imgs[IMAGES - 1].origin, MR_MCR - imgs[IMAGES - 1].origin);
+	for (i = 0; i < IMAGES; i++) {
+		assert_image(g->memory, imgs[i].origin, imgs[i].words);
+	}
+	lc3_vm_destroy(g);
+	lc3_image_free(shared);
+	printf("pass - shared\n");
+
+	g = lc3_vm_create();
+	assert(g);
+	FILE* f = fopen(paths[0], "rb");
+	assert(f);
+	read_image_file(g, f);
+	fclose(f);
+	assert_image(g->memory, imgs[0].origin, imgs[0].words);
+	lc3_vm_destroy(g);
+	printf("pass - read\n");
+
+	/* 21 words from xFFF0, the last 5 are dropped and nothing wraps */
+	char past[32];
+	temp_file(past);
+	write_image(past, 0xFFF0, 21);
+	g = lc3_vm_create();
+	assert(g);
+	char* one[1] = { past };
+	assert(lc3_load_images(g, one, 1));
+	assert_image(g->memory, 0xFFF0, 16);
+	assert(g->memory[0] == 0 && g->memory[4] == 0);
+	lc3_vm_destroy(g);
+	printf("pass - truncated\n");
+
+	/* touching the last word of the first image, then just after it */
+	char near[32];
+	temp_file(near);
+	char* pair[2] = { paths[0], near };
+	write_image(near, imgs[0].origin + imgs[0].words - 1, 3);
+	g = lc3_vm_create();
+	assert(g);
+	assert(!lc3_load_images(g, pair, 2));
+	assert(g->memory[imgs[0].origin] == 0);
+	lc3_vm_destroy(g);
+	write_image(near, imgs[0].origin + imgs[0].words, 3);
+	g = lc3_vm_create();
+	assert(g && lc3_load_images(g, pair, 2));
+	assert(g->memory[imgs[0].origin + imgs[0].words + 2] == image_word(imgs[0].origin + imgs[0].words, 2));
+	lc3_vm_destroy(g);
+	printf("pass - overlap\n");
+
+	for (i = 0; i < IMAGES; i++) {
+		unlink(paths[i]);
+	}
+	unlink(past);
+	unlink(near);
+}
+
+/* Fuzzer */
+
+/* fills BUF before its first keyboard access, then stores and echoes keys
+ * until the input ends, counting them in R4. A space latches the virtual
+ * clock and overwrites BUMP so later keys count twice */
+static const uint16_t fuzz_prog[] = {
+	0x54A0, /* AND R2, R2, #0 */
+	0x14A5, /* ADD R2, R2, #5 */
+	0xE219, /* LEA R1, BUF */
+	0x7440, /* FILL STR R2, R1, #0 */
+	0x1261, /* ADD R1, R1, #1 */
+	0x14BF, /* ADD R2, R2, #-1 */
+	0x03FC, /* BRp FILL */
+	0xE214, /* LEA R1, BUF */
+	0xAC11, /* READ LDI R6, KBSRP */
+	0x07FE, /* BRzp READ */
+	0xF020, /* GETC */
+	0x1020, /* ADD R0, R0, #0 */
+	0x080B, /* BRn DONE */
+	0x7040, /* STR R0, R1, #0 */
+	0x1261, /* ADD R1, R1, #1 */
+	0xF021, /* OUT */
+	0x1921, /* BUMP ADD R4, R4, #1 */
+	0x1630, /* ADD R3, R0, #-16 */
+	0x16F0, /* ADD R3, R3, #-16 */
+	0x0BF4, /* BRnp READ */
+	0xAC06, /* LDI R6, VCLKP */
+	0x2A03, /* LD R5, INC2 */
+	0x3BF9, /* ST R5, BUMP */
+	0x0FF0, /* BRnzp READ */
+	0xF025, /* DONE HALT */
+	0x1922, /* INC2 ADD R4, R4, #2 */
+	0xFE00, /* KBSRP .FILL xFE00 */
+	0xFE08, /* VCLKP .FILL xFE08 */
+	0x0000, /* BUF .FILL #0 */
+};
+
+/**
+ * Every case run from the fork point ends where the guest run from
+ * scratch on the same input does, whatever the cases before it dirtied
+ */
+void fuzz_test() {
+	static const char* const inputs[] = {
+		"ab", "a b c", "", "no spaces here", " ", "two  spaces and a long tail after them", "zz"
+	};
+	static const uint64_t budgets[] = { 100000, 150 }; /* from the fork point */
+	char path[32];
+	temp_file(path);
+	FILE* file = fopen(path, "wb");
+	assert(file);
+	size_t i;
+	assert(fputc(ORIGIN >> 8, file) != EOF && fputc(ORIGIN & 0xFF, file) != EOF);
+	for (i = 0; i < WORDS(fuzz_prog); i++) {
+		assert(fputc(fuzz_prog[i] >> 8, file) != EOF && fputc(fuzz_prog[i] & 0xFF, file) != EOF);
+	}
+	assert(fclose(file) == 0);
+	char* paths[1] = { path };
+
+	/* loaded images start at x0000 like the fuzzer's, not at ORIGIN */
+	lc3_vm* g = guest(fuzz_prog, WORDS(fuzz_prog));
+	g->registers[R_PC] = 0;
+	lc3_run(g);
+	uint64_t first_use = g->in_mem.first_use;
+	assert(first_use > 1);
+	lc3_vm_destroy(g);
+
+	size_t b;
+	for (b = 0; b < WORDS(budgets); b++) {
+		lc3_fuzzer* f = lc3_fuzzer_create(paths, 1, budgets[b]);
+		assert(f);
+		int hangs = 0;
+		int round;
+		for (round = 0; round < 2; round++) {
+			for (i = 0; i < WORDS(inputs); i++) {
+				const uint8_t* data = (const uint8_t*) inputs[i];
+				size_t len = strlen(inputs[i]);
+				lc3_vm* vm = lc3_fuzz_case(f, data, len);
+				g = guest(fuzz_prog, WORDS(fuzz_prog));
+				g->registers[R_PC] = 0;
+				lc3_input_mem(g, data, len);
+				lc3_set_budget(g, first_use - 1 + budgets[b]);
+				lc3_run(g);
+				assert_same(g, vm);
+				hangs += vm->fault == LC3_BUDGET;
+				lc3_vm_destroy(g);
+			}
+		}
+		assert(b == 0 ? hangs == 0 : hangs > 0);
+		lc3_fuzzer_destroy(f);
+		printf("pass - budget %llu\n", (unsigned long long) budgets[b]);
+	}
+	unlink(path);
 }
 
 int main(int argc, char** argv) {
+	vm = lc3_vm_create();
+	assert(vm);
+
 	before();
 	printf("Begin: add_test\n");
 	add_test();
@@ -450,7 +1858,7 @@ int main(int argc, char** argv) {
 	
 	before();
 	printf("Begin: jmp_ret_test\n");
-	br_test();
+	jmp_ret_test();
 	printf("PASSED: jmp_ret_test\n");
 
 	before();
@@ -492,5 +1900,73 @@ int main(int argc, char** argv) {
 	printf("Begin: str_test\n");
 	str_test();
 	printf("PASSED: str_test\n");
+
+	printf("Begin: smc_test\n");
+	smc_test();
+	printf("PASSED: smc_test\n");
+
+	printf("Begin: profile_test\n");
+	profile_test();
+	printf("PASSED: profile_test\n");
+
+	printf("Begin: sample_test\n");
+	sample_test();
+	printf("PASSED: sample_test\n");
+
+	printf("Begin: snapshot_test\n");
+	snapshot_test();
+	printf("PASSED: snapshot_test\n");
+
+	printf("Begin: checkpoint_test\n");
+	checkpoint_test();
+	printf("PASSED: checkpoint_test\n");
+
+	printf("Begin: replay_test\n");
+	replay_test();
+	printf("PASSED: replay_test\n");
+
+	printf("Begin: pipe_test\n");
+	pipe_test();
+	printf("PASSED: pipe_test\n");
+
+	printf("Begin: idle_test\n");
+	idle_test();
+	printf("PASSED: idle_test\n");
+
+	printf("Begin: output_test\n");
+	output_test();
+	printf("PASSED: output_test\n");
+
+	printf("Begin: fuzz_test\n");
+	fuzz_test();
+	printf("PASSED: fuzz_test\n");
+
+	printf("Begin: image_test\n");
+	image_test();
+	printf("PASSED: image_test\n");
+
+	printf("Begin: trace_test\n");
+	trace_test();
+	printf("PASSED: trace_test\n");
+
+	printf("Begin: lockstep_test\n");
+	lockstep_test();
+	printf("PASSED: lockstep_test\n");
+
+	printf("Begin: fuse_test\n");
+	fuse_test();
+	printf("PASSED: fuse_test\n");
+
+	printf("Begin: idiom_test\n");
+	idiom_test();
+	printf("PASSED: idiom_test\n");
+
+#ifdef CORE
+	printf("Begin: aot_test\n");
+	aot_test();
+	printf("PASSED: aot_test\n");
+#endif
+
+	lc3_vm_destroy(vm);
 	return 0;
 }
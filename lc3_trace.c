@@ -0,0 +1,552 @@
+#include "lc3.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+/* Execution traces
+ * lc3_run_traced() is lc3_run() appending one record per instruction to
+ * a buffer. A full buffer goes to the writer thread, which compresses and
+ * writes it while the VM fills the other one, so the VM only waits when
+ * the writer falls a whole buffer behind.
+ *
+ * File: trace_header, then blocks of { uint32 raw, uint32 packed, packed
+ * bytes } with whole records only. A record is a flags byte followed by
+ *   T_WORD   instruction word, first time at this pc or after it changed
+ *   T_REGS   mask of the changed R0-R7, then new - old of each
+ *   T_COND   new R_COND
+ *   T_JUMP   new R_PC - (pc + 1), when it is not the next word
+ *   T_STORE  address and value stored
+ * all 16 bit values little endian. The fetch pc is R_PC as left by the
+ * record before. Deltas repeat from one trip around a loop to the next,
+ * which is what the compressor feeds on. */
+
+#define TRACE_MAGIC "LC3TRACE"
+#define TRACE_VERSION 1
+#define TRACE_BUF_SIZE (1 << 20)
+#define TRACE_MAX_RECORD 32
+
+enum {
+	T_WORD = 1 << 0,
+	T_REGS = 1 << 1,
+	T_COND = 1 << 2,
+	T_JUMP = 1 << 3,
+	T_STORE = 1 << 4
+};
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint16_t registers[R_COUNT];
+	uint64_t retired;  /* instructions run before the first record */
+} trace_header;
+
+/* LZ4 style blocks
+ * a token byte (literal count << 4 | match length - 4, 15 means more
+ * length bytes follow), the literals, then a 16 bit offset back to the
+ * match. The last sequence of a block is literals only. */
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 14
+#define LZ_BOUND(n) ((n) + (n) / 255 + 16)
+
+static uint32_t lz_hash(const uint8_t* p) {
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static uint8_t* lz_put_len(uint8_t* op, size_t len) {
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = len;
+	return op;
+}
+
+static uint8_t* lz_sequence(uint8_t* op, const uint8_t* lit, size_t lit_len, size_t offset, size_t match) {
+	uint8_t* token = op++;
+	*token = (lit_len < 15 ? lit_len : 15) << 4;
+	if (lit_len >= 15) {
+		op = lz_put_len(op, lit_len - 15);
+	}
+	memcpy(op, lit, lit_len);
+	op += lit_len;
+	if (match) {
+		*op++ = offset & 0xFF;
+		*op++ = offset >> 8;
+		match -= LZ_MIN_MATCH;
+		*token |= match < 15 ? match : 15;
+		if (match >= 15) {
+			op = lz_put_len(op, match - 15);
+		}
+	}
+	return op;
+}
+
+/* dst holds LZ_BOUND(n) bytes, table 1 << LZ_HASH_BITS entries */
+static size_t lz_compress(const uint8_t* src, size_t n, uint8_t* dst, uint32_t* table) {
+	const uint8_t* ip = src;
+	const uint8_t* anchor = src;
+	const uint8_t* end = src + n;
+	uint8_t* op = dst;
+
+	memset(table, 0, (1 << LZ_HASH_BITS) * sizeof(uint32_t));
+	while (ip + LZ_MIN_MATCH <= end) {
+		uint32_t h = lz_hash(ip);
+		uint32_t prev = table[h]; /* position + 1, 0 is empty */
+		table[h] = ip - src + 1;
+		const uint8_t* ref = prev ? src + prev - 1 : ip;
+		if (ref < ip && ip - ref <= 0xFFFF && memcmp(ref, ip, LZ_MIN_MATCH) == 0) {
+			size_t len = LZ_MIN_MATCH;
+			while (ip + len < end && ref[len] == ip[len]) {
+				len++;
+			}
+			op = lz_sequence(op, anchor, ip - anchor, ip - ref, len);
+			ip += len;
+			anchor = ip;
+		} else {
+			ip++;
+		}
+	}
+	op = lz_sequence(op, anchor, end - anchor, 0, 0);
+	return op - dst;
+}
+
+static bool lz_get_len(const uint8_t** ip, const uint8_t* end, size_t* len) {
+	uint8_t b;
+	do {
+		if (*ip == end) {
+			return false;
+		}
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255);
+	return true;
+}
+
+static bool lz_decompress(const uint8_t* src, size_t n, uint8_t* dst, size_t raw) {
+	const uint8_t* ip = src;
+	const uint8_t* end = src + n;
+	uint8_t* op = dst;
+	uint8_t* op_end = dst + raw;
+
+	while (ip < end) {
+		uint8_t token = *ip++;
+		size_t lit = token >> 4;
+		if (lit == 15 && !lz_get_len(&ip, end, &lit)) {
+			return false;
+		}
+		if (lit > (size_t) (end - ip) || lit > (size_t) (op_end - op)) {
+			return false;
+		}
+		memcpy(op, ip, lit);
+		op += lit;
+		ip += lit;
+		if (ip == end) {
+			break;
+		}
+
+		if (end - ip < 2) {
+			return false;
+		}
+		size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		size_t len = token & 15;
+		if (len == 15 && !lz_get_len(&ip, end, &len)) {
+			return false;
+		}
+		len += LZ_MIN_MATCH;
+		if (offset == 0 || offset > (size_t) (op - dst) || len > (size_t) (op_end - op)) {
+			return false;
+		}
+		const uint8_t* ref = op - offset; /* may overlap op */
+		while (len-- > 0) {
+			*op++ = *ref++;
+		}
+	}
+	return op == op_end;
+}
+
+struct lc3_trace {
+	FILE* file;
+	bool failed;             /* a write failed, the rest is dropped */
+
+	/* the VM fills bufs[fill], the writer drains bufs[full] */
+	uint8_t* bufs[2];
+	int fill;
+	size_t used;
+	int full;                /* -1: the writer is idle */
+	size_t full_len;
+	bool stop;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	/* writer only */
+	uint8_t* packed;
+	uint32_t table[1 << LZ_HASH_BITS];
+
+	/* what the decoder will know after the last record */
+	uint16_t registers[R_COUNT];
+	uint16_t words[MEMORY_SIZE];
+	uint8_t seen[MEMORY_SIZE / 8];
+};
+
+static void put16(uint8_t** p, uint16_t v) {
+	(*p)[0] = v & 0xFF;
+	(*p)[1] = v >> 8;
+	*p += 2;
+}
+
+static uint16_t get16(const uint8_t** p) {
+	uint16_t v = (*p)[0] | ((*p)[1] << 8);
+	*p += 2;
+	return v;
+}
+
+static bool write_block(lc3_trace* t, const uint8_t* raw, size_t len) {
+	uint32_t sizes[2];
+	sizes[0] = len;
+	sizes[1] = lz_compress(raw, len, t->packed, t->table);
+	return fwrite(sizes, sizeof(sizes), 1, t->file) == 1 &&
+			fwrite(t->packed, sizes[1], 1, t->file) == 1;
+}
+
+static void* writer(void* p) {
+	lc3_trace* t = p;
+	pthread_mutex_lock(&t->lock);
+	while (1) {
+		while (t->full < 0 && !t->stop) {
+			pthread_cond_wait(&t->cond, &t->lock);
+		}
+		if (t->full < 0) {
+			break;
+		}
+		int full = t->full;
+		size_t len = t->full_len;
+		pthread_mutex_unlock(&t->lock);
+
+		bool ok = t->failed || write_block(t, t->bufs[full], len);
+
+		pthread_mutex_lock(&t->lock);
+		if (!ok && !t->failed) {
+			fprintf(stderr, "trace: %s\n", strerror(errno));
+			t->failed = true;
+		}
+		t->full = -1;
+		pthread_cond_broadcast(&t->cond);
+	}
+	pthread_mutex_unlock(&t->lock);
+	return NULL;
+}
+
+/* hands the filled buffer to the writer, waits while it still writes the
+ * other one */
+static void swap_buffers(lc3_trace* t) {
+	pthread_mutex_lock(&t->lock);
+	while (t->full >= 0) {
+		pthread_cond_wait(&t->cond, &t->lock);
+	}
+	t->full = t->fill;
+	t->full_len = t->used;
+	pthread_cond_broadcast(&t->cond);
+	pthread_mutex_unlock(&t->lock);
+	t->fill ^= 1;
+	t->used = 0;
+}
+
+bool lc3_trace_start(lc3_vm* vm, const char* path) {
+	lc3_trace* t = calloc(1, sizeof(lc3_trace));
+	if (!t) {
+		return false;
+	}
+	t->file = fopen(path, "wb");
+	t->bufs[0] = malloc(TRACE_BUF_SIZE);
+	t->bufs[1] = malloc(TRACE_BUF_SIZE);
+	t->packed = malloc(LZ_BOUND(TRACE_BUF_SIZE));
+	if (!t->file || !t->bufs[0] || !t->bufs[1] || !t->packed) {
+		if (!t->file) {
+			fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		}
+		goto fail;
+	}
+
+	lc3_sync_flags(vm);
+	trace_header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, TRACE_MAGIC, sizeof(h.magic));
+	h.version = TRACE_VERSION;
+	memcpy(h.registers, vm->registers, sizeof(h.registers));
+	h.retired = vm->retired;
+	if (fwrite(&h, sizeof(h), 1, t->file) != 1) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		goto fail;
+	}
+	memcpy(t->registers, vm->registers, sizeof(t->registers));
+
+	t->full = -1;
+	pthread_mutex_init(&t->lock, NULL);
+	pthread_cond_init(&t->cond, NULL);
+	if (pthread_create(&t->thread, NULL, writer, t) != 0) {
+		pthread_cond_destroy(&t->cond);
+		pthread_mutex_destroy(&t->lock);
+		goto fail;
+	}
+	if (vm->trace) {
+		trace_destroy(vm->trace);
+	}
+	vm->trace = t;
+	return true;
+
+fail:
+	if (t->file) {
+		fclose(t->file);
+	}
+	free(t->bufs[0]);
+	free(t->bufs[1]);
+	free(t->packed);
+	free(t);
+	return false;
+}
+
+static void record(lc3_trace* t, lc3_vm* vm, uint16_t pc, uint16_t word, int store) {
+	uint8_t* start = t->bufs[t->fill] + t->used;
+	uint8_t* p = start + 1;
+	uint8_t flags = 0;
+
+	if (!(t->seen[pc >> 3] & (1 << (pc & 7))) || t->words[pc] != word) {
+		t->seen[pc >> 3] |= 1 << (pc & 7);
+		t->words[pc] = word;
+		flags |= T_WORD;
+		put16(&p, word);
+	}
+
+	unsigned mask = 0;
+	int r;
+	for (r = R_0; r <= R_7; r++) {
+		mask |= (vm->registers[r] != t->registers[r]) << r;
+	}
+	if (mask) {
+		flags |= T_REGS;
+		*p++ = mask;
+		for (r = R_0; r <= R_7; r++) {
+			if (mask & (1 << r)) {
+				put16(&p, vm->registers[r] - t->registers[r]);
+			}
+		}
+	}
+	if (vm->registers[R_COND] != t->registers[R_COND]) {
+		flags |= T_COND;
+		*p++ = vm->registers[R_COND];
+	}
+	if (vm->registers[R_PC] != (uint16_t) (pc + 1)) {
+		flags |= T_JUMP;
+		put16(&p, vm->registers[R_PC] - (uint16_t) (pc + 1));
+	}
+	if (store >= 0) {
+		flags |= T_STORE;
+		put16(&p, store);
+		put16(&p, vm->memory[store]);
+	}
+
+	*start = flags;
+	t->used += p - start;
+	memcpy(t->registers, vm->registers, sizeof(t->registers));
+	if (t->used > TRACE_BUF_SIZE - TRACE_MAX_RECORD) {
+		swap_buffers(t);
+	}
+}
+
+void lc3_run_traced(lc3_vm* vm) {
+	lc3_trace* t = vm->trace;
+	if (!t) {
+		lc3_run(vm);
+		return;
+	}
+
+	while (vm->running && vm->retired < vm->stop_at) {
+		uint16_t pc = vm->registers[R_PC];
+		uint16_t word = vm->memory[pc];
+
+		/* stores do not change registers, the address is known up front */
+		int store = -1;
+		switch (word >> 12) {
+			case OP_ST:
+			case OP_STR:
+			case OP_STI: {
+				lc3_decoded d;
+				lc3_decode(word, &d);
+				if (d.handler == D_STR) {
+					store = (uint16_t) (vm->registers[d.src1] + d.imm);
+				} else {
+					store = (uint16_t) (pc + 1 + d.imm);
+					if (d.handler == D_STI) {
+						store = vm->memory[store];
+					}
+				}
+				break;
+			}
+		}
+
+		uint64_t retired = ++vm->retired;
+		vm->registers[R_PC]++;
+		lc3_execute(vm, &vm->decoded[pc]);
+		lc3_sync_flags(vm);
+		/* a breakpoint takes its instruction back */
+		if (vm->retired == retired) {
+			record(t, vm, pc, word, store);
+		}
+	}
+	lc3_check_budget(vm);
+}
+
+/* lets the writer finish the block it has, false if anything was lost */
+static bool trace_close(lc3_trace* t) {
+	pthread_mutex_lock(&t->lock);
+	t->stop = true;
+	pthread_cond_broadcast(&t->cond);
+	pthread_mutex_unlock(&t->lock);
+	pthread_join(t->thread, NULL);
+
+	bool ok = !t->failed;
+	if (fclose(t->file) != 0 && ok) {
+		fprintf(stderr, "trace: %s\n", strerror(errno));
+		ok = false;
+	}
+	pthread_cond_destroy(&t->cond);
+	pthread_mutex_destroy(&t->lock);
+	free(t->bufs[0]);
+	free(t->bufs[1]);
+	free(t->packed);
+	free(t);
+	return ok;
+}
+
+bool lc3_trace_stop(lc3_vm* vm) {
+	lc3_trace* t = vm->trace;
+	if (!t) {
+		return true;
+	}
+	if (t->used > 0) {
+		swap_buffers(t);
+	}
+	vm->trace = NULL;
+	return trace_close(t);
+}
+
+void trace_destroy(lc3_trace* t) {
+	trace_close(t);
+}
+
+/* Decoder */
+
+static const char* const op_names[16] = {
+	"BR", "ADD", "LD", "ST", "JSR", "AND", "LDR", "STR",
+	"RTI", "NOT", "LDI", "STI", "JMP", "RES", "LEA", "TRAP"
+};
+
+/* one record of raw at *pos, false if it is cut short */
+static bool dump_record(const uint8_t* raw, size_t len, size_t* pos, uint16_t* regs,
+		uint16_t* words, uint64_t n, FILE* out) {
+	const uint8_t* p = raw + *pos;
+	const uint8_t* end = raw + len;
+	uint8_t flags = *p++;
+	uint16_t pc = regs[R_PC];
+	int i;
+
+	if (flags & T_WORD) {
+		if (end - p < 2) {
+			return false;
+		}
+		words[pc] = get16(&p);
+	}
+	uint16_t word = words[pc];
+	fprintf(out, "%llu x%04X x%04X %-4s", (unsigned long long) n, pc, word, op_names[word >> 12]);
+
+	if (flags & T_REGS) {
+		if (p == end) {
+			return false;
+		}
+		uint8_t mask = *p++;
+		for (i = R_0; i <= R_7; i++) {
+			if (mask & (1 << i)) {
+				if (end - p < 2) {
+					return false;
+				}
+				regs[i] += get16(&p);
+				fprintf(out, " R%d=x%04X", i, regs[i]);
+			}
+		}
+	}
+	if (flags & T_COND) {
+		if (p == end) {
+			return false;
+		}
+		regs[R_COND] = *p++;
+		fprintf(out, " cc=%c", regs[R_COND] & FL_NEG ? 'n' : regs[R_COND] & FL_ZRO ? 'z' : 'p');
+	}
+	regs[R_PC] = pc + 1;
+	if (flags & T_JUMP) {
+		if (end - p < 2) {
+			return false;
+		}
+		regs[R_PC] += get16(&p);
+		fprintf(out, " pc=x%04X", regs[R_PC]);
+	}
+	if (flags & T_STORE) {
+		if (end - p < 4) {
+			return false;
+		}
+		uint16_t addr = get16(&p);
+		uint16_t val = get16(&p);
+		fprintf(out, " [x%04X]=x%04X", addr, val);
+	}
+	fputc('\n', out);
+	*pos = p - raw;
+	return true;
+}
+
+bool lc3_trace_dump(FILE* in, FILE* out) {
+	trace_header h;
+	if (fread(&h, sizeof(h), 1, in) != 1 || memcmp(h.magic, TRACE_MAGIC, sizeof(h.magic)) != 0 ||
+			h.version != TRACE_VERSION) {
+		fprintf(stderr, "trace: not a trace file\n");
+		return false;
+	}
+	uint16_t regs[R_COUNT];
+	memcpy(regs, h.registers, sizeof(regs));
+	uint16_t* words = calloc(MEMORY_SIZE, sizeof(uint16_t));
+	uint8_t* raw = malloc(TRACE_BUF_SIZE);
+	uint8_t* packed = malloc(LZ_BOUND(TRACE_BUF_SIZE));
+	bool ok = words && raw && packed;
+	uint64_t n = h.retired;
+
+	uint32_t sizes[2];
+	while (ok && fread(sizes, sizeof(sizes), 1, in) == 1) {
+		if (sizes[0] > TRACE_BUF_SIZE || sizes[1] > LZ_BOUND(TRACE_BUF_SIZE) ||
+				fread(packed, sizes[1], 1, in) != 1 ||
+				!lz_decompress(packed, sizes[1], raw, sizes[0])) {
+			fprintf(stderr, "trace: block after instruction %llu is damaged\n", (unsigned long long) n);
+			ok = false;
+			break;
+		}
+		size_t pos = 0;
+		while (pos < sizes[0]) {
+			if (!dump_record(raw, sizes[0], &pos, regs, words, ++n, out)) {
+				fprintf(stderr, "trace: record %llu is cut short\n", (unsigned long long) n);
+				ok = false;
+				break;
+			}
+		}
+	}
+	free(words);
+	free(raw);
+	free(packed);
+	return ok;
+}
@@ -0,0 +1,28 @@
+#include "lc3.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Prints a trace written by lc3 -t, one instruction per line:
+ * index pc word opcode, then the registers, flags, pc and memory word the
+ * instruction changed */
+int main(int argc, char** argv) {
+	if (argc > 2) {
+		fprintf(stderr, "usage: %s [trace]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	FILE* in = stdin;
+	if (argc == 2 && strcmp(argv[1], "-") != 0) {
+		in = fopen(argv[1], "rb");
+		if (!in) {
+			perror(argv[1]);
+			return EXIT_FAILURE;
+		}
+	}
+	bool ok = lc3_trace_dump(in, stdout);
+	if (in != stdin) {
+		fclose(in);
+	}
+	return ok ? 0 : EXIT_FAILURE;
+}
@@ -0,0 +1,52 @@
+#include "lc3.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Translates images to a C program, see lc3_aot(). The code is found
+ * from pc 0, where lc3 starts the guest. Build the output with
+ *   gcc -O2 -I. out.c $(CORE) -lpthread */
+int main(int argc, char** argv) {
+	const char* path = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "o:")) != -1) {
+		if (opt != 'o') {
+			break;
+		}
+		path = optarg;
+	}
+	if (opt != -1 || optind >= argc) {
+		fprintf(stderr, "usage: %s [-o out.c] image...\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	lc3_vm* vm = lc3_vm_create();
+	if (!vm) {
+		fprintf(stderr, "Out of memory\n");
+		return EXIT_FAILURE;
+	}
+	if (!lc3_load_images(vm, argv + optind, argc - optind)) {
+		fprintf(stderr, "failed to load image files\n");
+		lc3_vm_destroy(vm);
+		return EXIT_FAILURE;
+	}
+	FILE* out = stdout;
+	if (path && strcmp(path, "-") != 0) {
+		out = fopen(path, "w");
+		if (!out) {
+			perror(path);
+			lc3_vm_destroy(vm);
+			return EXIT_FAILURE;
+		}
+	}
+	bool ok = lc3_aot(vm, out);
+	if (out != stdout && fclose(out) != 0) {
+		ok = false;
+	}
+	if (!ok) {
+		fprintf(stderr, "translation failed\n");
+	}
+	lc3_vm_destroy(vm);
+	return ok ? 0 : EXIT_FAILURE;
+}
@@ -0,0 +1,377 @@
+#include "lc3.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <getopt.h>
+
+#include <sys/termios.h>
+
+/* Unix stuff */
+struct termios original_tio;
+
+void disable_input_buffering() {
+    tcgetattr(STDIN_FILENO, &original_tio);
+    struct termios new_tio = original_tio;
+    new_tio.c_lflag &= ~ICANON & ~ECHO;
+    tcsetattr(STDIN_FILENO, TCSANOW, &new_tio);
+}
+
+void restore_input_buffering() {
+    tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
+}
+
+void handle_interrupt(int signal) {
+    restore_input_buffering();
+    printf("\n");
+    exit(-2);
+}
+
+/* exit status of a guest stopped by its instruction budget, as timeout(1) */
+#define EXIT_BUDGET 124
+
+void usage(const char* prog) {
+	fprintf(stderr, "usage: %s [-e loop|threaded|jit] [-o unbuffered|line|full] [-l budget]\n"
+			"          [-s snapshot [-p pc]] [-r snapshot]\n"
+			"          [-k log [-n interval] [--rollback seq|last]]\n"
+			"          [-P report] [--folded stacks] [-S report [--sample-hz n]]\n"
+			"          [--stats file] [-t trace] [--record-input log | --replay-input log]\n"
+			"          image...\n"
+			"       %s [-e engine|lockstep] [-j threads] [-l budget] -b manifest\n"
+			"       %s [-l budget] --fuzz dir [--fuzz-execs n] image...\n", prog, prog, prog);
+	exit(EXIT_FAILURE);
+}
+
+bool write_profile(lc3_vm* vm, const char* path, bool (*write)(lc3_vm*, FILE*)) {
+	FILE* file = strcmp(path, "-") == 0 ? stderr : fopen(path, "w");
+	if (!file) {
+		perror(path);
+		return false;
+	}
+	bool ok = write(vm, file);
+	if (file != stderr) {
+		fclose(file);
+	}
+	return ok;
+}
+
+bool sample_report(lc3_vm* vm, FILE* out) {
+	return lc3_sampler_report(out);
+}
+
+int main(int argc, char** argv) {
+	static const struct option long_opts[] = {
+		{ "engine", required_argument, NULL, 'e' },
+		{ "batch", required_argument, NULL, 'b' },
+		{ "jobs", required_argument, NULL, 'j' },
+		{ "output", required_argument, NULL, 'o' },
+		{ "save", required_argument, NULL, 's' },
+		{ "save-pc", required_argument, NULL, 'p' },
+		{ "restore", required_argument, NULL, 'r' },
+		{ "checkpoint", required_argument, NULL, 'k' },
+		{ "interval", required_argument, NULL, 'n' },
+		{ "rollback", required_argument, NULL, 'R' },
+		{ "profile", required_argument, NULL, 'P' },
+		{ "folded", required_argument, NULL, 'F' },
+		{ "sample", required_argument, NULL, 'S' },
+		{ "sample-hz", required_argument, NULL, 'H' },
+		{ "stats", required_argument, NULL, 'T' },
+		{ "limit", required_argument, NULL, 'l' },
+		{ "trace", required_argument, NULL, 't' },
+		{ "record-input", required_argument, NULL, 'I' },
+		{ "replay-input", required_argument, NULL, 'Y' },
+		{ "fuzz", required_argument, NULL, 'z' },
+		{ "fuzz-execs", required_argument, NULL, 'Z' },
+		{ NULL, 0, NULL, 0 }
+	};
+	void (*run)(lc3_vm*) = lc3_run;
+	const char* manifest = NULL;
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int policy = -1;
+	const char* save = NULL;
+	const char* restore = NULL;
+	long save_pc = -1;
+	const char* checkpoint = NULL;
+	uint64_t interval = 10000000;
+	const char* rollback = NULL;
+	const char* report = NULL;
+	const char* folded = NULL;
+	const char* sampled = NULL;
+	int sample_hz = 1000;
+	const char* stats = NULL;
+	FILE* stats_file = NULL;
+	uint64_t budget = UINT64_MAX;
+	const char* trace = NULL;
+	bool lockstep = false;
+	const char* fuzz = NULL;
+	uint64_t fuzz_execs = 0;
+	const char* record_input = NULL;
+	const char* replay_input = NULL;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "e:b:j:o:s:p:r:k:n:R:P:F:S:H:T:l:t:I:Y:z:Z:", long_opts, NULL)) != -1) {
+		switch (opt) {
+			case 'e':
+				if (strcmp(optarg, "loop") == 0) {
+					run = lc3_run;
+				} else if (strcmp(optarg, "threaded") == 0) {
+					run = lc3_run_threaded;
+				} else if (strcmp(optarg, "jit") == 0) {
+					run = lc3_run_jit;
+				} else if (strcmp(optarg, "lockstep") == 0) {
+					lockstep = true;
+				} else {
+					fprintf(stderr, "Unknown engine: %s\n", optarg);
+					usage(argv[0]);
+				}
+				break;
+			case 'b':
+				manifest = optarg;
+				break;
+			case 'j':
+				threads = atoi(optarg);
+				break;
+			case 'o':
+				if (strcmp(optarg, "unbuffered") == 0) {
+					policy = OUT_UNBUFFERED;
+				} else if (strcmp(optarg, "line") == 0) {
+					policy = OUT_LINE;
+				} else if (strcmp(optarg, "full") == 0) {
+					policy = OUT_FULL;
+				} else {
+					fprintf(stderr, "Unknown output policy: %s\n", optarg);
+					usage(argv[0]);
+				}
+				break;
+			case 's':
+				save = optarg;
+				break;
+			case 'p':
+				/* x3000 as in LC-3 assembly, or anything strtol takes */
+				save_pc = strtol(optarg + (optarg[0] == 'x'), NULL, optarg[0] == 'x' ? 16 : 0);
+				if (save_pc < 0 || save_pc > UINT16_T_MAX) {
+					fprintf(stderr, "Bad pc: %s\n", optarg);
+					usage(argv[0]);
+				}
+				break;
+			case 'r':
+				restore = optarg;
+				break;
+			case 'k':
+				checkpoint = optarg;
+				break;
+			case 'n':
+				interval = strtoull(optarg, NULL, 0);
+				if (interval == 0) {
+					fprintf(stderr, "Bad interval: %s\n", optarg);
+					usage(argv[0]);
+				}
+				break;
+			case 'R':
+				rollback = optarg;
+				break;
+			case 'P':
+				report = optarg;
+				break;
+			case 'F':
+				folded = optarg;
+				break;
+			case 'S':
+				sampled = optarg;
+				break;
+			case 'H':
+				sample_hz = atoi(optarg);
+				if (sample_hz < 1 || sample_hz > 10000) {
+					fprintf(stderr, "Bad sample rate: %s\n", optarg);
+					usage(argv[0]);
+				}
+				break;
+			case 'T':
+				stats = optarg;
+				break;
+			case 't':
+				trace = optarg;
+				break;
+			case 'I':
+				record_input = optarg;
+				break;
+			case 'Y':
+				replay_input = optarg;
+				break;
+			case 'z':
+				fuzz = optarg;
+				break;
+			case 'Z':
+				fuzz_execs = strtoull(optarg, NULL, 0);
+				break;
+			case 'l':
+				budget = strtoull(optarg, NULL, 0);
+				if (budget == 0) {
+					fprintf(stderr, "Bad budget: %s\n", optarg);
+					usage(argv[0]);
+				}
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	if (manifest) {
+		int failed = lc3_batch(manifest, threads, run, lockstep, budget);
+		return failed == 0 ? 0 : EXIT_FAILURE;
+	}
+
+	if (fuzz) {
+		if (optind >= argc) {
+			fprintf(stderr, "Need executable\n");
+			exit(EXIT_FAILURE);
+		}
+		int found = lc3_fuzz(argv + optind, argc - optind, fuzz, budget, fuzz_execs);
+		return found == 0 ? 0 : EXIT_FAILURE;
+	}
+	if (lockstep) {
+		fprintf(stderr, "The lockstep engine only runs manifests\n");
+		usage(argv[0]);
+	}
+	if (rollback && !checkpoint) {
+		fprintf(stderr, "--rollback needs a checkpoint log\n");
+		usage(argv[0]);
+	}
+	if (record_input && replay_input) {
+		fprintf(stderr, "Cannot record and replay input at once\n");
+		usage(argv[0]);
+	}
+	if (trace && (report || folded)) {
+		fprintf(stderr, "Cannot trace and profile at once\n");
+		usage(argv[0]);
+	}
+	if (report || folded) {
+		run = lc3_run_profiled; /* whatever -e said */
+	}
+	if (trace) {
+		run = lc3_run_traced;
+	}
+	if (optind >= argc && !restore && !rollback) {
+		fprintf(stderr, "Need executable\n");
+		exit(EXIT_FAILURE);
+	}
+
+	lc3_vm* vm = lc3_vm_create();
+	if (!vm) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	/* JSON on exit, and whenever SIGUSR1 asks while the guest runs */
+	if (stats) {
+		stats_file = strcmp(stats, "-") == 0 ? stderr : fopen(stats, "w");
+		if (!stats_file) {
+			perror(stats);
+			exit(EXIT_FAILURE);
+		}
+		lc3_stats_on_signal(vm, SIGUSR1, stats_file);
+	}
+	if (policy >= 0) {
+		vm->out.policy = policy;
+	}
+	/* the profiler and tracer see every instruction, the JIT has its own */
+	vm->fuse = run == lc3_run || run == lc3_run_threaded;
+
+	if (restore) {
+		if (!lc3_snapshot_restore(vm, restore)) {
+			exit(EXIT_FAILURE);
+		}
+		vm->running = true; /* a snapshot taken at HALT resumes after it */
+		vm->fault = LC3_OK;   /* and one that ran out of budget gets a new one */
+	}
+	if (rollback) {
+		long seq = strcmp(rollback, "last") == 0 ? -1 : strtol(rollback, NULL, 0);
+		if (lc3_rollback(vm, checkpoint, seq) < 0) {
+			exit(EXIT_FAILURE);
+		}
+		vm->running = true;
+		vm->fault = LC3_OK;
+	}
+	if (!lc3_load_images(vm, argv + optind, argc - optind)) {
+		printf("failed to load image files\n");
+		exit(EXIT_FAILURE);
+	}
+	if (save_pc >= 0) {
+		lc3_break_at(vm, save_pc);
+	}
+	lc3_set_budget(vm, budget); /* counted from the restored state on */
+	if (trace && !lc3_trace_start(vm, trace)) {
+		exit(EXIT_FAILURE);
+	}
+	if (record_input && !lc3_record_input(vm, record_input)) {
+		exit(EXIT_FAILURE);
+	}
+	if (replay_input && !lc3_replay_input(vm, replay_input)) {
+		exit(EXIT_FAILURE);
+	}
+
+	signal(SIGINT, handle_interrupt);
+	disable_input_buffering();
+
+	if (sampled && !lc3_sampler_start(vm, sample_hz)) {
+		sampled = NULL;
+	}
+
+	if (checkpoint) {
+		FILE* log = fopen(checkpoint, "ab");
+		if (!log) {
+			restore_input_buffering();
+			perror(checkpoint);
+			exit(EXIT_FAILURE);
+		}
+		lc3_run_checkpointed(vm, run, log, interval);
+		fclose(log);
+	} else {
+		run(vm);
+	}
+
+	restore_input_buffering();
+
+	if (sampled) {
+		lc3_sampler_stop();
+	}
+
+	int status = vm->fault == LC3_OK ? 0 : EXIT_FAILURE;
+	if (trace && !lc3_trace_stop(vm)) {
+		status = EXIT_FAILURE;
+	}
+	if (vm->fault == LC3_BUDGET) {
+		fprintf(stderr, "instruction budget exceeded after %llu instructions\n",
+				(unsigned long long) vm->retired);
+		dump_registers(vm);
+		status = EXIT_BUDGET;
+	}
+
+	if (report && !write_profile(vm, report, lc3_profile_report)) {
+		status = EXIT_FAILURE;
+	}
+	if (folded && !write_profile(vm, folded, lc3_profile_folded)) {
+		status = EXIT_FAILURE;
+	}
+	if (sampled && !write_profile(vm, sampled, sample_report)) {
+		status = EXIT_FAILURE;
+	}
+	if (stats_file) {
+		lc3_stats_stop_signal();
+		lc3_stats_json(vm, stats_file);
+		if (stats_file != stderr) {
+			fclose(stats_file);
+		}
+	}
+
+	/* at save_pc, or wherever the guest stopped if it never got there */
+	if (save && status == 0 && !lc3_snapshot_save(vm, save)) {
+		status = EXIT_FAILURE;
+	}
+	lc3_vm_destroy(vm);
+
+	return status;
+}